@@ -1,15 +1,29 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
 #include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <cerrno>
 #include <cinttypes>
 
 #include <iconv.h>
 
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <linux/fs.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #include "utils.h"
 
@@ -21,12 +35,25 @@ namespace file {
             S_IRUSR|S_IWUSR|S_IRGRP);
     }
 
-    int open_file_ro(const std::string& file_path) {
-        return ::open(file_path.c_str(), O_RDONLY | O_LARGEFILE);
+    static int open_file_flags(const std::string& file_path, int flags, bool direct) {
+        if (direct) {
+            int fd = ::open(file_path.c_str(), flags | O_DIRECT);
+            if (fd >= 0 || errno != EINVAL) {
+                return fd;
+            }
+            /* file system without O_DIRECT support, page cache it is */
+            printf("%s: O_DIRECT is not supported, open with page cache\n", file_path.c_str());
+        }
+
+        return ::open(file_path.c_str(), flags);
+    }
+
+    int open_file_ro(const std::string& file_path, bool direct/* = false*/) {
+        return open_file_flags(file_path, O_RDONLY | O_LARGEFILE, direct);
     }
 
-    int open_file_rw(const std::string& file_path) {
-        return ::open(file_path.c_str(), O_RDWR | O_LARGEFILE);
+    int open_file_rw(const std::string& file_path, bool direct/* = false*/) {
+        return open_file_flags(file_path, O_RDWR | O_LARGEFILE, direct);
     }
     // int seek_file_li(int fd, LARGE_INTEGER offset, int whence) {
     //     return seek_file(fd, offset.QuadPart, whence);
@@ -104,21 +131,381 @@ namespace file {
         return write_file(fd, buf, size);
     }
 
+    static int do_pread(int fd, off64_t offset, void* buf, size_t size) {
+        uint8_t* p = reinterpret_cast<uint8_t*>(buf);
+        size_t done = 0;
+
+        while (done < size) {
+            ssize_t ret = ::pread64(fd, p + done, size - done, offset + done);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -errno;
+            }
+            /* end of file, same as read_file: a short read is valid, nothing read is not */
+            if (ret == 0) {
+                return (done > 0 ? 0 : -EIO);
+            }
+            done += ret;
+        }
+
+        return 0;
+    }
+
+    static int do_pwrite(int fd, off64_t offset, const void* buf, size_t size) {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(buf);
+        size_t done = 0;
+
+        while (done < size) {
+            ssize_t ret = ::pwrite64(fd, p + done, size - done, offset + done);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -errno;
+            }
+            if (ret == 0) {
+                return -EIO;
+            }
+            done += ret;
+        }
+
+        return 0;
+    }
+
+    static int do_vectored(int fd, off64_t offset, const struct iovec* iov, int iovcnt, bool is_write) {
+        int i = 0;
+        bool any_done = false;
+
+        while (i < iovcnt) {
+            int cnt = std::min(iovcnt - i, IOV_MAX);
+            ssize_t ret = is_write ? ::pwritev64(fd, iov + i, cnt, offset) : ::preadv64(fd, iov + i, cnt, offset);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -errno;
+            }
+
+            size_t done = ret;
+            offset += ret;
+            while (i < iovcnt && done >= iov[i].iov_len) {
+                done -= iov[i].iov_len;
+                ++i;
+            }
+
+            if (ret == 0 && i < iovcnt) {
+                /* end of file, same as pread_file */
+                return (is_write || !any_done) ? -EIO : 0;
+            }
+            any_done = true;
+
+            /* short transfer stopped in the middle of an iovec, finish that one by itself */
+            if (done > 0) {
+                uint8_t* p = reinterpret_cast<uint8_t*>(iov[i].iov_base) + done;
+                size_t left = iov[i].iov_len - done;
+                int r = is_write ? do_pwrite(fd, offset, p, left) : do_pread(fd, offset, p, left);
+                if (r) {
+                    return r;
+                }
+                offset += left;
+                ++i;
+            }
+        }
+
+        return 0;
+    }
+
+    /*
+     O_DIRECT bounce buffers. Buffers are aligned to kDirectIoAlignment and
+     kept for reuse, so unaligned requests do not pay for an allocation each time
+     */
+    class AlignedBufferPool {
+    public:
+        static AlignedBufferPool& instance() {
+            static AlignedBufferPool pool;
+            return pool;
+        }
+
+        ~AlignedBufferPool() {
+            for (const auto& b : free_) {
+                ::free(b.second);
+            }
+        }
+
+        void* acquire(size_t size) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (size_t i = 0; i < free_.size(); ++i) {
+                    if (free_[i].first == size) {
+                        void* p = free_[i].second;
+                        free_[i] = free_.back();
+                        free_.pop_back();
+                        return p;
+                    }
+                }
+            }
+
+            void* p = nullptr;
+            if (::posix_memalign(&p, kDirectIoAlignment, size) != 0) {
+                return nullptr;
+            }
+            return p;
+        }
+
+        void release(void* p, size_t size) {
+            if (size <= kMaxCachedSize) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (free_.size() < kMaxCached) {
+                    free_.emplace_back(size, p);
+                    return;
+                }
+            }
+            ::free(p);
+        }
+
+    private:
+        static const size_t kMaxCached = 16;
+        static const size_t kMaxCachedSize = 4 * kMiB;
+
+        std::mutex mutex_;
+        std::vector<std::pair<size_t, void*>> free_;
+    };
+
+    static bool is_direct_fd(int fd) {
+        int flags = ::fcntl(fd, F_GETFL);
+        return (flags != -1 && (flags & O_DIRECT) != 0);
+    }
+
+    /*
+     offset, length or memory of the request is not aligned for O_DIRECT,
+     transfer the covering aligned range through a bounce buffer.
+     Partial head/tail blocks of a write are read first (read-modify-write),
+     and a write at the end of file does not leave the padding behind.
+     */
+    static int direct_vectored(int fd, off64_t offset, const struct iovec* iov, int iovcnt, bool is_write) {
+        size_t size = iov::total_size(iov, iovcnt);
+        off64_t start = convert::roundDown(offset, kDirectIoAlignment);
+        off64_t end = convert::roundUp(offset + size, kDirectIoAlignment);
+        size_t len = end - start;
+        size_t head = offset - start;
+        off64_t tail_start = 0;
+        int64_t file_size = 0;
+        int ret = 0;
+
+        uint8_t* bounce = reinterpret_cast<uint8_t*>(AlignedBufferPool::instance().acquire(len));
+        if (bounce == nullptr) {
+            return -ENOMEM;
+        }
+        /* whatever is past end of file reads as zero */
+        memset(bounce, 0, len);
+
+        if (!is_write) {
+            ret = do_pread(fd, start, bounce, len);
+            if (ret == 0) {
+                uint8_t* p = bounce + head;
+                for (int i = 0; i < iovcnt; ++i) {
+                    memcpy(iov[i].iov_base, p, iov[i].iov_len);
+                    p += iov[i].iov_len;
+                }
+            }
+            goto out;
+        }
+
+        ret = get_file_sizes(fd, &file_size);
+        if (ret) {
+            goto out;
+        }
+
+        if (head != 0 && start < file_size) {
+            ret = do_pread(fd, start, bounce, kDirectIoAlignment);
+            if (ret) {
+                goto out;
+            }
+        }
+        tail_start = end - kDirectIoAlignment;
+        if (static_cast<off64_t>(offset + size) != end && tail_start < file_size &&
+                !(tail_start == start && head != 0)) {
+            ret = do_pread(fd, tail_start, bounce + len - kDirectIoAlignment, kDirectIoAlignment);
+            if (ret) {
+                goto out;
+            }
+        }
+
+        {
+            uint8_t* p = bounce + head;
+            for (int i = 0; i < iovcnt; ++i) {
+                memcpy(p, iov[i].iov_base, iov[i].iov_len);
+                p += iov[i].iov_len;
+            }
+        }
+
+        ret = do_pwrite(fd, start, bounce, len);
+        if (ret == 0 && end > file_size && static_cast<int64_t>(offset + size) < end) {
+            ret = truncate_file(fd, std::max<int64_t>(file_size, offset + size));
+        }
+
+    out:
+        AlignedBufferPool::instance().release(bounce, len);
+        return ret;
+    }
+
+    int pread_file(int fd, off64_t offset, void* buf, size_t size) {
+        int ret = do_pread(fd, offset, buf, size);
+        if (ret == -EINVAL && is_direct_fd(fd)) {
+            struct iovec iov;
+            iov.iov_base = buf;
+            iov.iov_len = size;
+            ret = direct_vectored(fd, offset, &iov, 1, false);
+        }
+
+        return ret;
+    }
+
+    int pwrite_file(int fd, off64_t offset, const void* buf, size_t size) {
+        int ret = do_pwrite(fd, offset, buf, size);
+        if (ret == -EINVAL && is_direct_fd(fd)) {
+            struct iovec iov;
+            iov.iov_base = const_cast<void*>(buf);
+            iov.iov_len = size;
+            ret = direct_vectored(fd, offset, &iov, 1, true);
+        }
+        if (ret) {
+            printf("%d: pwrite of %zu at %" PRId64 " failed, errno: %d\n",
+                fd, size, static_cast<int64_t>(offset), ret);
+        }
+
+        return ret;
+    }
+
+    int preadv_file(int fd, off64_t offset, const struct iovec* iov, int iovcnt) {
+        int ret = do_vectored(fd, offset, iov, iovcnt, false);
+        if (ret == -EINVAL && is_direct_fd(fd)) {
+            ret = direct_vectored(fd, offset, iov, iovcnt, false);
+        }
+
+        return ret;
+    }
+
+    int pwritev_file(int fd, off64_t offset, const struct iovec* iov, int iovcnt) {
+        int ret = do_vectored(fd, offset, iov, iovcnt, true);
+        if (ret == -EINVAL && is_direct_fd(fd)) {
+            ret = direct_vectored(fd, offset, iov, iovcnt, true);
+        }
+        if (ret) {
+            printf("%d: pwritev of %d iovecs at %" PRId64 " failed, errno: %d\n",
+                fd, iovcnt, static_cast<int64_t>(offset), ret);
+        }
+
+        return ret;
+    }
+
+    MappedFile::MappedFile() 
+        : addr_(nullptr), 
+          size_(0) {
+    }
+
+    MappedFile::~MappedFile() {
+        unmap();
+    }
+
+    int MappedFile::map(int fd) {
+        int64_t file_size = 0;
+
+        unmap();
+
+        int ret = get_file_sizes(fd, &file_size);
+        if (ret) {
+            return ret;
+        }
+        if (file_size == 0) {
+            return -EINVAL;
+        }
+
+        void* addr = ::mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            return -errno;
+        }
+
+        addr_ = reinterpret_cast<uint8_t*>(addr);
+        size_ = file_size;
+        return 0;
+    }
+
+    void MappedFile::unmap() {
+        if (addr_) {
+            ::munmap(addr_, size_);
+            addr_ = nullptr;
+            size_ = 0;
+        }
+    }
+
+    int MappedFile::advise(AccessHint hint) {
+        int advice = MADV_NORMAL;
+        if (hint == AccessHint::kSequential) {
+            advice = MADV_SEQUENTIAL;
+        } else if (hint == AccessHint::kRandom) {
+            advice = MADV_RANDOM;
+        }
+
+        if (addr_ == nullptr) {
+            return -EINVAL;
+        }
+        return (::madvise(addr_, size_, advice) == 0 ? 0 : -errno);
+    }
+
+    int MappedFile::prefetch(off64_t offset, size_t size) const {
+        if (addr_ == nullptr || offset < 0 || static_cast<uint64_t>(offset) >= size_) {
+            return -EINVAL;
+        }
+
+        /* madvise wants a page aligned start */
+        uint64_t page_size = sysconf(_SC_PAGESIZE);
+        uint64_t start = offset & ~(page_size - 1);
+        uint64_t end = std::min<uint64_t>(offset + size, size_);
+        return (::madvise(addr_ + start, end - start, MADV_WILLNEED) == 0 ? 0 : -errno);
+    }
+
+    int MappedFile::read(off64_t offset, void* buf, size_t size) const {
+        struct iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len = size;
+        return readv(offset, &iov, 1);
+    }
+
+    int MappedFile::readv(off64_t offset, const struct iovec* iov, int iovcnt) const {
+        if (offset < 0 || static_cast<uint64_t>(offset) >= size_) {
+            return -EIO;
+        }
+
+        const uint8_t* p = addr_ + offset;
+        size_t left = size_ - offset;
+        for (int i = 0; i < iovcnt && left > 0; ++i) {
+            size_t n = std::min(iov[i].iov_len, left);
+            memcpy(iov[i].iov_base, p, n);
+            p += n;
+            left -= n;
+        }
+
+        return 0;
+    }
+
     // int get_file_sizes_li(int fd, LARGE_INTEGER* pos) {
     //     return get_file_sizes(fd, reinterpret_cast<off64_t*>(&pos->QuadPart));
     // }
 
     int get_file_sizes(int fd, off64_t* pos) {
-        off64_t off;
+        struct stat64 st;
 
-        off = lseek64(fd, 0, SEEK_END);
-        if (off == (off64_t)-1) {
-            printf("%d: seek SEEK_END failed: %d\n",
+        /* fstat instead of lseek(SEEK_END), the shared file offset is left untouched */
+        if (::fstat64(fd, &st) != 0) {
+            printf("%d: fstat failed: %d\n",
                 fd, -errno);
             return -errno;
         }
 
-        *pos = off;
+        *pos = st.st_size;
         return 0;
     }
 
@@ -150,6 +537,273 @@ namespace file {
         return ret;
     }
 
+    static bool fallocate_unsupported(int err) {
+        return (err == EOPNOTSUPP || err == ENOSYS || err == EINVAL);
+    }
+
+    int allocate_file(int fd, off64_t offset, off64_t len) {
+        int64_t size;
+        int ret;
+
+        if (::fallocate64(fd, 0, offset, len) == 0) {
+            return 0;
+        }
+        if (!fallocate_unsupported(errno)) {
+            return -errno;
+        }
+
+        /* no preallocation, at least make the range part of the file */
+        ret = get_file_sizes(fd, &size);
+        if (ret == 0 && offset + len > size) {
+            ret = truncate_file(fd, offset + len);
+        }
+        return ret;
+    }
+
+    int zero_file_range(int fd, off64_t offset, off64_t len) {
+        int64_t size;
+        int ret;
+
+#ifdef FALLOC_FL_ZERO_RANGE
+        if (::fallocate64(fd, FALLOC_FL_ZERO_RANGE, offset, len) == 0) {
+            return 0;
+        }
+        if (!fallocate_unsupported(errno)) {
+            return -errno;
+        }
+#endif
+
+        ret = get_file_sizes(fd, &size);
+        if (ret) {
+            return ret;
+        }
+
+        /* the part inside the file may hold old data, write zeroes over it */
+        if (offset < size) {
+            const size_t kZeroChunk = 1 * kMiB;
+            off64_t end = std::min<off64_t>(offset + len, size);
+            std::vector<uint8_t> zero_buf(std::min<off64_t>(end - offset, kZeroChunk), 0);
+            for (off64_t pos = offset; pos < end; pos += zero_buf.size()) {
+                size_t n = std::min<off64_t>(end - pos, zero_buf.size());
+                ret = pwrite_file(fd, pos, zero_buf.data(), n);
+                if (ret) {
+                    return ret;
+                }
+            }
+        }
+
+        /* past the end reads as zero once allocated */
+        if (offset + len > size) {
+            off64_t begin = std::max<off64_t>(offset, size);
+            ret = allocate_file(fd, begin, offset + len - begin);
+        }
+        return ret;
+    }
+
+    int clone_file(int src_fd, int dst_fd) {
+#ifdef FICLONE
+        return (::ioctl(dst_fd, FICLONE, src_fd) == 0 ? 0 : -errno);
+#else
+        return -EOPNOTSUPP;
+#endif
+    }
+
+    // in kernel copy, the file system may share extents (nfs/cifs server side copy, xfs/btrfs reflink)
+    static int copy_range_file(int src_fd, int dst_fd, int64_t size) {
+        loff_t in_off = 0, out_off = 0;
+        while (in_off < size) {
+            ssize_t n = ::copy_file_range(src_fd, &in_off, dst_fd, &out_off, size - in_off, 0);
+            if (n < 0) {
+                return -errno;
+            }
+            if (n == 0) {
+                return -EIO;
+            }
+        }
+        return 0;
+    }
+
+    static bool all_zero(const uint8_t* buf, size_t len) {
+        return (len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0));
+    }
+
+    // threads copy kCopyChunk pieces in turn, zero pieces are left as holes
+    static int parallel_copy_file(int src_fd, int dst_fd, int64_t size, unsigned int threads) {
+        const int64_t kCopyChunk = 8 * kMiB;
+        std::atomic<int64_t> next(0);
+        std::atomic<int> error(0);
+
+        int ret = truncate_file(dst_fd, size);
+        if (ret) {
+            return ret;
+        }
+
+        auto worker = [&]() {
+            std::vector<uint8_t> buf(std::min(kCopyChunk, size));
+            while (error.load() == 0) {
+                int64_t offset = next.fetch_add(kCopyChunk);
+                if (offset >= size) {
+                    break;
+                }
+
+                size_t len = std::min(kCopyChunk, size - offset);
+                int r = pread_file(src_fd, offset, buf.data(), len);
+                if (r == 0 && !all_zero(buf.data(), len)) {
+                    r = pwrite_file(dst_fd, offset, buf.data(), len);
+                }
+                if (r) {
+                    int expected = 0;
+                    error.compare_exchange_strong(expected, r);
+                }
+            }
+        };
+
+        threads = std::max(1u, std::min<unsigned int>(threads, (size + kCopyChunk - 1) / kCopyChunk));
+        std::vector<std::thread> workers;
+        for (unsigned int i = 1; i < threads; ++i) {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (auto& t : workers) {
+            t.join();
+        }
+
+        return error.load();
+    }
+
+    int copy_file(const std::string& src_file, const std::string& dst_file, unsigned int threads/* = 0*/) {
+        int src_fd = -1, dst_fd = -1;
+        int64_t size = 0;
+        int ret = 0;
+
+        src_fd = open_file_ro(src_file);
+        if (src_fd < 0) {
+            ret = -errno;
+            CONSLOG("open file: %s failed - %d", src_file.c_str(), ret);
+            goto exit;
+        }
+
+        dst_fd = create_file(dst_file);
+        if (dst_fd < 0) {
+            ret = -errno;
+            CONSLOG("create file: %s failed - %d", dst_file.c_str(), ret);
+            goto exit;
+        }
+
+        ret = get_file_sizes(src_fd, &size);
+        if (ret) {
+            goto exit;
+        }
+
+        /* cheapest first: shared extents, in kernel copy, then a plain copy */
+        if (clone_file(src_fd, dst_fd) == 0) {
+            goto exit;
+        }
+        if (copy_range_file(src_fd, dst_fd, size) == 0) {
+            goto exit;
+        }
+
+        if (threads == 0) {
+            threads = std::min(4u, std::max(1u, std::thread::hardware_concurrency()));
+        }
+        ret = parallel_copy_file(src_fd, dst_fd, size, threads);
+        if (ret) {
+            CONSLOG("copy file: %s to %s failed - %d", src_file.c_str(), dst_file.c_str(), ret);
+        }
+
+    exit:
+        if (ret == 0 && flush_file(dst_fd) != 0) {
+            ret = -errno;
+        }
+        if (dst_fd >= 0) {
+            close_file(dst_fd);
+            if (ret) {
+                delete_file(dst_file);
+            }
+        }
+        if (src_fd >= 0) {
+            close_file(src_fd);
+        }
+        return ret;
+    }
+
+    int prefetch_file(int fd, off64_t offset, off64_t len) {
+        /* posix_fadvise returns the error number instead of setting errno */
+        return -::posix_fadvise64(fd, offset, len, POSIX_FADV_WILLNEED);
+    }
+
+    StreamDetector::StreamDetector(uint64_t initial_window/* = 0*/, uint64_t max_window/* = 0*/) {
+        setWindow(initial_window, max_window);
+    }
+
+    void StreamDetector::setWindow(uint64_t initial_window, uint64_t max_window) {
+        initial_window_ = std::min(initial_window, max_window);
+        if (initial_window_ == 0) {
+            initial_window_ = max_window;
+        }
+        max_window_ = max_window;
+        reset();
+    }
+
+    void StreamDetector::reset() {
+        memset(streams_, 0, sizeof(streams_));
+        clock_ = 0;
+    }
+
+    bool StreamDetector::update(uint64_t start, uint64_t len, uint64_t* ra_start, uint64_t* ra_len) {
+        if (max_window_ == 0 || len == 0) {
+            return false;
+        }
+
+        ++clock_;
+
+        /* a request continuing a stream, or skipping forward inside its prefetched range */
+        Stream* s = nullptr;
+        Stream* victim = &streams_[0];
+        for (int i = 0; i < kStreams; ++i) {
+            Stream& cur = streams_[i];
+            if (cur.hits > 0 && start >= cur.next && start <= std::max(cur.next, cur.ra_end)) {
+                s = &cur;
+                break;
+            }
+            if (cur.last_use < victim->last_use) {
+                victim = &cur;
+            }
+        }
+
+        if (s == nullptr) {
+            /* a new stream replaces the least recently used one */
+            victim->next = start + len;
+            victim->ra_end = 0;
+            victim->window = 0;
+            victim->last_use = clock_;
+            victim->hits = 1;
+            return false;
+        }
+
+        s->next = start + len;
+        s->last_use = clock_;
+        ++s->hits;
+
+        if (s->window == 0) {
+            s->window = initial_window_;
+        }
+
+        /* enough data already prefetched ahead of the reader */
+        if (s->ra_end >= s->next + s->window / 2) {
+            return false;
+        }
+
+        uint64_t from = std::max(s->ra_end, s->next);
+        uint64_t to = s->next + s->window;
+        s->ra_end = to;
+        s->window = std::min(s->window * 2, max_window_);
+
+        *ra_start = from;
+        *ra_len = to - from;
+        return true;
+    }
+
     std::string absolute_path(const std::string& file, int* err) {
         std::string path;
         struct stat stats;
@@ -183,6 +837,210 @@ namespace file {
     }
 }
 
+namespace iov {
+    size_t total_size(const struct iovec* iov, int iovcnt) {
+        size_t total = 0;
+        for (int i = 0; i < iovcnt; ++i) {
+            total += iov[i].iov_len;
+        }
+        return total;
+    }
+
+    int slice(const struct iovec* iov, int iovcnt, size_t offset, size_t len, std::vector<struct iovec>* out) {
+        int i = 0;
+        for (; i < iovcnt && offset >= iov[i].iov_len; ++i) {
+            offset -= iov[i].iov_len;
+        }
+
+        for (; i < iovcnt && len > 0; ++i) {
+            size_t n = std::min(iov[i].iov_len - offset, len);
+            struct iovec v;
+            v.iov_base = reinterpret_cast<uint8_t*>(iov[i].iov_base) + offset;
+            v.iov_len = n;
+            out->push_back(v);
+
+            len -= n;
+            offset = 0;
+        }
+
+        return (len == 0 ? 0 : -EINVAL);
+    }
+
+    void fill(const struct iovec* iov, int iovcnt, size_t offset, int c, size_t len) {
+        int i = 0;
+        for (; i < iovcnt && offset >= iov[i].iov_len; ++i) {
+            offset -= iov[i].iov_len;
+        }
+
+        for (; i < iovcnt && len > 0; ++i) {
+            size_t n = std::min(iov[i].iov_len - offset, len);
+            memset(reinterpret_cast<uint8_t*>(iov[i].iov_base) + offset, c, n);
+
+            len -= n;
+            offset = 0;
+        }
+    }
+
+    void copy_in(const struct iovec* iov, int iovcnt, size_t offset, const void* buf, size_t len) {
+        const uint8_t* src = reinterpret_cast<const uint8_t*>(buf);
+        int i = 0;
+        for (; i < iovcnt && offset >= iov[i].iov_len; ++i) {
+            offset -= iov[i].iov_len;
+        }
+
+        for (; i < iovcnt && len > 0; ++i) {
+            size_t n = std::min(iov[i].iov_len - offset, len);
+            memcpy(reinterpret_cast<uint8_t*>(iov[i].iov_base) + offset, src, n);
+
+            src += n;
+            len -= n;
+            offset = 0;
+        }
+    }
+} // namespace iov
+
+namespace bitmap {
+    // 从addr[byte]开始的8字节按大端序组成一个字, 第一个字节在最高位, 超出limit的字节补0
+    static inline uint64_t load_word(const uint8_t* addr, uint32_t byte, uint32_t limit) {
+        uint64_t word = 0;
+        uint32_t n = limit - byte;
+        memcpy(&word, addr + byte, n < 8 ? n : 8);
+        return be64toh(word);
+    }
+
+    uint32_t run_length(const uint8_t* addr, uint32_t start, uint32_t end, bool* set) {
+        if (start >= end) {
+            if (set) {
+                *set = false;
+            }
+            return 0;
+        }
+
+        bool value = (addr[start >> 3] & (0x80 >> (start & 7))) != 0;
+        /* xor with flip turns the bits equal to value into 0, the first 1 ends the run */
+        uint64_t flip = value ? ~0ULL : 0ULL;
+        uint32_t limit = (end + 7) >> 3;
+        uint32_t pos = start;
+        while (pos < end) {
+#if defined(__AVX2__)
+            if ((pos & 7) == 0) {
+                const __m256i pattern = _mm256_set1_epi8(value ? -1 : 0);
+                while (pos + 256 <= end) {
+                    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(addr + (pos >> 3)));
+                    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pattern)) != -1) {
+                        break;
+                    }
+                    pos += 256;
+                }
+                if (pos >= end) {
+                    break;
+                }
+            }
+#endif
+            uint32_t shift = pos & 7;
+            uint32_t valid = 64 - shift;
+            uint64_t word = (load_word(addr, pos >> 3, limit) ^ flip) << shift;
+            uint32_t n = (word == 0) ? valid : static_cast<uint32_t>(__builtin_clzll(word));
+            pos += n;
+            if (n < valid) {
+                break;
+            }
+        }
+
+        if (set) {
+            *set = value;
+        }
+        return (pos < end ? pos : end) - start;
+    }
+
+    void runs(const uint8_t* addr, uint32_t start, uint32_t count, std::vector<Run>* out) {
+        uint32_t end = start + count;
+        while (start < end) {
+            Run run;
+            run.start = start;
+            run.count = run_length(addr, start, end, &run.set);
+            out->push_back(run);
+            start += run.count;
+        }
+    }
+
+    static void fill_range(uint8_t* addr, uint32_t start, uint32_t count, bool value) {
+        if (count == 0) {
+            return;
+        }
+
+        uint32_t end = start + count;
+        uint32_t first = start >> 3, last = (end - 1) >> 3;
+        uint8_t head = static_cast<uint8_t>(0xff >> (start & 7));
+        uint8_t tail = static_cast<uint8_t>(0xff << (7 - ((end - 1) & 7)));
+        if (first == last) {
+            head &= tail;
+        }
+
+        addr[first] = value ? (addr[first] | head) : (addr[first] & ~head);
+        if (first == last) {
+            return;
+        }
+        memset(addr + first + 1, value ? 0xff : 0, last - first - 1);
+        addr[last] = value ? (addr[last] | tail) : (addr[last] & ~tail);
+    }
+
+    bool set_range(uint8_t* addr, uint32_t start, uint32_t count, uint32_t nbits) {
+        fill_range(addr, start, count, true);
+
+        bool set = false;
+        return nbits > 0 && run_length(addr, 0, nbits, &set) == nbits && set;
+    }
+
+    bool clear_range(uint8_t* addr, uint32_t start, uint32_t count, uint32_t nbits) {
+        fill_range(addr, start, count, false);
+
+        bool set = true;
+        return nbits > 0 && run_length(addr, 0, nbits, &set) == nbits && !set;
+    }
+} // namespace bitmap
+
+namespace bench {
+    // sequential 1MiB reads over the first 1GiB (at most) of the disk, then 4KiB random reads
+    int read_benchmark(uint64_t disk_size, uint32_t sector_bits, const Reader& read) {
+        const uint32_t kSeqBytes = libvdk::kMiB;
+        const uint32_t kRandBytes = 4096;
+        const uint32_t kRandCount = 16384;
+
+        uint64_t total = std::min<uint64_t>(disk_size, libvdk::kGiB);
+        std::vector<uint8_t> buf(kSeqBytes, 0);
+
+        auto begin = std::chrono::steady_clock::now();
+        for (uint64_t off = 0; off + kSeqBytes <= total; off += kSeqBytes) {
+            if (read(off >> sector_bits, kSeqBytes >> sector_bits, buf.data())) {
+                return -1;
+            }
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        printf("sequential read: %" PRIu64 " MiB, %.3f s, %.1f MiB/s\n",
+            total / libvdk::kMiB, secs, secs > 0 ? total / libvdk::kMiB / secs : 0.0);
+
+        uint64_t rand_blocks = disk_size / kRandBytes;
+        if (rand_blocks == 0) {
+            /* smaller than one random read, there is nothing to pick from */
+            return 0;
+        }
+        uint64_t seed = 0x2545F4914F6CDD1DULL;
+        begin = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < kRandCount; ++i) {
+            seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+            uint64_t off = (seed % rand_blocks) * kRandBytes;
+            if (read(off >> sector_bits, kRandBytes >> sector_bits, buf.data())) {
+                return -1;
+            }
+        }
+        secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        printf("random 4KiB read: %u ops, %.3f s, %.0f IOPS\n", kRandCount, secs, secs > 0 ? kRandCount / secs : 0.0);
+
+        return 0;
+    }
+} // namespace bench
+
 namespace guid {
     std::string toWinString(const GUID *in, bool uppercase) {
         char buf[kMaxUUID] = {'\0'};
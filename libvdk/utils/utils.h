@@ -4,11 +4,20 @@
 #include <uuid/uuid.h>
 
 #include <unistd.h>
+#include <sys/uio.h>
 #include <cstdint>
 #include <cstring>
 #include <string>
 #include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 #if defined(__linux__)
 #include <endian.h>
@@ -31,8 +40,13 @@ namespace libvdk {
 
 namespace file {
     int create_file(const std::string& file_path);
-    int open_file_ro(const std::string& file_path);
-    int open_file_rw(const std::string& file_path);
+    // O_DIRECT读写要求偏移/长度/内存按kDirectIoAlignment对齐
+    const uint32_t kDirectIoAlignment = 4096;
+
+    // direct: 使用O_DIRECT绕过page cache, 文件系统不支持时退回普通打开
+    // 不对齐的读写由pread_file/pwrite_file等通过对齐的缓冲区完成
+    int open_file_ro(const std::string& file_path, bool direct = false);
+    int open_file_rw(const std::string& file_path, bool direct = false);
     inline int close_file(int fd) {
         return ::close(fd);
     }
@@ -53,6 +67,13 @@ namespace file {
     int seek_and_read_file(int fd, off64_t offset, void* buf, size_t size, int whence);
     int seek_and_write_file(int fd, off64_t offset, const void* buf, size_t size, int whence);
 
+    // 按偏移读写, 不修改文件当前偏移, 同一个fd可被多个线程同时使用
+    int pread_file(int fd, off64_t offset, void* buf, size_t size);
+    int pwrite_file(int fd, off64_t offset, const void* buf, size_t size);
+    // 按偏移分散读/聚集写, iovcnt可以超过IOV_MAX
+    int preadv_file(int fd, off64_t offset, const struct iovec* iov, int iovcnt);
+    int pwritev_file(int fd, off64_t offset, const struct iovec* iov, int iovcnt);
+
     //int get_file_sizes_li(int fd, LARGE_INTEGER* pos);
     int get_file_sizes(int fd, int64_t* pos);
 
@@ -60,6 +81,18 @@ namespace file {
     int get_file_pos(int fd, off64_t* pos);
 
     int truncate_file(int fd, off64_t offset); 
+    // 为[offset, offset+len)分配磁盘空间(fallocate), 超出文件尾时扩展文件, 新空间读出为0
+    // 文件系统不支持时退回ftruncate扩展文件
+    int allocate_file(int fd, off64_t offset, off64_t len);
+    // [offset, offset+len)读出为0并分配空间(FALLOC_FL_ZERO_RANGE), 不支持时文件尾内写0, 文件尾外同allocate_file
+    int zero_file_range(int fd, off64_t offset, off64_t len);
+    // dst_fd共享src_fd的全部数据块(ioctl FICLONE, xfs/btrfs等), 不支持时返回-EOPNOTSUPP/-EXDEV/-EINVAL等
+    int clone_file(int src_fd, int dst_fd);
+    // 复制文件, 依次尝试clone_file, copy_file_range, 多线程大块读写(全0块留作空洞)
+    // threads为0时自动选择, 失败时删除dst_file
+    int copy_file(const std::string& src_file, const std::string& dst_file, unsigned int threads = 0);
+    // 提示内核预读[offset, offset+len)到page cache(posix_fadvise WILLNEED), 不等待读完成
+    int prefetch_file(int fd, off64_t offset, off64_t len);
     
     std::string absolute_path(const std::string& file, int* err);
     std::string relative_path_to(const std::string& file, const std::string& another_file, int* err);
@@ -68,8 +101,773 @@ namespace file {
     inline int exist_file(const std::string& file_path) {
         return ::access(file_path.c_str(), F_OK);
     }
+
+    enum class IoEngine : int {
+        kSync = 0,      // pread/pwrite
+        kUring = 1,     // io_uring批量提交, 不可用时退回kSync
+        kMmap = 2,      // 只读文件映射到内存, 读即memcpy, 可写文件仍用kSync
+    };
+
+    // 映射文件的访问模式提示(madvise)
+    enum class AccessHint : int {
+        kNormal = 0,
+        kSequential = 1,
+        kRandom = 2,
+    };
+
+    /*
+     只读映射整个文件, 文件在映射期间不能被截短
+     example:
+        MappedFile m;
+        m.map(fd);
+        m.advise(AccessHint::kRandom);
+        m.read(offset, buf, len);
+    */
+class MappedFile {
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    int  map(int fd);
+    void unmap();
+
+    bool mapped() const {
+        return addr_ != nullptr;
+    }
+    uint64_t size() const {
+        return size_;
+    }
+
+    int advise(AccessHint hint);
+    // 预读映射中的[offset, offset+size)(madvise WILLNEED)
+    int prefetch(off64_t offset, size_t size) const;
+
+    // 与pread_file相同: 读到文件尾时部分读成功, 一点都没读到返回-EIO
+    int read(off64_t offset, void* buf, size_t size) const;
+    int readv(off64_t offset, const struct iovec* iov, int iovcnt) const;
+
+private:
+    uint8_t* addr_;
+    uint64_t size_;
+};
+
+    /*
+     io_uring批量读写, 请求先排队, wait()时一次提交并等待全部完成, 单线程即可有较深的队列深度
+     内核不支持io_uring时请求在排队时同步完成
+     example:
+        IoBatch batch;
+        batch.read(fd, off1, buf1, len1);
+        batch.readv(fd, off2, iov, iovcnt);
+        ret = batch.wait();
+     请求的缓冲区在wait()返回前必须保持有效
+    */
+class IoBatch {
+public:
+    static const unsigned int kDefaultQueueDepth = 64;
+
+    explicit IoBatch(unsigned int queue_depth = kDefaultQueueDepth);
+    ~IoBatch();
+
+    IoBatch(const IoBatch&) = delete;
+    IoBatch& operator=(const IoBatch&) = delete;
+
+    bool async() const {
+        return static_cast<bool>(ring_);
+    }
+
+    // 注册文件/固定缓冲区, 之后对这些fd和落在这些缓冲区内的请求使用IOSQE_FIXED_FILE/READ_FIXED
+    int registerFiles(const std::vector<int>& fds);
+    int registerBuffers(const struct iovec* iov, int iovcnt);
+
+    int read(int fd, off64_t offset, void* buf, size_t size);
+    int readv(int fd, off64_t offset, const struct iovec* iov, int iovcnt);
+    int write(int fd, off64_t offset, const void* buf, size_t size);
+    int writev(int fd, off64_t offset, const struct iovec* iov, int iovcnt);
+
+    // 提交所有请求并等待完成, 返回第一个失败请求的错误码
+    int wait();
+
+private:
+    struct Ring;
+    struct Request {
+        int fd;
+        off64_t offset;
+        std::vector<struct iovec> iov;
+        bool is_write;
+    };
+
+    int  queue(int fd, off64_t offset, const struct iovec* iov, int iovcnt, bool is_write);
+    int  reap(unsigned int count);
+    void complete(uint64_t index, int res);
+    int  fixedBufferIndex(const void* buf, size_t len) const;
+
+    std::unique_ptr<Ring> ring_;
+    unsigned int queue_depth_;
+    unsigned int queued_;       // in sq, not submitted
+    unsigned int inflight_;     // submitted, not completed
+    int error_;
+
+    std::vector<Request> requests_;
+    std::vector<int> files_;
+    std::vector<struct iovec> buffers_;
+};
+
+    /*
+     顺序读检测: 记住最近kStreams个读流, 读请求接上某个流时计数, 连续两次即认为是顺序读,
+     预读窗口从initial_window开始每次翻倍直到max_window, 已预读的部分剩下不到半个窗口时再预读下一段
+     单位由调用者决定(如扇区), max_window为0时不预读
+     example:
+        StreamDetector sd(256, 8192);
+        if (sd.update(sector, nb_sectors, &ra_start, &ra_len)) {
+            prefetch(ra_start, ra_len);
+        }
+    */
+class StreamDetector {
+public:
+    static const int kStreams = 4;
+
+    StreamDetector(uint64_t initial_window = 0, uint64_t max_window = 0);
+
+    void setWindow(uint64_t initial_window, uint64_t max_window);
+    void reset();
+
+    // 记录一次读[start, start+len), 需要预读时返回true和预读的范围
+    bool update(uint64_t start, uint64_t len, uint64_t* ra_start, uint64_t* ra_len);
+
+private:
+    struct Stream {
+        uint64_t next;      // 顺序读时下一个请求的开始
+        uint64_t ra_end;    // 已预读到的位置
+        uint64_t window;
+        uint64_t last_use;
+        uint32_t hits;
+    };
+
+    Stream streams_[kStreams];
+    uint64_t clock_;
+    uint64_t initial_window_;
+    uint64_t max_window_;
+};
 } // namespace file
 
+namespace iov {
+    // iovec数组的总字节数
+    size_t total_size(const struct iovec* iov, int iovcnt);
+    // 截取iovec数组中[offset, offset+len)的区间追加到out, 只引用原内存, 不拷贝数据
+    // 区间超出iovec数组时返回-EINVAL
+    int slice(const struct iovec* iov, int iovcnt, size_t offset, size_t len, std::vector<struct iovec>* out);
+    // iovec数组中[offset, offset+len)的区间填充为c
+    void fill(const struct iovec* iov, int iovcnt, size_t offset, int c, size_t len);
+    // buf的len字节复制到iovec数组中[offset, offset+len)的区间
+    void copy_in(const struct iovec* iov, int iovcnt, size_t offset, const void* buf, size_t len);
+} // namespace iov
+
+namespace bitmap {
+    // 位序与vhdx/vpc的testBit一致: 第nr位是addr[nr >> 3]的(0x80 >> (nr & 7))
+    // 一段取值相同的连续位[start, start+count), set为true时这些位为1
+    struct Run {
+        uint32_t start;
+        uint32_t count;
+        bool set;
+    };
+
+    // 从start开始与start位取值相同的连续位数, 不超过end - start, set返回该取值
+    // 按64位字比较, 全0/全1的字整体跳过, 只读取[start, end)所在的字节
+    uint32_t run_length(const uint8_t* addr, uint32_t start, uint32_t end, bool* set = nullptr);
+    // [start, start+count)按取值拆成交替的段追加到out
+    void runs(const uint8_t* addr, uint32_t start, uint32_t count, std::vector<Run>* out);
+    // [start, start+count)置1, 中间的整字节直接填充, 只有两端的字节按掩码修改
+    // 返回[0, nbits)是否已经全为1, nbits为0时不检查并返回false
+    bool set_range(uint8_t* addr, uint32_t start, uint32_t count, uint32_t nbits = 0);
+    // [start, start+count)清0, 返回[0, nbits)是否已经全为0
+    bool clear_range(uint8_t* addr, uint32_t start, uint32_t count, uint32_t nbits = 0);
+} // namespace bitmap
+
+namespace bench {
+    using Reader = std::function<int(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf)>;
+
+    // 读性能测试: 先对磁盘前1GiB(不足时为整个磁盘)做1MiB顺序读, 再做4KiB随机读(磁盘不足4KiB时跳过), 结果打印到stdout
+    // io引擎等由调用者事先设置, 读失败时返回-1
+    int read_benchmark(uint64_t disk_size, uint32_t sector_bits, const Reader& read);
+} // namespace bench
+
+namespace storage {
+    // 路径以kMemoryPrefix开头时使用内存后端(MemoryStorage), 否则为普通文件(PosixStorage)
+    // 同名的内存存储在进程内共享数据, 与文件一样可以被重复打开, 删除后已打开的仍可使用
+    const char kMemoryPrefix[] = "mem:";
+
+    /*
+     镜像的存储后端, vhdx/vpc的格式代码只通过它读写, 返回0或-errno
+     example:
+        std::unique_ptr<Storage> s;
+        ret = open_storage(path, true, false, &s);
+        ret = s->read(offset, buf, len);
+    */
+class Storage {
+public:
+    virtual ~Storage() {}
+
+    virtual int read(off64_t offset, void* buf, size_t size) = 0;
+    virtual int write(off64_t offset, const void* buf, size_t size) = 0;
+    virtual int readv(off64_t offset, const struct iovec* iov, int iovcnt) = 0;
+    virtual int writev(off64_t offset, const struct iovec* iov, int iovcnt) = 0;
+
+    virtual int flush() = 0;
+    virtual int truncate(off64_t size) = 0;
+    virtual int getSize(int64_t* size) = 0;
+    // 同libvdk::file::allocate_file/zero_file_range
+    virtual int allocate(off64_t offset, off64_t len) = 0;
+    virtual int zeroRange(off64_t offset, off64_t len) = 0;
+
+    virtual bool readOnly() const = 0;
+    // 预读提示, 不支持时什么都不做
+    virtual int prefetch(off64_t offset, off64_t len) {
+        return 0;
+    }
+    // 底层文件描述符, 给io_uring和mmap使用, 不是文件时返回-1
+    virtual int fd() const {
+        return -1;
+    }
+};
+
+class PosixStorage : public Storage {
+public:
+    PosixStorage();
+    ~PosixStorage();
+
+    PosixStorage(const PosixStorage&) = delete;
+    PosixStorage& operator=(const PosixStorage&) = delete;
+
+    int open(const std::string& path, bool read_only, bool direct = false);
+    int create(const std::string& path);
+    void close();
+
+    int read(off64_t offset, void* buf, size_t size) override;
+    int write(off64_t offset, const void* buf, size_t size) override;
+    int readv(off64_t offset, const struct iovec* iov, int iovcnt) override;
+    int writev(off64_t offset, const struct iovec* iov, int iovcnt) override;
+
+    int flush() override;
+    int truncate(off64_t size) override;
+    int getSize(int64_t* size) override;
+    int allocate(off64_t offset, off64_t len) override;
+    int zeroRange(off64_t offset, off64_t len) override;
+    int prefetch(off64_t offset, off64_t len) override;
+
+    bool readOnly() const override {
+        return read_only_;
+    }
+    int fd() const override {
+        return fd_;
+    }
+
+private:
+    int fd_;
+    bool read_only_;
+};
+
+class MemoryStorage : public Storage {
+public:
+    struct Data;
+
+    // 不与其他存储共享的匿名内存
+    MemoryStorage();
+    MemoryStorage(std::shared_ptr<Data> data, bool read_only);
+    ~MemoryStorage();
+
+    MemoryStorage(const MemoryStorage&) = delete;
+    MemoryStorage& operator=(const MemoryStorage&) = delete;
+
+    int read(off64_t offset, void* buf, size_t size) override;
+    int write(off64_t offset, const void* buf, size_t size) override;
+    int readv(off64_t offset, const struct iovec* iov, int iovcnt) override;
+    int writev(off64_t offset, const struct iovec* iov, int iovcnt) override;
+
+    int flush() override {
+        return 0;
+    }
+    int truncate(off64_t size) override;
+    int getSize(int64_t* size) override;
+    int allocate(off64_t offset, off64_t len) override;
+    int zeroRange(off64_t offset, off64_t len) override;
+
+    bool readOnly() const override {
+        return read_only_;
+    }
+
+private:
+    std::shared_ptr<Data> data_;
+    bool read_only_;
+};
+
+    /*
+     在文件尾部追加分配空间: 内存中记住已用的尾部(tail), 不用每次查询文件大小,
+     文件按chunk_bytes一次多扩展一些(预分配), 关闭前trim()截掉没用到的部分
+     example:
+        TailAllocator ta(4 * block_size);
+        ta.allocate(storage, kMiB, block_size, false, &offset);
+        ...
+        ta.trim(storage);
+    */
+class TailAllocator {
+public:
+    explicit TailAllocator(uint64_t chunk_bytes = 0);
+
+    // chunk_bytes不大于单次分配时不预分配
+    void setChunkBytes(uint64_t chunk_bytes) {
+        chunk_bytes_ = chunk_bytes;
+    }
+    uint64_t chunkBytes() const {
+        return chunk_bytes_;
+    }
+
+    // 按文件大小载入尾部, trailer: 文件末尾可以被新分配覆盖的字节数(如vhd的footer)
+    // 没有载入时allocate()会先以trailer为0载入
+    int  load(Storage* storage, uint64_t trailer = 0);
+    bool loaded() const {
+        return loaded_;
+    }
+    // 忘掉尾部, 文件被其他方式改变大小后调用
+    void reset();
+
+    // 在尾部按align对齐分配len字节, zero为true时保证读出为0
+    int allocate(Storage* storage, uint64_t align, uint64_t len, bool zero, uint64_t* offset);
+    // 已用空间的结尾, 没有载入时为0
+    uint64_t tail() const {
+        return tail_;
+    }
+    // 把文件截到tail(), 去掉预分配但没用到的部分
+    int trim(Storage* storage);
+
+private:
+    uint64_t chunk_bytes_;
+    bool loaded_;
+    uint64_t tail_;     // end of the used space
+    uint64_t end_;      // end of the file, preallocated space included
+};
+
+    /*
+     文件元数据的页缓存(默认4KiB一页), 按文件偏移(页对齐)查找, 未命中时通过reader读入, 超过max_pages时淘汰最久没用的页
+     get()/insert()返回的指针在下一次get()/insert()之前有效
+     修改页内容后可以由调用者自己写回文件, 也可以markDirty()后由flush()或淘汰时通过writer写回
+     example:
+        PageCache pc(256, [storage](uint64_t off, void* buf, size_t len) { return storage->read(off, buf, len); });
+        uint8_t* page;
+        ret = pc.get(offset, PageCache::kPageSize, &page);
+    */
+class PageCache {
+public:
+    static const uint32_t kPageSize = 4096;
+
+    using Reader = std::function<int(uint64_t offset, void* buf, size_t len)>;
+    using Writer = std::function<int(uint64_t offset, const void* buf, size_t len)>;
+
+    explicit PageCache(uint32_t max_pages = 1, Reader reader = Reader(), uint32_t page_size = kPageSize);
+    ~PageCache() = default;
+
+    PageCache(const PageCache&) = delete;
+    PageCache& operator=(const PageCache&) = delete;
+
+    void setReader(Reader reader) {
+        reader_ = std::move(reader);
+    }
+    void setWriter(Writer writer) {
+        writer_ = std::move(writer);
+    }
+    // 淘汰的脏页先写回, 写回失败时保留
+    void setMaxPages(uint32_t max_pages);
+    uint32_t maxPages() const {
+        return max_pages_;
+    }
+    uint32_t pageSize() const {
+        return page_size_;
+    }
+    size_t residentPages() const {
+        return pages_.size();
+    }
+    size_t dirtyPages() const {
+        return dirty_count_;
+    }
+
+    // offset按页大小对齐, 只读入前bytes字节(表尾不满一页), 其余为0
+    int  get(uint64_t offset, uint32_t bytes, uint8_t** page);
+    // 不读文件, 直接缓存一个全0的页(新分配的空间)
+    int  insert(uint64_t offset, uint8_t** page);
+    // 已缓存的页返回true
+    bool lookup(uint64_t offset, uint8_t** page);
+    // 把[offset, offset+len)的新内容复制进已缓存的页, 未缓存的部分忽略
+    void update(uint64_t offset, const void* buf, size_t len);
+    // 页必须已缓存
+    void markDirty(uint64_t offset);
+    // 按偏移顺序写回全部脏页
+    int  flush();
+    // 丢弃全部页, 包括没写回的脏页
+    void clear();
+
+private:
+    struct Page {
+        std::unique_ptr<uint8_t[]> data;
+        std::list<uint64_t>::iterator lru_pos;
+        bool dirty;
+    };
+
+    int  add(uint64_t offset, Page* np, uint8_t** page);
+    int  evict();
+
+    Reader reader_;
+    Writer writer_;
+    uint32_t max_pages_;
+    uint32_t page_size_;
+    size_t dirty_count_;
+    std::unordered_map<uint64_t, Page> pages_;
+    // most recently used at front
+    std::list<uint64_t> lru_;
+    // the last used page, skips the lookup for runs of accesses in one page
+    uint64_t last_offset_;
+    Page* last_page_;
+};
+
+    /*
+     进程内共享的数据块缓存, 以(文件的dev/ino/大小/修改时间, 文件偏移)为key, 给多个镜像共用的只读父镜像使用,
+     文件被改写, 删除后重建(inode重用)或被复制覆盖时key随之改变, 不会读到旧块
+     O_DIRECT打开时代替内核页缓存. 容量为0时不缓存(默认)
+     淘汰用2Q: 第一次读入的块进A1in(FIFO), 从A1in淘汰的块只留下key(A1out),
+     在A1out里的块再被读到时进Am(LRU), 一次顺序扫描不会冲掉Am里反复使用的块
+     线程安全, 未命中时在锁外读文件, 连续未命中的块合并成一次readv
+     example:
+        BlockCache::FileKey key;
+        ret = BlockCache::fileKey(fd, &key);
+        ret = BlockCache::instance().readv(key, offset, iov, iovcnt,
+                [storage](uint64_t off, const struct iovec* v, int n) { return storage->readv(off, v, n); });
+    */
+class BlockCache {
+public:
+    static const uint32_t kBlockSize = 64 * 1024;
+    // most blocks read by one readv of the file
+    static const uint32_t kMaxReadBlocks = 32;
+
+    struct FileKey {
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t size;
+        uint64_t mtime_ns;
+    };
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t resident_bytes;
+    };
+
+    using Reader = std::function<int(uint64_t offset, const struct iovec* iov, int iovcnt)>;
+
+    static BlockCache& instance();
+    // 同一个文件不管从哪个路径打开key都相同, fd不是文件时返回-EBADF
+    static int fileKey(int fd, FileKey* key);
+
+    // 缩小时立即淘汰, 0: 清空并停止缓存
+    void setCapacity(uint64_t bytes);
+    uint64_t capacity() const {
+        return capacity_;
+    }
+    bool enabled() const {
+        return capacity_ >= kBlockSize;
+    }
+    Stats stats() const;
+
+    // 读文件的[offset, offset+total_size(iov)), 未命中的块整块通过reader读入
+    // 文件内容在缓存期间不能被修改
+    int  readv(const FileKey& key, uint64_t offset, const struct iovec* iov, int iovcnt, const Reader& reader);
+    // 丢弃文件(dev/ino相同)的全部缓存块, 不管大小和修改时间. 以可写方式打开, 创建, 删除文件时调用
+    void invalidate(const FileKey& key);
+
+private:
+    struct BlockKey {
+        FileKey file;
+        uint64_t offset;
+
+        bool operator==(const BlockKey& rhs) const {
+            return (file.dev == rhs.file.dev && file.ino == rhs.file.ino && file.size == rhs.file.size &&
+                file.mtime_ns == rhs.file.mtime_ns && offset == rhs.offset);
+        }
+    };
+    struct BlockKeyHash {
+        size_t operator()(const BlockKey& k) const {
+            return std::hash<uint64_t>()(k.file.ino * 0x9e3779b97f4a7c15ULL ^ k.file.dev ^ k.file.mtime_ns ^ (k.offset >> 16));
+        }
+    };
+    struct AlignedFree {
+        void operator()(uint8_t* p) const {
+            free(p);
+        }
+    };
+    using BlockBuffer = std::unique_ptr<uint8_t, AlignedFree>;
+
+    enum class Queue : int {
+        kA1in = 0,
+        kAm,
+        kA1out,
+    };
+    struct Block {
+        BlockBuffer data;
+        Queue queue;
+        std::list<BlockKey>::iterator pos;
+    };
+
+    BlockCache();
+
+    // 命中时把块内[in_block, in_block+len)复制到iov的iov_offset处
+    bool lookup(const BlockKey& key, uint32_t in_block, const struct iovec* iov, int iovcnt, size_t iov_offset, size_t len);
+    bool contains(const BlockKey& key);
+    void insert(const BlockKey& key, BlockBuffer data);
+    // caller holds mutex_
+    void reclaim();
+    void trim(uint64_t max_blocks);
+
+    std::list<BlockKey>& queue(Queue q) {
+        return (q == Queue::kA1in ? a1in_ : (q == Queue::kAm ? am_ : a1out_));
+    }
+
+    mutable std::mutex mutex_;
+    std::atomic<uint64_t> capacity_;
+    uint64_t hits_;
+    uint64_t misses_;
+    std::unordered_map<BlockKey, Block, BlockKeyHash> blocks_;
+    // newest at front
+    std::list<BlockKey> a1in_;
+    std::list<BlockKey> am_;
+    std::list<BlockKey> a1out_;
+};
+
+    /*
+     写回缓存, 写入的扇区先留在内存, 相邻或重叠的脏扇区合并成一个区间, flush()时每个区间一次写出
+     读要用overlay()把还没写回的扇区盖到从镜像读出的数据上
+     needFlush(): 脏数据超过max_bytes或最早的脏数据超过max_age_ms(为0时不限时间)
+     example:
+        WriteBackCache wb;
+        wb.setup(9, 32 * kMiB, 5000);
+        wb.write(sector, n, iov, iovcnt);
+        wb.overlay(sector, n, iov, iovcnt);
+        if (wb.needFlush()) { ret = wb.flush(writer); }
+    */
+class WriteBackCache {
+public:
+    using Writer = std::function<int(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt)>;
+
+    WriteBackCache();
+    ~WriteBackCache() = default;
+
+    WriteBackCache(const WriteBackCache&) = delete;
+    WriteBackCache& operator=(const WriteBackCache&) = delete;
+
+    // max_bytes 0: disabled, dirty data must be flushed before
+    void setup(uint32_t sector_bits, uint64_t max_bytes, uint32_t max_age_ms);
+    bool enabled() const {
+        return max_bytes_ > 0;
+    }
+    uint64_t dirtyBytes() const {
+        return dirty_bytes_;
+    }
+    size_t extents() const {
+        return extents_.size();
+    }
+
+    void write(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt);
+    void overlay(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt) const;
+    bool needFlush() const;
+    // 按扇区顺序写出, 写失败的区间和之后的保持脏
+    int  flush(const Writer& writer);
+    void clear();
+
+private:
+    uint64_t sectorsOf(const std::vector<uint8_t>& data) const {
+        return data.size() >> sector_bits_;
+    }
+
+    uint32_t sector_bits_;
+    uint64_t max_bytes_;
+    uint32_t max_age_ms_;
+    uint64_t dirty_bytes_;
+    // first sector -> data of the extent, extents never overlap or touch
+    std::map<uint64_t, std::vector<uint8_t>> extents_;
+    // when the oldest dirty data came in
+    std::chrono::steady_clock::time_point dirty_since_;
+};
+
+    /*
+     差分链中每个虚拟块由哪一层完整持有, 按页(kPageEntries项)在第一次用到时分配
+     项的编码: kUnknown未解析, kAbsent所有层都没有(读为0), kPartial需要逐层查bitmap,
+     其余为owned(layer, file_offset), layer 0是链顶镜像, file_offset按扇区对齐
+     example:
+        ChainMap cm;
+        cm.reset(block_count);
+        if (cm.get(block) == ChainMap::kUnknown) { cm.set(block, ChainMap::owned(layer, offset)); }
+    */
+class ChainMap {
+public:
+    static const uint32_t kPageEntries = 4096;
+    static const uint64_t kUnknown = 0;
+    static const uint64_t kAbsent = 1;
+    static const uint64_t kPartial = 2;
+    static const uint32_t kMaxLayers = 253;
+
+    static uint64_t owned(uint32_t layer, uint64_t file_offset) {
+        return ((file_offset >> 9) << 8) | (layer + 3);
+    }
+    static bool isOwned(uint64_t value) {
+        return (value & 0xff) >= 3;
+    }
+    static uint32_t layerOf(uint64_t value) {
+        return static_cast<uint32_t>(value & 0xff) - 3;
+    }
+    static uint64_t offsetOf(uint64_t value) {
+        return (value >> 8) << 9;
+    }
+
+    // 0: no map
+    void reset(uint64_t blocks);
+    bool empty() const {
+        return blocks_ == 0;
+    }
+    uint64_t get(uint64_t block) const;
+    void set(uint64_t block, uint64_t value);
+    // blocks [first, last] are resolved again on next use
+    void invalidate(uint64_t first, uint64_t last);
+
+private:
+    uint64_t blocks_ = 0;
+    std::vector<std::unique_ptr<uint64_t[]>> pages_;
+};
+
+    /*
+     每个虚拟块在所有父镜像中是否都没有分配, 每块2bit: 未知/已分配/未分配
+     父镜像不会被修改, 记下的结果在父镜像链存在期间一直有效
+    */
+class ParentBlockSet {
+public:
+    enum class State : uint8_t {
+        kUnknown = 0,
+        kAllocated = 1,
+        kUnallocated = 2,
+    };
+
+    // 0: nothing is recorded
+    void reset(uint64_t blocks) {
+        blocks_ = blocks;
+        bits_.assign((blocks + 31) / 32, 0);
+    }
+    State get(uint64_t block) const {
+        if (block >= blocks_) {
+            return State::kUnknown;
+        }
+        return static_cast<State>((bits_[block / 32] >> (block % 32 * 2)) & 3);
+    }
+    void set(uint64_t block, State state) {
+        if (block < blocks_) {
+            uint64_t& word = bits_[block / 32];
+            uint32_t shift = block % 32 * 2;
+            word = (word & ~(3ULL << shift)) | (static_cast<uint64_t>(state) << shift);
+        }
+    }
+
+private:
+    uint64_t blocks_ = 0;
+    std::vector<uint64_t> bits_;
+};
+
+    /*
+     进程内共享的只读镜像层(父镜像), 以(规范路径, 内容标识, 打开方式, io引擎)为key, 同一个父镜像只打开解析一次
+     io引擎在层创建时设定, 之后不再改变, 子镜像换引擎时换用另一个key的层
+     只保存weak_ptr, 最后一个子镜像释放后层被析构, key随之失效, 线程安全
+     example:
+        auto& reg = LayerRegistry<Vhdx>::instance();
+        std::string key = LayerRegistry<Vhdx>::key(canonical_path, guid, direct, engine, hint);
+        std::shared_ptr<Vhdx> p = reg.find(key);
+        if (!p) { p = reg.add(key, std::make_shared<Vhdx>(path, true, direct)); }
+    */
+template <typename Layer>
+class LayerRegistry {
+public:
+    static LayerRegistry& instance() {
+        static LayerRegistry registry;
+        return registry;
+    }
+
+    static std::string key(const std::string& canonical_path, const std::string& id, bool direct,
+            libvdk::file::IoEngine engine, libvdk::file::AccessHint hint) {
+        return canonical_path + "|" + id + (direct ? "|direct" : "") + 
+            "|" + std::to_string(static_cast<int>(engine)) + "|" + std::to_string(static_cast<int>(hint));
+    }
+
+    // nullptr if no live layer is registered under key
+    std::shared_ptr<Layer> find(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = layers_.find(key);
+        if (it == layers_.end()) {
+            return std::shared_ptr<Layer>();
+        }
+
+        std::shared_ptr<Layer> layer = it->second.lock();
+        if (!layer) {
+            layers_.erase(it);
+        }
+        return layer;
+    }
+
+    // 并发打开时先注册的胜出, 返回实际注册的层
+    std::shared_ptr<Layer> add(const std::string& key, const std::shared_ptr<Layer>& layer) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = layers_.begin(); it != layers_.end(); ) {
+            if (it->second.expired()) {
+                it = layers_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        std::weak_ptr<Layer>& slot = layers_[key];
+        std::shared_ptr<Layer> existing = slot.lock();
+        if (existing) {
+            return existing;
+        }
+        slot = layer;
+        return layer;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t n = 0;
+        for (const auto& kv : layers_) {
+            n += (kv.second.expired() ? 0 : 1);
+        }
+        return n;
+    }
+
+private:
+    LayerRegistry() = default;
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::weak_ptr<Layer>> layers_;
+};
+
+    bool is_memory_path(const std::string& path);
+
+    // 按路径选择后端打开/创建, direct只对文件有效
+    int open_storage(const std::string& path, bool read_only, bool direct, std::unique_ptr<Storage>* storage);
+    int create_storage(const std::string& path, std::unique_ptr<Storage>* storage);
+    int delete_storage(const std::string& path);
+    // if storage exist, zero is returned
+    int exist_storage(const std::string& path);
+    // 两边都是文件时同libvdk::file::copy_file, 否则逐块读写
+    int copy_storage(const std::string& src_path, const std::string& dst_path);
+
+    // 内存存储的路径原样返回
+    std::string absolute_path(const std::string& path, int* err);
+    std::string relative_path_to(const std::string& path, const std::string& another_path, int* err);
+} // namespace storage
+
 namespace guid {
     const int kMaxUUID = 40;
 
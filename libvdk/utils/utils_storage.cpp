@@ -0,0 +1,983 @@
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <mutex>
+
+#include "utils.h"
+
+namespace libvdk {
+namespace storage {
+
+PosixStorage::PosixStorage()
+    : fd_(-1),
+      read_only_(true) {
+}
+
+PosixStorage::~PosixStorage() {
+    close();
+}
+
+int PosixStorage::open(const std::string& path, bool read_only, bool direct/* = false*/) {
+    close();
+
+    int fd = read_only ? libvdk::file::open_file_ro(path, direct) : libvdk::file::open_file_rw(path, direct);
+    if (fd <= 0) {
+        return (fd < 0 ? -errno : -EBADF);
+    }
+
+    fd_ = fd;
+    read_only_ = read_only;
+    return 0;
+}
+
+int PosixStorage::create(const std::string& path) {
+    close();
+
+    int fd = libvdk::file::create_file(path);
+    if (fd <= 0) {
+        return (fd < 0 ? -errno : -EBADF);
+    }
+
+    fd_ = fd;
+    read_only_ = false;
+    return 0;
+}
+
+void PosixStorage::close() {
+    if (fd_ > 0) {
+        libvdk::file::close_file(fd_);
+        fd_ = -1;
+    }
+}
+
+int PosixStorage::read(off64_t offset, void* buf, size_t size) {
+    return libvdk::file::pread_file(fd_, offset, buf, size);
+}
+
+int PosixStorage::write(off64_t offset, const void* buf, size_t size) {
+    return libvdk::file::pwrite_file(fd_, offset, buf, size);
+}
+
+int PosixStorage::readv(off64_t offset, const struct iovec* iov, int iovcnt) {
+    return libvdk::file::preadv_file(fd_, offset, iov, iovcnt);
+}
+
+int PosixStorage::writev(off64_t offset, const struct iovec* iov, int iovcnt) {
+    return libvdk::file::pwritev_file(fd_, offset, iov, iovcnt);
+}
+
+int PosixStorage::flush() {
+    return (libvdk::file::flush_file(fd_) == 0 ? 0 : -errno);
+}
+
+int PosixStorage::truncate(off64_t size) {
+    return libvdk::file::truncate_file(fd_, size);
+}
+
+int PosixStorage::getSize(int64_t* size) {
+    return libvdk::file::get_file_sizes(fd_, size);
+}
+
+int PosixStorage::allocate(off64_t offset, off64_t len) {
+    return libvdk::file::allocate_file(fd_, offset, len);
+}
+
+int PosixStorage::zeroRange(off64_t offset, off64_t len) {
+    return libvdk::file::zero_file_range(fd_, offset, len);
+}
+
+int PosixStorage::prefetch(off64_t offset, off64_t len) {
+    return libvdk::file::prefetch_file(fd_, offset, len);
+}
+
+struct MemoryStorage::Data {
+    std::mutex lock;
+    std::vector<uint8_t> bytes;
+};
+
+MemoryStorage::MemoryStorage()
+    : data_(std::make_shared<Data>()),
+      read_only_(false) {
+}
+
+MemoryStorage::MemoryStorage(std::shared_ptr<Data> data, bool read_only)
+    : data_(std::move(data)),
+      read_only_(read_only) {
+}
+
+MemoryStorage::~MemoryStorage() {
+}
+
+int MemoryStorage::read(off64_t offset, void* buf, size_t size) {
+    struct iovec v = { buf, size };
+    return readv(offset, &v, 1);
+}
+
+int MemoryStorage::write(off64_t offset, const void* buf, size_t size) {
+    struct iovec v = { const_cast<void*>(buf), size };
+    return writev(offset, &v, 1);
+}
+
+int MemoryStorage::readv(off64_t offset, const struct iovec* iov, int iovcnt) {
+    if (offset < 0) {
+        return -EINVAL;
+    }
+
+    std::lock_guard<std::mutex> guard(data_->lock);
+    const std::vector<uint8_t>& bytes = data_->bytes;
+    uint64_t pos = offset;
+    size_t done = 0;
+    for (int i = 0; i < iovcnt && pos < bytes.size(); ++i) {
+        size_t n = std::min<uint64_t>(iov[i].iov_len, bytes.size() - pos);
+        memcpy(iov[i].iov_base, bytes.data() + pos, n);
+        pos += n;
+        done += n;
+    }
+
+    /* same as pread_file: a short read at the end is valid, nothing read is not */
+    if (done == 0 && libvdk::iov::total_size(iov, iovcnt) > 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+int MemoryStorage::writev(off64_t offset, const struct iovec* iov, int iovcnt) {
+    if (read_only_) {
+        return -EBADF;
+    }
+    if (offset < 0) {
+        return -EINVAL;
+    }
+
+    std::lock_guard<std::mutex> guard(data_->lock);
+    std::vector<uint8_t>& bytes = data_->bytes;
+    uint64_t end = offset + libvdk::iov::total_size(iov, iovcnt);
+    if (end > bytes.size()) {
+        bytes.resize(end, 0);
+    }
+
+    uint64_t pos = offset;
+    for (int i = 0; i < iovcnt; ++i) {
+        memcpy(bytes.data() + pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+    return 0;
+}
+
+int MemoryStorage::truncate(off64_t size) {
+    if (read_only_) {
+        return -EBADF;
+    }
+    if (size < 0) {
+        return -EINVAL;
+    }
+
+    std::lock_guard<std::mutex> guard(data_->lock);
+    data_->bytes.resize(size, 0);
+    return 0;
+}
+
+int MemoryStorage::getSize(int64_t* size) {
+    std::lock_guard<std::mutex> guard(data_->lock);
+    *size = data_->bytes.size();
+    return 0;
+}
+
+int MemoryStorage::allocate(off64_t offset, off64_t len) {
+    if (read_only_) {
+        return -EBADF;
+    }
+    if (offset < 0 || len <= 0) {
+        return -EINVAL;
+    }
+
+    std::lock_guard<std::mutex> guard(data_->lock);
+    if (static_cast<uint64_t>(offset + len) > data_->bytes.size()) {
+        data_->bytes.resize(offset + len, 0);
+    }
+    return 0;
+}
+
+int MemoryStorage::zeroRange(off64_t offset, off64_t len) {
+    int ret = allocate(offset, len);
+    if (ret == 0) {
+        std::lock_guard<std::mutex> guard(data_->lock);
+        memset(data_->bytes.data() + offset, 0, len);
+    }
+    return ret;
+}
+
+TailAllocator::TailAllocator(uint64_t chunk_bytes/* = 0*/)
+    : chunk_bytes_(chunk_bytes),
+      loaded_(false),
+      tail_(0),
+      end_(0) {
+}
+
+int TailAllocator::load(Storage* storage, uint64_t trailer/* = 0*/) {
+    int64_t size = 0;
+    int ret = storage->getSize(&size);
+    if (ret) {
+        return ret;
+    }
+
+    end_ = size;
+    tail_ = (static_cast<uint64_t>(size) > trailer ? size - trailer : 0);
+    loaded_ = true;
+    return 0;
+}
+
+void TailAllocator::reset() {
+    loaded_ = false;
+    tail_ = end_ = 0;
+}
+
+int TailAllocator::allocate(Storage* storage, uint64_t align, uint64_t len, bool zero, uint64_t* offset) {
+    int ret = 0;
+    if (!loaded_) {
+        ret = load(storage);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    uint64_t start = libvdk::convert::roundUp(tail_, align);
+    uint64_t new_tail = start + len;
+
+    if (new_tail > end_) {
+        /* grow by a whole chunk, the following allocations are only a pointer bump */
+        uint64_t new_end = std::max(new_tail, end_ + chunk_bytes_);
+        ret = storage->allocate(end_, new_end - end_);
+        if (ret) {
+            return ret;
+        }
+        end_ = new_end;
+    }
+
+    /* preallocated space reads as zero already, a reused trailer does not */
+    if (zero) {
+        ret = storage->zeroRange(start, len);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    tail_ = new_tail;
+    *offset = start;
+    return 0;
+}
+
+int TailAllocator::trim(Storage* storage) {
+    if (!loaded_ || end_ <= tail_) {
+        return 0;
+    }
+
+    int ret = storage->truncate(tail_);
+    if (ret == 0) {
+        end_ = tail_;
+    }
+    return ret;
+}
+
+PageCache::PageCache(uint32_t max_pages/* = 1*/, Reader reader/* = Reader()*/, uint32_t page_size/* = kPageSize*/)
+    : reader_(std::move(reader)),
+      max_pages_(std::max(max_pages, 1u)),
+      page_size_(page_size),
+      dirty_count_(0),
+      last_offset_(0),
+      last_page_(nullptr) {
+}
+
+void PageCache::setMaxPages(uint32_t max_pages) {
+    max_pages_ = std::max(max_pages, 1u);
+
+    while (pages_.size() > max_pages_) {
+        if (evict()) {
+            break;
+        }
+    }
+}
+
+void PageCache::clear() {
+    pages_.clear();
+    lru_.clear();
+    dirty_count_ = 0;
+    last_page_ = nullptr;
+}
+
+bool PageCache::lookup(uint64_t offset, uint8_t** page) {
+    if (last_page_ && last_offset_ == offset) {
+        *page = last_page_->data.get();
+        return true;
+    }
+
+    auto it = pages_.find(offset);
+    if (it == pages_.end()) {
+        return false;
+    }
+
+    lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+    last_offset_ = offset;
+    last_page_ = &it->second;
+    *page = last_page_->data.get();
+    return true;
+}
+
+int PageCache::evict() {
+    uint64_t victim = lru_.back();
+    auto it = pages_.find(victim);
+    if (it->second.dirty) {
+        int ret = writer_(victim, it->second.data.get(), page_size_);
+        if (ret) {
+            return ret;
+        }
+        --dirty_count_;
+    }
+
+    if (last_page_ == &it->second) {
+        last_page_ = nullptr;
+    }
+    pages_.erase(it);
+    lru_.pop_back();
+    return 0;
+}
+
+int PageCache::add(uint64_t offset, Page* np, uint8_t** page) {
+    if (pages_.size() >= max_pages_) {
+        int ret = evict();
+        if (ret) {
+            return ret;
+        }
+    }
+
+    lru_.push_front(offset);
+    np->lru_pos = lru_.begin();
+    np->dirty = false;
+    auto it = pages_.emplace(offset, std::move(*np)).first;
+
+    last_offset_ = offset;
+    last_page_ = &it->second;
+    *page = last_page_->data.get();
+    return 0;
+}
+
+int PageCache::get(uint64_t offset, uint32_t bytes, uint8_t** page) {
+    if (lookup(offset, page)) {
+        return 0;
+    }
+
+    Page np;
+    np.data.reset(new uint8_t[page_size_]());
+    int ret = reader_(offset, np.data.get(), (bytes < page_size_ ? bytes : page_size_));
+    if (ret) {
+        return ret;
+    }
+
+    return add(offset, &np, page);
+}
+
+int PageCache::insert(uint64_t offset, uint8_t** page) {
+    if (lookup(offset, page)) {
+        memset(*page, 0, page_size_);
+        return 0;
+    }
+
+    Page np;
+    np.data.reset(new uint8_t[page_size_]());
+    return add(offset, &np, page);
+}
+
+void PageCache::update(uint64_t offset, const void* buf, size_t len) {
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(buf);
+    uint64_t end = offset + len;
+    for (uint64_t page_off = offset - offset % page_size_; page_off < end; page_off += page_size_) {
+        auto it = pages_.find(page_off);
+        if (it == pages_.end()) {
+            continue;
+        }
+
+        uint64_t from = std::max(offset, page_off);
+        uint64_t to = std::min(end, page_off + page_size_);
+        memcpy(it->second.data.get() + (from - page_off), src + (from - offset), to - from);
+    }
+}
+
+void PageCache::markDirty(uint64_t offset) {
+    auto it = pages_.find(offset);
+    if (it != pages_.end() && !it->second.dirty) {
+        it->second.dirty = true;
+        ++dirty_count_;
+    }
+}
+
+int PageCache::flush() {
+    if (dirty_count_ == 0) {
+        return 0;
+    }
+
+    std::vector<uint64_t> offsets;
+    offsets.reserve(dirty_count_);
+    for (auto& kv : pages_) {
+        if (kv.second.dirty) {
+            offsets.push_back(kv.first);
+        }
+    }
+    /* in file order, the writes go out as one forward sweep */
+    std::sort(offsets.begin(), offsets.end());
+
+    for (uint64_t offset : offsets) {
+        Page& p = pages_[offset];
+        int ret = writer_(offset, p.data.get(), page_size_);
+        if (ret) {
+            return ret;
+        }
+        p.dirty = false;
+        --dirty_count_;
+    }
+    return 0;
+}
+
+namespace {
+    // named memory storages, kept until delete_storage()
+    struct MemoryRegistry {
+        std::mutex lock;
+        std::map<std::string, std::shared_ptr<MemoryStorage::Data>> datas;
+    };
+
+    MemoryRegistry& memory_registry() {
+        static MemoryRegistry registry;
+        return registry;
+    }
+} // namespace
+
+BlockCache::BlockCache()
+    : capacity_(0),
+      hits_(0),
+      misses_(0) {
+}
+
+BlockCache& BlockCache::instance() {
+    static BlockCache cache;
+    return cache;
+}
+
+int BlockCache::fileKey(int fd, FileKey* key) {
+    struct stat st;
+    if (fd < 0) {
+        return -EBADF;
+    }
+    if (::fstat(fd, &st) != 0) {
+        return -errno;
+    }
+
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->size = st.st_size;
+    key->mtime_ns = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ULL + st.st_mtim.tv_nsec;
+    return 0;
+}
+
+void BlockCache::setCapacity(uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = bytes;
+    trim(bytes / kBlockSize);
+    if (!enabled()) {
+        blocks_.clear();
+        a1in_.clear();
+        am_.clear();
+        a1out_.clear();
+    }
+}
+
+BlockCache::Stats BlockCache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats st;
+    st.hits = hits_;
+    st.misses = misses_;
+    st.resident_bytes = static_cast<uint64_t>(a1in_.size() + am_.size()) * kBlockSize;
+    return st;
+}
+
+void BlockCache::reclaim() {
+    uint64_t max_blocks = capacity_ / kBlockSize;
+    /* A1in holds a quarter of the blocks, the ghost list remembers half as many keys */
+    size_t kin = static_cast<size_t>(max_blocks / 4 > 0 ? max_blocks / 4 : 1);
+    size_t kout = static_cast<size_t>(max_blocks / 2);
+
+    if (a1in_.size() > kin || am_.empty()) {
+        BlockKey victim = a1in_.back();
+        a1in_.pop_back();
+
+        if (kout == 0) {
+            blocks_.erase(victim);
+            return;
+        }
+
+        Block& b = blocks_[victim];
+        b.data.reset();
+        b.queue = Queue::kA1out;
+        a1out_.push_front(victim);
+        b.pos = a1out_.begin();
+
+        while (a1out_.size() > kout) {
+            blocks_.erase(a1out_.back());
+            a1out_.pop_back();
+        }
+    } else {
+        blocks_.erase(am_.back());
+        am_.pop_back();
+    }
+}
+
+void BlockCache::trim(uint64_t max_blocks) {
+    while (!(a1in_.empty() && am_.empty()) && a1in_.size() + am_.size() > max_blocks) {
+        reclaim();
+    }
+}
+
+bool BlockCache::lookup(const BlockKey& key, uint32_t in_block, const struct iovec* iov, int iovcnt, size_t iov_offset, size_t len) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = blocks_.find(key);
+    if (it == blocks_.end() || !it->second.data) {
+        return false;
+    }
+
+    Block& b = it->second;
+    if (b.queue == Queue::kAm && b.pos != am_.begin()) {
+        am_.splice(am_.begin(), am_, b.pos);
+    }
+    /* a hit in A1in does not promote, the block may only be part of a scan */
+    libvdk::iov::copy_in(iov, iovcnt, iov_offset, b.data.get() + in_block, len);
+    ++hits_;
+    return true;
+}
+
+bool BlockCache::contains(const BlockKey& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = blocks_.find(key);
+    return (it != blocks_.end() && it->second.data);
+}
+
+void BlockCache::insert(const BlockKey& key, BlockBuffer data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t max_blocks = capacity_ / kBlockSize;
+    ++misses_;
+    if (max_blocks == 0) {
+        return;
+    }
+
+    auto it = blocks_.find(key);
+    bool seen = false;
+    if (it != blocks_.end()) {
+        if (it->second.data) {
+            /* loaded by another reader meanwhile */
+            return;
+        }
+        a1out_.erase(it->second.pos);
+        blocks_.erase(it);
+        seen = true;
+    }
+
+    trim(max_blocks - 1);
+
+    Block& b = blocks_[key];
+    b.data = std::move(data);
+    b.queue = (seen ? Queue::kAm : Queue::kA1in);
+    std::list<BlockKey>& q = queue(b.queue);
+    q.push_front(key);
+    b.pos = q.begin();
+}
+
+void BlockCache::invalidate(const FileKey& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = blocks_.begin(); it != blocks_.end(); ) {
+        if (it->first.file.dev == key.dev && it->first.file.ino == key.ino) {
+            queue(it->second.queue).erase(it->second.pos);
+            it = blocks_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+int BlockCache::readv(const FileKey& key, uint64_t offset, const struct iovec* iov, int iovcnt, const Reader& reader) {
+    size_t total = libvdk::iov::total_size(iov, iovcnt);
+    size_t done = 0;
+    std::vector<BlockBuffer> bufs;
+    std::vector<struct iovec> read_iov;
+
+    while (done < total) {
+        uint64_t pos = offset + done;
+        BlockKey bk = {key, pos - pos % kBlockSize};
+        uint32_t in_block = static_cast<uint32_t>(pos - bk.offset);
+        size_t len = (kBlockSize - in_block < total - done ? kBlockSize - in_block : total - done);
+
+        if (lookup(bk, in_block, iov, iovcnt, done, len)) {
+            done += len;
+            continue;
+        }
+
+        /* the missing run up to the next cached block is read in one go */
+        uint64_t run_start = bk.offset;
+        uint64_t run_end = bk.offset;
+        bufs.clear();
+        read_iov.clear();
+        do {
+            void* p = nullptr;
+            if (::posix_memalign(&p, libvdk::file::kDirectIoAlignment, kBlockSize) != 0) {
+                return -ENOMEM;
+            }
+            /* the tail of the last block of the file stays zero */
+            memset(p, 0, kBlockSize);
+            bufs.emplace_back(static_cast<uint8_t*>(p));
+            struct iovec v;
+            v.iov_base = p;
+            v.iov_len = kBlockSize;
+            read_iov.push_back(v);
+            run_end += kBlockSize;
+        } while (run_end < offset + total && bufs.size() < kMaxReadBlocks &&
+                !contains(BlockKey{key, run_end}));
+
+        int ret = reader(run_start, read_iov.data(), static_cast<int>(read_iov.size()));
+        if (ret) {
+            return ret;
+        }
+
+        for (size_t i = 0; i < bufs.size(); ++i) {
+            BlockKey rk = {key, run_start + i * kBlockSize};
+            uint64_t from = (rk.offset > pos ? rk.offset : pos);
+            uint64_t to = (rk.offset + kBlockSize < offset + total ? rk.offset + kBlockSize : offset + total);
+            libvdk::iov::copy_in(iov, iovcnt, from - offset, bufs[i].get() + (from - rk.offset), to - from);
+            insert(rk, std::move(bufs[i]));
+        }
+        done = run_end - offset < total ? run_end - offset : total;
+    }
+
+    return 0;
+}
+
+WriteBackCache::WriteBackCache()
+    : sector_bits_(9),
+      max_bytes_(0),
+      max_age_ms_(0),
+      dirty_bytes_(0) {
+}
+
+void WriteBackCache::setup(uint32_t sector_bits, uint64_t max_bytes, uint32_t max_age_ms) {
+    sector_bits_ = sector_bits;
+    max_bytes_ = max_bytes;
+    max_age_ms_ = max_age_ms;
+}
+
+void WriteBackCache::write(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt) {
+    uint64_t start = sector_num;
+    uint64_t end = sector_num + nb_sectors;
+
+    /* the extents overlapping or touching [start, end) are merged with it */
+    auto first = extents_.upper_bound(start);
+    if (first != extents_.begin()) {
+        auto prev = std::prev(first);
+        if (prev->first + sectorsOf(prev->second) >= start) {
+            first = prev;
+        }
+    }
+    auto last = first;
+    while (last != extents_.end() && last->first <= end) {
+        ++last;
+    }
+
+    if (extents_.empty()) {
+        dirty_since_ = std::chrono::steady_clock::now();
+    }
+
+    std::vector<uint8_t> merged;
+    uint64_t merged_start = start;
+    if (first != last) {
+        uint64_t last_end = std::prev(last)->first + sectorsOf(std::prev(last)->second);
+        end = std::max(end, last_end);
+        if (first->first <= start) {
+            /* appending to an extent grows it in place, sequential writes are not copied again */
+            merged_start = first->first;
+            merged.swap(first->second);
+        }
+    }
+    dirty_bytes_ -= merged.size();
+    merged.resize((end - merged_start) << sector_bits_);
+
+    for (auto it = first; it != last; ++it) {
+        if (!it->second.empty()) {
+            memcpy(merged.data() + ((it->first - merged_start) << sector_bits_), it->second.data(), it->second.size());
+            dirty_bytes_ -= it->second.size();
+        }
+    }
+    extents_.erase(first, last);
+
+    /* the new data wins over what was dirty before */
+    size_t done = 0;
+    size_t len = static_cast<size_t>(nb_sectors) << sector_bits_;
+    uint8_t* dst = merged.data() + ((start - merged_start) << sector_bits_);
+    for (int i = 0; i < iovcnt && done < len; ++i) {
+        size_t n = std::min(iov[i].iov_len, len - done);
+        memcpy(dst + done, iov[i].iov_base, n);
+        done += n;
+    }
+
+    dirty_bytes_ += merged.size();
+    extents_[merged_start].swap(merged);
+}
+
+void WriteBackCache::overlay(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt) const {
+    uint64_t end = sector_num + nb_sectors;
+    auto it = extents_.upper_bound(sector_num);
+    if (it != extents_.begin()) {
+        --it;
+    }
+
+    for (; it != extents_.end() && it->first < end; ++it) {
+        uint64_t ext_end = it->first + sectorsOf(it->second);
+        uint64_t from = std::max(sector_num, it->first);
+        uint64_t to = std::min(end, ext_end);
+        if (from >= to) {
+            continue;
+        }
+
+        libvdk::iov::copy_in(iov, iovcnt, (from - sector_num) << sector_bits_, 
+            it->second.data() + ((from - it->first) << sector_bits_), (to - from) << sector_bits_);
+    }
+}
+
+bool WriteBackCache::needFlush() const {
+    if (extents_.empty()) {
+        return false;
+    }
+    if (dirty_bytes_ > max_bytes_) {
+        return true;
+    }
+    if (max_age_ms_ == 0) {
+        return false;
+    }
+
+    auto age = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - dirty_since_);
+    return (age.count() >= max_age_ms_);
+}
+
+int WriteBackCache::flush(const Writer& writer) {
+    int ret = 0;
+    auto it = extents_.begin();
+    for (; it != extents_.end(); ++it) {
+        struct iovec v;
+        v.iov_base = it->second.data();
+        v.iov_len = it->second.size();
+        ret = writer(it->first, static_cast<uint32_t>(sectorsOf(it->second)), &v, 1);
+        if (ret) {
+            break;
+        }
+        dirty_bytes_ -= it->second.size();
+    }
+    extents_.erase(extents_.begin(), it);
+
+    if (!extents_.empty()) {
+        /* what is left is retried by the next flush */
+        dirty_since_ = std::chrono::steady_clock::now();
+    }
+    return ret;
+}
+
+void WriteBackCache::clear() {
+    extents_.clear();
+    dirty_bytes_ = 0;
+}
+
+void ChainMap::reset(uint64_t blocks) {
+    blocks_ = blocks;
+    pages_.clear();
+    pages_.resize((blocks + kPageEntries - 1) / kPageEntries);
+}
+
+uint64_t ChainMap::get(uint64_t block) const {
+    if (block >= blocks_) {
+        return kUnknown;
+    }
+
+    const std::unique_ptr<uint64_t[]>& page = pages_[block / kPageEntries];
+    return (page ? page[block % kPageEntries] : kUnknown);
+}
+
+void ChainMap::set(uint64_t block, uint64_t value) {
+    if (block >= blocks_) {
+        return;
+    }
+
+    std::unique_ptr<uint64_t[]>& page = pages_[block / kPageEntries];
+    if (!page) {
+        page.reset(new uint64_t[kPageEntries]());
+    }
+    page[block % kPageEntries] = value;
+}
+
+void ChainMap::invalidate(uint64_t first, uint64_t last) {
+    for (uint64_t block = first; block <= last && block < blocks_; ++block) {
+        std::unique_ptr<uint64_t[]>& page = pages_[block / kPageEntries];
+        if (page) {
+            page[block % kPageEntries] = kUnknown;
+        }
+    }
+}
+
+/* the file is about to change or go away, blocks cached from it are of no use any more */
+static void drop_cached_blocks(int fd) {
+    BlockCache::FileKey key;
+    if (BlockCache::fileKey(fd, &key) == 0) {
+        BlockCache::instance().invalidate(key);
+    }
+}
+
+static void drop_cached_blocks(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        drop_cached_blocks(fd);
+        ::close(fd);
+    }
+}
+
+bool is_memory_path(const std::string& path) {
+    return path.compare(0, sizeof(kMemoryPrefix) - 1, kMemoryPrefix) == 0;
+}
+
+int open_storage(const std::string& path, bool read_only, bool direct, std::unique_ptr<Storage>* storage) {
+    if (is_memory_path(path)) {
+        MemoryRegistry& registry = memory_registry();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        auto it = registry.datas.find(path);
+        if (it == registry.datas.end()) {
+            return -ENOENT;
+        }
+
+        storage->reset(new MemoryStorage(it->second, read_only));
+        return 0;
+    }
+
+    std::unique_ptr<PosixStorage> ps(new PosixStorage());
+    int ret = ps->open(path, read_only, direct);
+    if (ret == 0) {
+        if (!read_only) {
+            drop_cached_blocks(ps->fd());
+        }
+        storage->reset(ps.release());
+    }
+    return ret;
+}
+
+int create_storage(const std::string& path, std::unique_ptr<Storage>* storage) {
+    if (is_memory_path(path)) {
+        MemoryRegistry& registry = memory_registry();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        /* same as create_file: an existing one is truncated */
+        std::shared_ptr<MemoryStorage::Data> data = std::make_shared<MemoryStorage::Data>();
+        registry.datas[path] = data;
+
+        storage->reset(new MemoryStorage(data, false));
+        return 0;
+    }
+
+    std::unique_ptr<PosixStorage> ps(new PosixStorage());
+    int ret = ps->create(path);
+    if (ret == 0) {
+        drop_cached_blocks(ps->fd());
+        storage->reset(ps.release());
+    }
+    return ret;
+}
+
+int delete_storage(const std::string& path) {
+    if (is_memory_path(path)) {
+        MemoryRegistry& registry = memory_registry();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        return (registry.datas.erase(path) ? 0 : -ENOENT);
+    }
+
+    drop_cached_blocks(path);
+    return (libvdk::file::delete_file(path) == 0 ? 0 : -errno);
+}
+
+int exist_storage(const std::string& path) {
+    if (is_memory_path(path)) {
+        MemoryRegistry& registry = memory_registry();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        return (registry.datas.count(path) ? 0 : -ENOENT);
+    }
+
+    return libvdk::file::exist_file(path);
+}
+
+int copy_storage(const std::string& src_path, const std::string& dst_path) {
+    if (!is_memory_path(src_path) && !is_memory_path(dst_path)) {
+        drop_cached_blocks(dst_path);
+        return libvdk::file::copy_file(src_path, dst_path);
+    }
+
+    const uint64_t kCopyChunk = 8 * kMiB;
+    std::unique_ptr<Storage> src, dst;
+    std::vector<uint8_t> buf;
+    int64_t size = 0;
+
+    int ret = open_storage(src_path, true, false, &src);
+    if (ret) {
+        return ret;
+    }
+    ret = src->getSize(&size);
+    if (ret) {
+        return ret;
+    }
+
+    ret = create_storage(dst_path, &dst);
+    if (ret) {
+        return ret;
+    }
+
+    ret = dst->truncate(size);
+    buf.resize(std::min<uint64_t>(kCopyChunk, size));
+    for (uint64_t offset = 0; ret == 0 && offset < static_cast<uint64_t>(size); offset += kCopyChunk) {
+        size_t len = std::min<uint64_t>(kCopyChunk, size - offset);
+        ret = src->read(offset, buf.data(), len);
+        if (ret == 0) {
+            ret = dst->write(offset, buf.data(), len);
+        }
+    }
+    if (ret == 0) {
+        ret = dst->flush();
+    }
+
+    dst.reset();
+    if (ret) {
+        delete_storage(dst_path);
+    }
+    return ret;
+}
+
+std::string absolute_path(const std::string& path, int* err) {
+    if (is_memory_path(path)) {
+        *err = exist_storage(path);
+        return (*err == 0 ? path : std::string());
+    }
+
+    return libvdk::file::absolute_path(path, err);
+}
+
+std::string relative_path_to(const std::string& path, const std::string& another_path, int* err) {
+    if (is_memory_path(another_path)) {
+        *err = 0;
+        return another_path;
+    }
+
+    return libvdk::file::relative_path_to(path, another_path, err);
+}
+
+} // namespace storage
+} // namespace libvdk
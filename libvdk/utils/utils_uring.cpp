@@ -0,0 +1,381 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#endif
+
+#include "utils.h"
+
+namespace libvdk {
+namespace file {
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+struct IoBatch::Ring {
+    int fd;
+    struct io_uring_params params;
+
+    void*    sq_ptr;
+    size_t   sq_len;
+    void*    cq_ptr;
+    size_t   cq_len;
+    struct io_uring_sqe* sqes;
+    size_t   sqes_len;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    Ring() : fd(-1), sq_ptr(MAP_FAILED), sq_len(0), cq_ptr(MAP_FAILED), cq_len(0),
+             sqes(reinterpret_cast<struct io_uring_sqe*>(MAP_FAILED)), sqes_len(0) {
+        memset(&params, 0, sizeof(params));
+    }
+
+    ~Ring() {
+        if (sqes != MAP_FAILED) {
+            ::munmap(sqes, sqes_len);
+        }
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+            ::munmap(cq_ptr, cq_len);
+        }
+        if (sq_ptr != MAP_FAILED) {
+            ::munmap(sq_ptr, sq_len);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    int setup(unsigned int entries) {
+        fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0) {
+            return -errno;
+        }
+
+        sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_len = cq_len = std::max(sq_len, cq_len);
+        }
+
+        sq_ptr = ::mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            return -errno;
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ptr = sq_ptr;
+        } else {
+            cq_ptr = ::mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED) {
+                return -errno;
+            }
+        }
+
+        sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = reinterpret_cast<struct io_uring_sqe*>(::mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) {
+            return -errno;
+        }
+
+        uint8_t* sq = reinterpret_cast<uint8_t*>(sq_ptr);
+        uint8_t* cq = reinterpret_cast<uint8_t*>(cq_ptr);
+        sq_head  = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail  = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask  = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cq_head  = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail  = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask  = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes     = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        return 0;
+    }
+
+    int enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+        int ret = static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+        return (ret < 0 ? -errno : ret);
+    }
+
+    int registerOp(unsigned int opcode, const void* arg, unsigned int nr_args) {
+        int ret = static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+        return (ret < 0 ? -errno : ret);
+    }
+};
+
+#else
+
+struct IoBatch::Ring {
+    int fd = -1;
+};
+
+#endif
+
+IoBatch::IoBatch(unsigned int queue_depth/* = kDefaultQueueDepth*/)
+    : queue_depth_(0),
+      queued_(0),
+      inflight_(0),
+      error_(0) {
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+    std::unique_ptr<Ring> ring(new Ring());
+    int ret = ring->setup(queue_depth);
+    if (ret == 0) {
+        ring_ = std::move(ring);
+        queue_depth_ = ring_->params.sq_entries;
+    }
+#else
+    (void)queue_depth;
+#endif
+}
+
+IoBatch::~IoBatch() {
+    wait();
+}
+
+int IoBatch::registerFiles(const std::vector<int>& fds) {
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+    if (!ring_) {
+        return -ENOTSUP;
+    }
+
+    wait();
+
+    if (!files_.empty()) {
+        ring_->registerOp(IORING_UNREGISTER_FILES, nullptr, 0);
+        files_.clear();
+    }
+
+    int ret = ring_->registerOp(IORING_REGISTER_FILES, fds.data(), fds.size());
+    if (ret < 0) {
+        return ret;
+    }
+    files_ = fds;
+    return 0;
+#else
+    (void)fds;
+    return -ENOTSUP;
+#endif
+}
+
+int IoBatch::registerBuffers(const struct iovec* iov, int iovcnt) {
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+    if (!ring_) {
+        return -ENOTSUP;
+    }
+
+    wait();
+
+    if (!buffers_.empty()) {
+        ring_->registerOp(IORING_UNREGISTER_BUFFERS, nullptr, 0);
+        buffers_.clear();
+    }
+
+    int ret = ring_->registerOp(IORING_REGISTER_BUFFERS, iov, iovcnt);
+    if (ret < 0) {
+        return ret;
+    }
+    buffers_.assign(iov, iov + iovcnt);
+    return 0;
+#else
+    (void)iov;
+    (void)iovcnt;
+    return -ENOTSUP;
+#endif
+}
+
+int IoBatch::read(int fd, off64_t offset, void* buf, size_t size) {
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = size;
+    return queue(fd, offset, &iov, 1, false);
+}
+
+int IoBatch::readv(int fd, off64_t offset, const struct iovec* iov, int iovcnt) {
+    return queue(fd, offset, iov, iovcnt, false);
+}
+
+int IoBatch::write(int fd, off64_t offset, const void* buf, size_t size) {
+    struct iovec iov;
+    iov.iov_base = const_cast<void*>(buf);
+    iov.iov_len = size;
+    return queue(fd, offset, &iov, 1, true);
+}
+
+int IoBatch::writev(int fd, off64_t offset, const struct iovec* iov, int iovcnt) {
+    return queue(fd, offset, iov, iovcnt, true);
+}
+
+int IoBatch::queue(int fd, off64_t offset, const struct iovec* iov, int iovcnt, bool is_write) {
+    if (!ring_) {
+        /* no io_uring, done right now */
+        int ret = is_write ? pwritev_file(fd, offset, iov, iovcnt) : preadv_file(fd, offset, iov, iovcnt);
+        if (ret && error_ == 0) {
+            error_ = ret;
+        }
+        return ret;
+    }
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+    if (queued_ + inflight_ >= queue_depth_) {
+        int ret = reap(queued_ + inflight_);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    requests_.emplace_back();
+    Request& req = requests_.back();
+    req.fd = fd;
+    req.offset = offset;
+    req.iov.assign(iov, iov + iovcnt);
+    req.is_write = is_write;
+
+    struct io_uring_sqe* sqe;
+    unsigned tail = *ring_->sq_tail;
+    unsigned index = tail & *ring_->sq_mask;
+    sqe = &ring_->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+
+    int buf_index = -1;
+    if (iovcnt == 1) {
+        buf_index = fixedBufferIndex(iov[0].iov_base, iov[0].iov_len);
+    }
+    if (buf_index >= 0) {
+        sqe->opcode = is_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = reinterpret_cast<uint64_t>(iov[0].iov_base);
+        sqe->len = iov[0].iov_len;
+        sqe->buf_index = buf_index;
+    } else {
+        sqe->opcode = is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = reinterpret_cast<uint64_t>(req.iov.data());
+        sqe->len = req.iov.size();
+    }
+
+    std::vector<int>::const_iterator it = std::find(files_.begin(), files_.end(), fd);
+    if (it != files_.end()) {
+        sqe->fd = static_cast<int>(it - files_.begin());
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = fd;
+    }
+    sqe->off = offset;
+    sqe->user_data = requests_.size() - 1;
+
+    ring_->sq_array[index] = index;
+    __atomic_store_n(ring_->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++queued_;
+#endif
+
+    return 0;
+}
+
+int IoBatch::wait() {
+    int ret = 0;
+    if (ring_) {
+        ret = reap(queued_ + inflight_);
+    }
+    if (ret == 0) {
+        ret = error_;
+    }
+    error_ = 0;
+    return ret;
+}
+
+int IoBatch::reap(unsigned int count) {
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+    while (count > 0) {
+        int ret = ring_->enter(queued_, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0) {
+            if (ret == -EINTR || ret == -EAGAIN) {
+                continue;
+            }
+            CONSLOG("io_uring_enter failed - %d", ret);
+            return ret;
+        }
+        queued_ -= std::min(queued_, static_cast<unsigned int>(ret));
+        inflight_ += ret;
+
+        unsigned head = *ring_->cq_head;
+        unsigned tail = __atomic_load_n(ring_->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail && count > 0; ++head, --count) {
+            struct io_uring_cqe* cqe = &ring_->cqes[head & *ring_->cq_mask];
+            complete(cqe->user_data, cqe->res);
+            --inflight_;
+        }
+        __atomic_store_n(ring_->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (queued_ + inflight_ == 0) {
+        requests_.clear();
+    }
+#else
+    (void)count;
+#endif
+    return 0;
+}
+
+void IoBatch::complete(uint64_t index, int res) {
+    const Request& req = requests_[index];
+    size_t total = iov::total_size(req.iov.data(), req.iov.size());
+    int ret = 0;
+
+    /* transient, or a request not aligned for O_DIRECT that the sync path bounces,
+     * the whole request is done again synchronously. Any other error is final */
+    if (res == -EAGAIN || res == -EINTR || (res == -EINVAL && (::fcntl(req.fd, F_GETFL) & O_DIRECT))) {
+        res = 0;
+    }
+
+    if (res < 0) {
+        ret = res;
+    } else if (static_cast<size_t>(res) < total) {
+        /* short transfer, finish the rest synchronously */
+        std::vector<struct iovec> rest;
+        iov::slice(req.iov.data(), req.iov.size(), res, total - res, &rest);
+        if (req.is_write) {
+            ret = pwritev_file(req.fd, req.offset + res, rest.data(), rest.size());
+        } else {
+            ret = preadv_file(req.fd, req.offset + res, rest.data(), rest.size());
+
+            /* end of file after some data, same as pread_file */
+            int64_t file_size = 0;
+            if (ret == -EIO && res > 0 && get_file_sizes(req.fd, &file_size) == 0 &&
+                    req.offset + res >= file_size) {
+                ret = 0;
+            }
+        }
+    }
+
+    if (ret && error_ == 0) {
+        CONSLOG("%s of %zu bytes at %" PRId64 " failed - %d",
+            (req.is_write ? "write" : "read"), total, static_cast<int64_t>(req.offset), ret);
+        error_ = ret;
+    }
+}
+
+int IoBatch::fixedBufferIndex(const void* buf, size_t len) const {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(buf);
+    for (size_t i = 0; i < buffers_.size(); ++i) {
+        const uint8_t* b = reinterpret_cast<const uint8_t*>(buffers_[i].iov_base);
+        if (p >= b && p + len <= b + buffers_[i].iov_len) {
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+} // namespace file
+} // namespace libvdk
@@ -0,0 +1,108 @@
+#include "bat.h"
+
+#include <algorithm>
+#include <cinttypes>
+
+namespace vhdx {
+namespace bat {
+
+BatTable::BatTable()
+    : storage_(nullptr),
+      file_offset_(0),
+      entry_count_(0),
+      cache_(kDefaultCacheBytes / kPageSize) {
+}
+
+int BatTable::load(libvdk::storage::Storage* storage, uint64_t file_offset, uint64_t entry_count) {
+    unload();
+
+    storage_ = storage;
+    file_offset_ = file_offset;
+    entry_count_ = entry_count;
+    cache_.setReader([storage](uint64_t offset, void* buf, size_t len) {
+        return storage->read(offset, buf, len);
+    });
+    return 0;
+}
+
+void BatTable::unload() {
+    cache_.clear();
+    cache_.setReader(libvdk::storage::PageCache::Reader());
+    storage_ = nullptr;
+    file_offset_ = entry_count_ = 0;
+}
+
+void BatTable::setCacheBytes(uint64_t bytes) {
+    cache_.setMaxPages(std::max<uint64_t>(bytes / kPageSize, kMinCachePages));
+}
+
+uint32_t BatTable::pageBytes(uint32_t page_index) const {
+    uint64_t page_pos = static_cast<uint64_t>(page_index) * kPageSize;
+    return std::min<uint64_t>(kPageSize, entry_count_ * sizeof(BatEntry) - page_pos);
+}
+
+int BatTable::page(uint32_t index, BatEntry** entries) {
+    if (index >= entry_count_) {
+        CONSLOG("bat index: %u out of range: %" PRIu64, index, entry_count_);
+        return -EINVAL;
+    }
+
+    uint32_t page_index = index / kEntriesPerPage;
+    uint64_t offset = file_offset_ + static_cast<uint64_t>(page_index) * kPageSize;
+    uint8_t* data = nullptr;
+    int ret = cache_.get(offset, pageBytes(page_index), &data);
+    if (ret) {
+        CONSLOG("read bat page at offset: %" PRIu64 " failed", offset);
+        return ret;
+    }
+
+    *entries = reinterpret_cast<BatEntry*>(data);
+    return 0;
+}
+
+int BatTable::get(uint32_t index, BatEntry* entry) {
+    BatEntry* entries = nullptr;
+    int ret = page(index, &entries);
+    if (ret == 0) {
+        *entry = entries[index % kEntriesPerPage];
+    }
+    return ret;
+}
+
+bool BatTable::peek(uint32_t index, BatEntry* entry) {
+    uint8_t* data = nullptr;
+    if (index >= entry_count_ || !cache_.lookup(pageOffset(index), &data)) {
+        return false;
+    }
+
+    *entry = reinterpret_cast<BatEntry*>(data)[index % kEntriesPerPage];
+    return true;
+}
+
+int BatTable::set(uint32_t index, BatEntry entry) {
+    BatEntry* entries = nullptr;
+    int ret = page(index, &entries);
+    if (ret == 0) {
+        entries[index % kEntriesPerPage] = entry;
+    }
+    return ret;
+}
+
+int BatTable::writeEntry(uint32_t index) {
+    BatEntry* entries = nullptr;
+    int ret = page(index, &entries);
+    if (ret) {
+        return ret;
+    }
+
+    uint32_t page_index = index / kEntriesPerPage;
+    uint64_t offset = file_offset_ + static_cast<uint64_t>(page_index) * kPageSize;
+    ret = storage_->write(offset, entries, pageBytes(page_index));
+    if (ret) {
+        CONSLOG("write bat page at offset: %" PRIu64 " failed", offset);
+    }
+    return ret;
+}
+
+} // namespace bat
+} // namespace vhdx
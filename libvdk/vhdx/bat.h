@@ -0,0 +1,84 @@
+#ifndef LIBVDK_VHDX_BAT_H_
+#define LIBVDK_VHDX_BAT_H_
+
+#include <stdint.h>
+
+#include "common.h"
+#include "utils.h"
+
+namespace vhdx {
+namespace bat {
+
+/*
+ BAT按4KiB页按需读入, 只缓存用到的页, 超过cache上限时淘汰最久没用的页
+ 修改过的表项已经写回文件(writeEntry)或加入日志, 淘汰后重新读入的页由reader补上日志中未提交的更新,
+ 缓存至少保留kMinCachePages页
+ example:
+    BatTable bt;
+    bt.load(storage, bat_offset, total_bat_count);
+    bt.get(index, &entry);
+    bt.set(index, entry);
+    bt.writeEntry(index);
+*/
+class BatTable {
+public:
+    static const uint32_t kPageSize = libvdk::storage::PageCache::kPageSize;
+    static const uint32_t kEntriesPerPage = kPageSize / sizeof(BatEntry);
+    static const uint32_t kMinCachePages = 4;
+    static const uint64_t kDefaultCacheBytes = 8 * libvdk::kMiB;
+
+    BatTable();
+    ~BatTable() = default;
+
+    BatTable(const BatTable&) = delete;
+    BatTable& operator=(const BatTable&) = delete;
+
+    // nothing is read here, pages are read on first use
+    int  load(libvdk::storage::Storage* storage, uint64_t file_offset, uint64_t entry_count);
+    void unload();
+
+    // pages are read through reader instead of straight from the storage
+    void setReader(libvdk::storage::PageCache::Reader reader) {
+        cache_.setReader(std::move(reader));
+    }
+
+    void setCacheBytes(uint64_t bytes);
+    uint64_t cacheBytes() const {
+        return cache_.maxPages() * static_cast<uint64_t>(kPageSize);
+    }
+
+    uint64_t count() const {
+        return entry_count_;
+    }
+    size_t residentPages() const {
+        return cache_.residentPages();
+    }
+
+    int get(uint32_t index, BatEntry* entry);
+    // only from a cached page, false if the page is not read yet
+    bool peek(uint32_t index, BatEntry* entry);
+    // file offset of the page holding index
+    uint64_t pageOffset(uint32_t index) const {
+        return file_offset_ + static_cast<uint64_t>(index / kEntriesPerPage) * kPageSize;
+    }
+    // only the cached page is changed
+    int set(uint32_t index, BatEntry entry);
+    // write the cached page holding the entry to the file
+    int writeEntry(uint32_t index);
+
+private:
+    // entries of the page holding index
+    int  page(uint32_t index, BatEntry** entries);
+    uint32_t pageBytes(uint32_t page_index) const;
+
+    libvdk::storage::Storage* storage_;
+    uint64_t file_offset_;
+    uint64_t entry_count_;
+
+    libvdk::storage::PageCache cache_;
+};
+
+} // namespace bat
+} // namespace vhdx
+
+#endif
@@ -35,6 +35,8 @@ const uint64_t kSeqNumForCreate = 0x0aUL;
 
 const uint32_t kLogSectionInitOffset = (1 * libvdk::kMiB);
 const uint32_t kLogSectionInitSize = (1 * libvdk::kMiB);
+// logs up to this size are read into memory at once when searched on open
+const uint32_t kLogSearchBufMaxSize = (64 * libvdk::kMiB);
 
 } // namespace log
 
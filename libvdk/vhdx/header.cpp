@@ -1,6 +1,7 @@
 #include "header.h"
 
 #include <inttypes.h>
+#include <array>
 #include <cassert>
 #include <cstdio>
 #include <cstring>
@@ -77,20 +78,20 @@ HeaderSection::~HeaderSection () {
  * The VHDX spec calls for header updates to be performed twice, so that both
  * the current and non-current header have valid info
  */
-int HeaderSection::updateHeader(int fd, const libvdk::guid::GUID* file_rw_guid/* = nullptr*/, const libvdk::guid::GUID* log_guid/* = nullptr*/) {
+int HeaderSection::updateHeader(libvdk::storage::Storage* storage, const libvdk::guid::GUID* file_rw_guid/* = nullptr*/, const libvdk::guid::GUID* log_guid/* = nullptr*/) {
     int ret = 0;
     // assert(file_rw_guid != nullptr && 
     //     memcmp(file_rw_guid, &libvdk::guid::kNullGuid, sizeof(libvdk::guid::GUID)) != 0);
 
-    ret = updateInactiveHeader(fd, file_rw_guid, log_guid);
+    ret = updateInactiveHeader(storage, file_rw_guid, log_guid);
     if (ret) {
         return ret;
     }
 
-    return updateInactiveHeader(fd, file_rw_guid, log_guid);
+    return updateInactiveHeader(storage, file_rw_guid, log_guid);
 }
 
-int HeaderSection::updateInactiveHeader(int fd, const libvdk::guid::GUID* file_rw_guid, const libvdk::guid::GUID* log_guid) {
+int HeaderSection::updateInactiveHeader(libvdk::storage::Storage* storage, const libvdk::guid::GUID* file_rw_guid, const libvdk::guid::GUID* log_guid) {
     int ret = 0;
     int hdr_index = 0;
     uint64_t header_offset = vhdx::header::kHeader1InitOffset;
@@ -119,7 +120,7 @@ int HeaderSection::updateInactiveHeader(int fd, const libvdk::guid::GUID* file_r
 
     libvdk::guid::generate(&inactive->data_write_guid);    
 
-    ret = writeHeader(fd, header_offset, inactive);
+    ret = writeHeader(storage, header_offset, inactive);
     if (ret) {
         CONSLOG("write header[%d] failed - %d", hdr_index, ret);
         goto exit;
@@ -177,24 +178,25 @@ uint32_t HeaderSection::calcRegionTableCrc(const RegionTable* region_table) {
     return chksum;
 }
 
-void HeaderSection::initContent(uint32_t total_bat_occupy_mb_count, uint64_t init_seq_num /*=0*/) {
+void HeaderSection::initContent(uint32_t total_bat_occupy_mb_count, uint64_t init_seq_num /*=0*/, 
+    uint32_t log_length/* = vhdx::log::kLogSectionInitSize*/, uint64_t log_offset/* = vhdx::log::kLogSectionInitOffset*/) {
     initFileIdentifier();
-    initHeader(init_seq_num);
+    initHeader(init_seq_num, log_length, log_offset);
     initRegionTable(total_bat_occupy_mb_count);
 }
 
-int  HeaderSection::parseContent(int fd) {
-    int ret = parseFileIdentifier(fd);
+int  HeaderSection::parseContent(libvdk::storage::Storage* storage) {
+    int ret = parseFileIdentifier(storage);
     if (ret) {
         return ret;
     }
 
-    ret = parseHeader(fd);
+    ret = parseHeader(storage);
     if (ret) {
         return ret;
     }
 
-    ret = parseRegionTable(fd);
+    ret = parseRegionTable(storage);
     return ret;
 }
 
@@ -206,7 +208,7 @@ void HeaderSection::initFileIdentifier() {
     memcpy(file_identifier_.creator, wstr.str(), wstr.len());
 }
 
-void HeaderSection::initHeader(uint64_t init_seq_num) {
+void HeaderSection::initHeader(uint64_t init_seq_num, uint32_t log_length, uint64_t log_offset) {
     uint64_t sn = (init_seq_num == 0 ? kHeaderSeqNumForCreate : init_seq_num);    
     
     Header header;
@@ -224,8 +226,8 @@ void HeaderSection::initHeader(uint64_t init_seq_num) {
 
     h->log_version = 0;
     h->version = 1;
-    h->log_length = vhdx::log::kLogSectionInitOffset;
-    h->log_offset = vhdx::log::kLogSectionInitSize;
+    h->log_length = log_length;
+    h->log_offset = log_offset;
 
     for (int i=0; i<2; ++i) {        
         h->checksum = 0x0;    
@@ -266,8 +268,8 @@ void HeaderSection::initRegionTable(uint32_t total_bat_occupy_mb_count) {
     memcpy(&region_tables_[1], r, sizeof(region_tables_[0]));
 }
 
-int HeaderSection::parseFileIdentifier(int fd) {
-    int ret = libvdk::file::read_file(fd, 
+int HeaderSection::parseFileIdentifier(libvdk::storage::Storage* storage) {
+    int ret = storage->read(kFileIdentifierInitOffset,
                 static_cast<void *>(&file_identifier_), sizeof(file_identifier_));
 
     if (memcmp(file_identifier_.signature, kFileIdentifierSignature, sizeof(file_identifier_.signature)) != 0) {
@@ -278,7 +280,7 @@ int HeaderSection::parseFileIdentifier(int fd) {
     return ret;
 }
 
-int HeaderSection::parseHeader(int fd) {
+int HeaderSection::parseHeader(libvdk::storage::Storage* storage) {
     int ret = 0;
     off64_t offset = vhdx::header::kHeader1InitOffset; // 64K    
     //std::array<uint8_t, kHeaderCrcArrayBufSize> array_buf; 
@@ -286,14 +288,8 @@ int HeaderSection::parseHeader(int fd) {
     uint64_t max_seq_num = 0UL;    
 
     for (int i=0; i<2; ++i) {
-        ret = libvdk::file::seek_file(fd, offset, SEEK_SET);
-        if (ret) {
-            CONSLOG("seek header offset: 0x%lx failed - %d", offset, ret);
-            break;
-        }               
-
         //ret = libvdk::file::read_file(fd, static_cast<void *>(array_buf.data()), kHeaderCrcArrayBufSize);
-        ret = libvdk::file::read_file(fd, static_cast<void *>(&tmp_header), sizeof(Header));
+        ret = storage->read(offset, static_cast<void *>(&tmp_header), sizeof(Header));
         if (ret) {
             CONSLOG("read header[%d] failed - %d", i, ret);
             break;
@@ -328,19 +324,13 @@ int HeaderSection::parseHeader(int fd) {
     return ret;
 }
 
-int HeaderSection::parseRegionTable(int fd) {
+int HeaderSection::parseRegionTable(libvdk::storage::Storage* storage) {
     int ret = 0;
     off64_t offset = vhdx::header::kRegion1InitOffset; // 192K    
     RegionTable tmp_rt;
 
     for (int i=0; i<2; ++i) {
-        ret = libvdk::file::seek_file(fd, offset, SEEK_SET);
-        if (ret) {
-            CONSLOG("seek region offset: 0x%lx failed - %d", offset, ret);
-            break;
-        }        
-
-        ret = libvdk::file::read_file(fd, static_cast<void *>(&tmp_rt), sizeof(RegionTable));
+        ret = storage->read(offset, static_cast<void *>(&tmp_rt), sizeof(RegionTable));
         if (ret) {
             CONSLOG("read region[%d] failed - %d", i, ret);
             break;
@@ -445,17 +435,12 @@ void HeaderSection::showRegion() const {
     }
 }
 
-int HeaderSection::writeHeader(int fd, uint64_t offset, Header* h) {
+int HeaderSection::writeHeader(libvdk::storage::Storage* storage, uint64_t offset, Header* h) {
     int ret = 0;
 
     h->checksum = calcHeaderCrc(h);
 
-    ret = libvdk::file::seek_file(fd, offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to offset: %" PRIu64 " failed", offset);
-        return ret;
-    }
-    ret = libvdk::file::write_file(fd, h, sizeof(*h));
+    ret = storage->write(offset, h, sizeof(*h));
     if (ret) {
         CONSLOG("write header failed");
         return ret;
@@ -464,17 +449,12 @@ int HeaderSection::writeHeader(int fd, uint64_t offset, Header* h) {
     return ret;
 }
 
-int HeaderSection::writeRegionTable(int fd, uint64_t offset, RegionTable* rt) {
+int HeaderSection::writeRegionTable(libvdk::storage::Storage* storage, uint64_t offset, RegionTable* rt) {
     int ret = 0;
 
     //rt->header.checksum = calcRegionTableCrc(rt);
 
-    ret = libvdk::file::seek_file(fd, offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to offset: %" PRIu64 " failed", offset);
-        return ret;
-    }
-    ret = libvdk::file::write_file(fd, rt, sizeof(*rt));
+    ret = storage->write(offset, rt, sizeof(*rt));
     if (ret) {
         CONSLOG("write region table failed");
         return ret;
@@ -483,16 +463,11 @@ int HeaderSection::writeRegionTable(int fd, uint64_t offset, RegionTable* rt) {
     return ret;
 }
 
-int HeaderSection::writeContent(int fd) {
+int HeaderSection::writeContent(libvdk::storage::Storage* storage) {
     int ret = 0;
     
     // file identifier
-    ret = libvdk::file::seek_file(fd, kFileIdentifierInitOffset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to offset: %u failed", kFileIdentifierInitOffset);
-        return ret;
-    }
-    ret = libvdk::file::write_file(fd, &file_identifier_, sizeof(file_identifier_));
+    ret = storage->write(kFileIdentifierInitOffset, &file_identifier_, sizeof(file_identifier_));
     if (ret) {
         CONSLOG("write file identifier failed");
         return ret;
@@ -503,7 +478,7 @@ int HeaderSection::writeContent(int fd) {
     for (int i=0; i<2; ++i) {
         offset = (i == 0 ? kHeader1InitOffset : kHeader2InitOffset);         
 
-        ret = writeHeader(fd, offset, &headers_[i]);
+        ret = writeHeader(storage, offset, &headers_[i]);
         if (ret) {
             return ret;
         }
@@ -512,7 +487,7 @@ int HeaderSection::writeContent(int fd) {
     for (int i=0; i<2; ++i) {
         offset = (i == 0 ? kRegion1InitOffset : kRegion2InitOffset);
 
-        ret = writeRegionTable(fd, offset, &region_tables_[i]);
+        ret = writeRegionTable(storage, offset, &region_tables_[i]);
         if (ret) {
             return ret;
         }
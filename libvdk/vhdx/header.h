@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <memory>
 #include "utils.h"
+#include "common.h"
 
 namespace vhdx {
 namespace header {
@@ -67,9 +68,10 @@ public:
     HeaderSection();
     ~HeaderSection();
 
-    void initContent(uint32_t total_bat_occupy_mb_count, uint64_t init_seq_num = 0);
-    int  writeContent(int fd);
-    int  parseContent(int fd);    
+    void initContent(uint32_t total_bat_occupy_mb_count, uint64_t init_seq_num = 0, 
+        uint32_t log_length = vhdx::log::kLogSectionInitSize, uint64_t log_offset = vhdx::log::kLogSectionInitOffset);
+    int  writeContent(libvdk::storage::Storage* storage);
+    int  parseContent(libvdk::storage::Storage* storage);    
 
     const libvdk::guid::GUID& activeHeaderDataWriteGuid() const {
         return headers_[active_header_index_].data_write_guid;
@@ -110,7 +112,7 @@ public:
         return headers_[active_header_index_].log_version;
     }
 
-    int updateHeader(int fd, const libvdk::guid::GUID* file_rw_guid = nullptr, const libvdk::guid::GUID* log_guid = nullptr);
+    int updateHeader(libvdk::storage::Storage* storage, const libvdk::guid::GUID* file_rw_guid = nullptr, const libvdk::guid::GUID* log_guid = nullptr);
     int updateRegionTable(int current_idx);
 
     void show() const;    
@@ -123,20 +125,20 @@ private:
     bool isValidHeader(int index);
 
     void initFileIdentifier();
-    void initHeader(uint64_t init_seq_num);
+    void initHeader(uint64_t init_seq_num, uint32_t log_length, uint64_t log_offset);
     void initRegionTable(uint32_t total_bat_occupy_mb_count);
 
-    int parseFileIdentifier(int fd);
-    int parseHeader(int fd);
-    int parseRegionTable(int fd);
+    int parseFileIdentifier(libvdk::storage::Storage* storage);
+    int parseHeader(libvdk::storage::Storage* storage);
+    int parseRegionTable(libvdk::storage::Storage* storage);
 
     void showFileIdentifier() const;
     void showHeader() const;
     void showRegion() const;
 
-    int  updateInactiveHeader(int fd, const libvdk::guid::GUID* file_rw_guid, const libvdk::guid::GUID* log_guid);
-    int  writeHeader(int fd, uint64_t offset, Header* h);
-    int  writeRegionTable(int fd, uint64_t offset, RegionTable* rt);
+    int  updateInactiveHeader(libvdk::storage::Storage* storage, const libvdk::guid::GUID* file_rw_guid, const libvdk::guid::GUID* log_guid);
+    int  writeHeader(libvdk::storage::Storage* storage, uint64_t offset, Header* h);
+    int  writeRegionTable(libvdk::storage::Storage* storage, uint64_t offset, RegionTable* rt);
     uint32_t calcHeaderCrc(const Header* header);
     uint32_t calcRegionTableCrc(const RegionTable* header);
 
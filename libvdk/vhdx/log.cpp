@@ -2,9 +2,9 @@
 
 //#include "elk/base/crc32c.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cinttypes>
-#include <fcntl.h>
 #include <vector>
 
 #include "common.h"
@@ -30,28 +30,28 @@ const uint32_t kLogEntrySectorSize = 4 * libvdk::kKiB;
 const uint32_t kLogMinSize = 1 * libvdk::kMiB;
 
 LogSection::LogSection()
-    : fd_(-1),
+    : storage_(nullptr),
       header_(nullptr),
       vhdx_(nullptr) {
     memset(&entry_header_, 0, sizeof(entry_header_));    
 }
 
-LogSection::LogSection(int fd, header::HeaderSection* header)
-    : fd_(fd),
+LogSection::LogSection(libvdk::storage::Storage* storage, header::HeaderSection* header)
+    : storage_(storage),
       header_(header),
       vhdx_(nullptr) {
     memset(&entry_header_, 0, sizeof(entry_header_));
 }
 
 LogSection::LogSection(Vhdx *v)
-    : fd_(v->fd()),
+    : storage_(v->storage()),
       header_(v->headerSection()),
       vhdx_(v) {
     memset(&entry_header_, 0, sizeof(entry_header_));
 }
 
 void LogSection::setVhdx(Vhdx* v) {
-    fd_ = v->fd();
+    storage_ = v->storage();
     header_ = v->headerSection();
     vhdx_ = v;
 }
@@ -117,21 +117,24 @@ int LogSection::parseContent() {
     }
 
     /* The log is present, we need to find if and where there is an active
-     * sequence of valid entries present in the log.  */
+     * sequence of valid entries present in the log. One read of the log
+     * serves the search and the replay */
+    if (log_entry_.length <= kLogSearchBufMaxSize) {
+        log_buf_.resize(log_entry_.length);
+        ret = storage_->read(log_entry_.offset, log_buf_.data(), log_buf_.size());
+        if (ret) {
+            CONSLOG("read log at offset: %" PRIu64 " failed", log_entry_.offset);
+            goto exit;
+        }
+    }
+
     ret = searchLog(&logs);
     if (ret) {
         goto exit;
     }
 
     if (logs.valid) {
-        int val = fcntl(fd_, F_GETFL);
-        if (val == -1) {
-            CONSLOG("F_GETFL failed");
-            ret = -errno;
-            goto exit;
-        }
-        
-        if ((val & O_ACCMODE) == O_RDONLY) {
+        if (storage_->readOnly()) {
             CONSLOG("file readonly, but contains a log that needs to be replayed");
             ret = -EPERM;
             goto exit;
@@ -141,100 +144,97 @@ int LogSection::parseContent() {
         if (ret) {
             goto exit;          
         }        
+    } else if (!storage_->readOnly()) {
+        /* the header got the log guid but no entry made it to the log */
+        resetLog();
     }
 
 exit:
+    std::vector<uint8_t>().swap(log_buf_);
     return ret;
 }
 
 int LogSection::searchLog(LogSequence* logs) {
     int ret = 0;    
-    uint32_t tail = 0;
+    uint32_t pos = 0;
+    uint32_t head_end = 0;
     bool seq_valid = false;
+    bool found = false;
+    uint64_t prev_seq = 0;
     LogSequence candidate;
-    EntryHeader hdr;
+    EntryHeader hdr, head;
     LogEntries current_log;
 
     current_log = log_entry_;
     current_log.read = 0;
     current_log.write = log_entry_.length; /* assume log is full */
 
-    /* now we will go through the whole log sector by sector, until
-     * we find a valid, active log sequence, or reach the end of the
-     * log buffer */
-    for (;;) {
-        uint64_t current_seq = 0;
-        LogSequence current;
-
-        tail = current_log.read;
+    /* go through the whole log, the valid entry with the highest sequence number
+     * is the head of the active sequence */
+    do {
+        pos = current_log.read;
 
-        // find first log entry that active_header.log_guid == EntryHeader.guid
-        ret = validateLogEntry(&current_log, current_seq, &seq_valid, &hdr);
+        ret = validateLogEntry(&current_log, 0, &seq_valid, &hdr);
         if (ret) {
             CONSLOG("validata log entry failed");
             goto exit;
         }
 
-        if (seq_valid) {
-            current.valid = true;
-            current.log = current_log;
-            current.log.read = tail;
-            current.log.write = current_log.read;
-            current.count = 1;
-            current.hdr = hdr;
-
-            for (;;) {
-                // from first found log entry and check sequence number serial
-                ret = validateLogEntry(&current_log, current_seq, &seq_valid, &hdr);
-                if (ret) {
-                    CONSLOG("validata log entry failed");
-                    goto exit;
-                }
-                if (!seq_valid) {
-                    CONSLOG("seq invalid");
-                    break;
-                }
+        if (seq_valid && (!found || hdr.seq_num > head.seq_num)) {
+            found = true;
+            head = hdr;
+            head_end = current_log.read;
+        }
+    } while (current_log.read > pos);
 
-                current.log.write = current_log.read;
-                current.count++;
+    if (!found) {
+        goto exit;
+    }
 
-                current_seq = hdr.seq_num;
-            }
+    /* the head names where its sequence starts, every entry from there on
+     * must be valid and follow the one before it */
+    current_log.read = head.tail;
+    current_log.write = head_end;
+    candidate.log = current_log;
+    for (;;) {
+        ret = validateLogEntry(&current_log, prev_seq, &seq_valid, &hdr);
+        if (ret) {
+            CONSLOG("validata log entry failed");
+            goto exit;
         }
-
-        if (current.valid) {
-            if (!candidate.valid ||
-                current.hdr.seq_num > candidate.hdr.seq_num) {
-                candidate = current;
-            }
+        if (!seq_valid) {
+            CONSLOG("log sequence from: %u to seq: %" PRIu64 " is broken", head.tail, head.seq_num);
+            ret = -EINVAL;
+            goto exit;
         }
 
-        if (current_log.read < tail) {
+        candidate.count++;
+        prev_seq = hdr.seq_num;
+        if (hdr.seq_num == head.seq_num) {
             break;
         }
     }
 
+    candidate.valid = true;
+    candidate.hdr = head;
+    candidate.log.write = head_end;
     *logs = candidate;
 
-    if (candidate.valid) {
-        /* this is the next sequence number, for writes */
-        log_entry_.seq = candidate.hdr.seq_num + 1;
-    }
+    /* this is the next sequence number, for writes */
+    log_entry_.seq = head.seq_num + 1;
 exit:
     return ret;
 }
 
 int LogSection::flushLog(LogSequence* logs) {
     int ret = 0;
-    uint32_t cnt, readed_sectors;
+    uint32_t cnt, entry_sectors, readed_sectors;
     uint64_t new_file_size;
-    std::vector<uint8_t> data_sector_buf;
+    std::vector<uint8_t> entry_buf;
     int64_t file_length;
     EntryHeader tmp_hdr;
-    Descriptor *pdesc;
 
     cnt = logs->count;
-    data_sector_buf.resize(kLogEntrySectorSize, 0);
     
     ret = vhdx_->userVisibleWrite();
     if (ret) {
@@ -249,7 +249,7 @@ int LogSection::flushLog(LogSequence* logs) {
             goto exit;
         }
 
-        ret = libvdk::file::get_file_sizes(fd_, &file_length);
+        ret = storage_->getSize(&file_length);
         if (ret) {
             CONSLOG("get file length failed");
             goto exit;
@@ -264,37 +264,20 @@ int LogSection::flushLog(LogSequence* logs) {
             goto exit;
         }
 
-        std::vector<uint8_t> desc_buf;
-        ret = readDescriptors(&logs->log, tmp_hdr, &desc_buf);
-        if (ret) {
-            CONSLOG("read descriptors failed");
+        /* the whole entry in one read, two when it wraps around the end of the log */
+        entry_sectors = tmp_hdr.entry_length / kLogEntrySectorSize;
+        entry_buf.resize(tmp_hdr.entry_length);
+        ret = readSectors(&logs->log, false, &entry_buf, entry_sectors, &readed_sectors);
+        if (ret || readed_sectors != entry_sectors) {
+            CONSLOG("read log entry failed");
+            ret = (ret ? ret : -EINVAL);
             goto exit;
         }
 
-        pdesc = reinterpret_cast<Descriptor*>(desc_buf.data() + sizeof(EntryHeader));
-        for (uint32_t i=0; i<tmp_hdr.desc_count; ++i) {
-            /* data sector, so read a sector to flush */
-            if (memcmp(pdesc[i].signature, kDataDescriptorSignature, sizeof(pdesc[i].signature)) == 0) {
-                ret = readSectors(&logs->log, false, &data_sector_buf, 1, &readed_sectors);
-                if (ret) {
-                    CONSLOG("read sectors failed");
-                    goto exit;
-                }
-
-                if (readed_sectors != 1) {
-                    ret = -EINVAL;
-                    CONSLOG("read sectors failed");
-                    goto exit;
-                }                
-            } else {
-                memset(data_sector_buf.data(), 0, kLogEntrySectorSize);
-            }
-
-            ret = flushDesciptor(pdesc[i], &data_sector_buf);
-            if (ret) {
-                CONSLOG("flush data sector failed");
-                goto exit;
-            }
+        ret = applyEntry(tmp_hdr, &entry_buf);
+        if (ret) {
+            CONSLOG("apply log entry seq: %" PRIu64 " failed", tmp_hdr.seq_num);
+            goto exit;
         }
 
         if (static_cast<uint64_t>(file_length) < tmp_hdr.last_file_offset) {
@@ -303,7 +286,7 @@ int LogSection::flushLog(LogSequence* logs) {
                 /* round up to nearest 1MB boundary */
                 new_file_size = libvdk::convert::roundUp(new_file_size, 1 * libvdk::kMiB);
 
-                ret = libvdk::file::truncate_file(fd_, new_file_size);
+                ret = storage_->truncate(new_file_size);
                 if (ret) {
                     CONSLOG("truncate file to length: %" PRIu64 " failed", new_file_size);
                     goto exit;
@@ -312,7 +295,7 @@ int LogSection::flushLog(LogSequence* logs) {
         }
     }
 
-    ret = libvdk::file::flush_file(fd_);
+    ret = storage_->flush();
     if (ret) {
         CONSLOG("flush file failed");
         goto exit;
@@ -323,58 +306,137 @@ exit:
     return ret;
 }
 
-int LogSection::flushDesciptor(const Descriptor& desc, std::vector<uint8_t>* sectors_buf) {
+int LogSection::applyEntry(const EntryHeader& hdr, std::vector<uint8_t>* entry_buf) {
     int ret = 0;
-    uint64_t flush_offset;
-    uint32_t count = 1; 
-    
-    if (memcmp(desc.signature, kDataDescriptorSignature, sizeof(desc.signature)) == 0) {
-        if (sectors_buf->size() != kLogEntrySectorSize) {
-            CONSLOG("sector buf size: %lu mismatch", sectors_buf->size());
+    uint32_t desc_sectors, data_index = 0;
+    const Descriptor* pdesc;
+    std::map<uint64_t, const uint8_t*> sectors;
+    std::map<uint64_t, uint64_t> zeros;
+
+    desc_sectors = calcDescSectors(hdr.desc_count);
+    pdesc = reinterpret_cast<const Descriptor*>(entry_buf->data() + sizeof(EntryHeader));
+
+    /* descriptors apply in order, a sector ends up with what the last descriptor covering it says.
+     * Zero ranges are written before the data sectors, so a data sector under a later zero
+     * descriptor is dropped here */
+    for (uint32_t i=0; i<hdr.desc_count; ++i) {
+        const Descriptor& desc = pdesc[i];
+        if (!validateDescriptor(hdr, desc)) {
+            CONSLOG("desc index[%u] is invalid", i);
             ret = -EINVAL;
             goto exit;
         }
 
-        uint8_t* p = reinterpret_cast<uint8_t*>(sectors_buf->data());
-        DataSector* pds = reinterpret_cast<DataSector*>(p);
-        uint64_t data_sector_seq = pds->seq_high;
-        data_sector_seq <<= 32;
-        data_sector_seq |= (pds->seq_low & 0xFFFFFFFF);
+        if (memcmp(desc.signature, kDataDescriptorSignature, sizeof(desc.signature)) == 0) {
+            uint32_t sector_index = desc_sectors + data_index++;
+            if (static_cast<uint64_t>(sector_index + 1) * kLogEntrySectorSize > entry_buf->size()) {
+                CONSLOG("entry length: %u too small for data sectors", hdr.entry_length);
+                ret = -EINVAL;
+                goto exit;
+            }
 
-        if (data_sector_seq != desc.seq_num) {
-            CONSLOG("desc and data sector seq mismatch");
+            uint8_t* p = entry_buf->data() + static_cast<size_t>(sector_index) * kLogEntrySectorSize;
+            DataSector* pds = reinterpret_cast<DataSector*>(p);
+            uint64_t data_sector_seq = pds->seq_high;
+            data_sector_seq <<= 32;
+            data_sector_seq |= (pds->seq_low & 0xFFFFFFFF);
+
+            if (data_sector_seq != desc.seq_num) {
+                CONSLOG("desc and data sector seq mismatch");
+                ret = -EINVAL;
+                goto exit;
+            }
+
+            /* rebuild the sector in place */
+            memcpy(p, &desc.leading_bytes, sizeof(desc.leading_bytes));
+            memcpy(p + kLogEntrySectorSize - sizeof(desc.trailing_bytes), &desc.trailing_bytes, sizeof(desc.trailing_bytes));
+            sectors[desc.file_offset] = p;
+        } else if (memcmp(desc.signature, kZeroDescriptorSignature, sizeof(desc.signature)) == 0) {
+            uint64_t length = desc.zero_length;
+            sectors.erase(sectors.lower_bound(desc.file_offset), sectors.lower_bound(desc.file_offset + length));
+            uint64_t& zero_length = zeros[desc.file_offset];
+            zero_length = std::max(zero_length, length);
+        } else {
+            CONSLOG("unknown descriptor signature");
             ret = -EINVAL;
             goto exit;
         }
+    }
+
+    ret = writeZeros(zeros);
+    if (ret) {
+        goto exit;
+    }
 
-        memcpy(p, &desc.leading_bytes, sizeof(desc.leading_bytes));
-        p += sizeof(desc.leading_bytes);
+    ret = writeCoalesced(sectors);
 
-        p += sizeof(pds->data);        
+exit:
+    return ret;
+}
 
-        memcpy(p, &desc.trailing_bytes, sizeof(desc.trailing_bytes));
+int LogSection::writeZeros(const std::map<uint64_t, uint64_t>& zeros) {
+    int ret = 0;
+    uint64_t run_offset = 0, run_end = 0;
 
-    } else if (memcmp(desc.signature, kZeroDescriptorSignature, sizeof(desc.signature)) == 0) {
-        count = desc.zero_length / kLogEntrySectorSize;
-    } else {
-        CONSLOG("unknown descriptor signature");
-        ret = -EINVAL;
-        goto exit;
+    /* overlapping and adjacent ranges are merged, each run is zeroed at once */
+    for (auto it = zeros.begin(); ; ++it) {
+        if (it != zeros.end() && run_end > run_offset && it->first <= run_end) {
+            run_end = std::max(run_end, it->first + it->second);
+            continue;
+        }
+
+        if (run_end > run_offset) {
+            ret = storage_->zeroRange(run_offset, run_end - run_offset);
+            if (ret) {
+                CONSLOG("zero range offset: %" PRIu64 " length: %" PRIu64 " failed", run_offset, run_end - run_offset);
+                break;
+            }
+        }
+        if (it == zeros.end()) {
+            break;
+        }
+
+        run_offset = it->first;
+        run_end = it->first + it->second;
     }
 
-    flush_offset = desc.file_offset;
+    return ret;
+}
 
-    for (uint32_t i=0; i<count; ++i) {
-        ret = libvdk::file::seek_and_write_file(fd_, flush_offset, sectors_buf->data(), kLogEntrySectorSize, SEEK_SET);
-        if (ret) {
-            CONSLOG("write desc data at offset: %" PRIu64 " failed", flush_offset);
-            goto exit;
+int LogSection::writeCoalesced(const std::map<uint64_t, const uint8_t*>& sectors) {
+    int ret = 0;
+    std::vector<struct iovec> iov;
+    uint64_t run_offset = 0;
+
+    /* sectors in offset order, neighbours go in one write */
+    for (auto it = sectors.begin(); ; ++it) {
+        if (it != sectors.end() && !iov.empty() && it->first == run_offset + iov.size() * kLogEntrySectorSize) {
+            struct iovec v;
+            v.iov_base = const_cast<uint8_t*>(it->second);
+            v.iov_len = kLogEntrySectorSize;
+            iov.push_back(v);
+            continue;
         }
 
-        flush_offset += kLogEntrySectorSize;
+        if (!iov.empty()) {
+            ret = storage_->writev(run_offset, iov.data(), iov.size());
+            if (ret) {
+                CONSLOG("write sectors at offset: %" PRIu64 " failed", run_offset);
+                break;
+            }
+            iov.clear();
+        }
+        if (it == sectors.end()) {
+            break;
+        }
+
+        struct iovec v;
+        v.iov_base = const_cast<uint8_t*>(it->second);
+        v.iov_len = kLogEntrySectorSize;
+        iov.push_back(v);
+        run_offset = it->first;
     }
 
-exit:
     return ret;
 }
 
@@ -393,7 +455,6 @@ int LogSection::validateLogEntry(LogEntries* log, uint64_t seq, bool *seq_valid,
     }
 
     if (!validateEntryHeader(*log, eheader)) {
-        CONSLOG("validate entry header failed");
         goto inc_and_exit;
     }
 
@@ -446,7 +507,7 @@ int LogSection::validateLogEntry(LogEntries* log, uint64_t seq, bool *seq_valid,
     goto exit;
 
 inc_and_exit:
-    log_entry_.read = incLogIndex(log_entry_.read, log_entry_.length);
+    log->read = incLogIndex(log->read, log->length);
 
 exit:
     return ret;
@@ -456,6 +517,7 @@ int LogSection::peekEntryHeader(const LogEntries& log, EntryHeader* hdr) {
     int ret = 0;
     uint64_t offset;
     uint32_t read;
+    std::vector<uint8_t> sector_buf;
 
     assert(hdr != nullptr);
 
@@ -481,11 +543,19 @@ int LogSection::peekEntryHeader(const LogEntries& log, EntryHeader* hdr) {
 
     offset = log.offset + read;
 
-    ret = libvdk::file::seek_and_read_file(fd_, offset, hdr, sizeof(EntryHeader), SEEK_SET);
+    if (!log_buf_.empty()) {
+        ret = readLog(offset, hdr, sizeof(EntryHeader));
+        goto exit;
+    }
+
+    /* read the whole log sector, a sub-sector read does not work with O_DIRECT */
+    sector_buf.resize(kLogEntrySectorSize);
+    ret = storage_->read(offset, sector_buf.data(), sector_buf.size());
     if (ret) {
         CONSLOG("read log entry header at offset: %" PRIu64 " failed", offset);
         goto exit;
     }
+    memcpy(hdr, sector_buf.data(), sizeof(EntryHeader));
 
 exit:
     return ret;
@@ -494,8 +564,8 @@ exit:
 bool LogSection::validateEntryHeader(const LogEntries& log, const EntryHeader& hdr) {
     bool valid = false;
 
+    /* most sectors of the log are not entry headers, no message for them */
     if (memcmp(&hdr.signature, kEntryHeaderSignature, sizeof(hdr.signature)) != 0) {
-        CONSLOG("signature mismatch");
         goto exit;
     }
 
@@ -519,9 +589,8 @@ bool LogSection::validateEntryHeader(const LogEntries& log, const EntryHeader& h
     }
 
     /* log entries are only valid if they match the file-wide log guid
-     * found in the active header */
+     * found in the active header, entries of older sequences stay in the log */
     if (memcmp(&hdr.guid, &header_->logGuid(), sizeof(hdr.guid)) != 0) {
-        CONSLOG("log guid mismatch");
         goto exit;
     }
 
@@ -558,7 +627,7 @@ int LogSection::readDescriptors(LogEntries* log, const EntryHeader& eheader, std
 
     desc = reinterpret_cast<Descriptor*>(desc_buf->data() + sizeof(EntryHeader));
     for (uint32_t i=0; i<eheader.desc_count; ++i) {
-        if (!validateDescriptor(eheader, *desc)) {
+        if (!validateDescriptor(eheader, desc[i])) {
             CONSLOG("desc index[%u] is invalid", i);
             ret = -EINVAL;
             goto free_and_exit;
@@ -601,7 +670,7 @@ exit:
 
 int LogSection::readSectors(LogEntries* log, bool peek, std::vector<uint8_t>* sectors_buf, uint32_t num_sectors, uint32_t *readed_sectors) {
     int ret = 0;
-    uint32_t read;
+    uint32_t read, span;
     uint64_t offset;
 
     read = log->read;
@@ -615,16 +684,22 @@ int LogSection::readSectors(LogEntries* log, bool peek, std::vector<uint8_t>* se
 
         offset = log->offset + read;
 
-        ret = libvdk::file::seek_and_read_file(fd_, offset, sectors_buf->data(), sectors_buf->size(), SEEK_SET);
+        /* one read up to the write index or the end of the log, where the sectors wrap around */
+        span = std::min(num_sectors, ((log->write > read ? log->write : log->length) - read) / kLogEntrySectorSize);
+        ret = readLog(offset, sectors_buf->data() + static_cast<size_t>(*readed_sectors) * kLogEntrySectorSize, 
+                static_cast<size_t>(span) * kLogEntrySectorSize);
         if (ret) {
-            CONSLOG("read log sector from offset: %" PRIu64 " failed", offset);
+            CONSLOG("read log sectors from offset: %" PRIu64 " failed", offset);
             goto exit;
         }
 
-        read = incLogIndex(read, log->length);
+        read += span * kLogEntrySectorSize;
+        if (read >= log->length) {
+            read = 0;
+        }
 
-        *readed_sectors += 1;
-        num_sectors--;
+        *readed_sectors += span;
+        num_sectors -= span;
     }
 
     if (!peek) {
@@ -635,6 +710,16 @@ exit:
     return ret;
 }
 
+int LogSection::readLog(uint64_t offset, void* buf, size_t length) {
+    if (!log_buf_.empty() && offset >= log_entry_.offset && 
+            offset + length <= log_entry_.offset + log_buf_.size()) {
+        memcpy(buf, log_buf_.data() + (offset - log_entry_.offset), length);
+        return 0;
+    }
+
+    return storage_->read(offset, buf, length);
+}
+
 int LogSection::writeSectors(LogEntries* log, const std::vector<uint8_t>& sectors_buf, uint32_t num_sectors, uint32_t *written_sectors) {
     int ret = 0;
     uint32_t write;
@@ -658,7 +743,7 @@ int LogSection::writeSectors(LogEntries* log, const std::vector<uint8_t>& sector
             break;
         }
 
-        ret = libvdk::file::seek_and_write_file(fd_, offset, p, kLogEntrySectorSize, SEEK_SET);
+        ret = storage_->write(offset, p, kLogEntrySectorSize);
         if (ret) {
             CONSLOG("write log sector at offset: %" PRIu64 " failed", offset);
             goto exit;
@@ -675,17 +760,12 @@ exit:
     return ret;
 }
 
-// FIXME: use class member variable: fd_
-int LogSection::writeContent(int fd) {
+// FIXME: use class member variable: storage_
+int LogSection::writeContent(libvdk::storage::Storage* storage, uint64_t log_offset/* = kLogSectionInitOffset*/) {
     int ret = 0;
     
     // file identifier
-    ret = libvdk::file::seek_file(fd, kLogSectionInitOffset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to offset: %u failed", kLogSectionInitOffset);
-        return ret;
-    }
-    ret = libvdk::file::write_file(fd, &entry_header_, sizeof(entry_header_));
+    ret = storage->write(log_offset, &entry_header_, sizeof(entry_header_));
     if (ret) {
         CONSLOG("write log entry header failed");
         return ret;
@@ -734,68 +814,273 @@ uint32_t LogSection::incLogIndex(uint32_t idx, uint64_t log_length) {
 }
 
 void LogSection::resetLog() {
-    header_->updateHeader(fd_, nullptr, &libvdk::guid::kNullGuid);
+    header_->updateHeader(storage_, nullptr, &libvdk::guid::kNullGuid);
 }
 
-int LogSection::writeLogEntryAndFlush(uint64_t offset, const void* data, uint32_t length) {
+uint32_t LogSection::entrySectors(uint32_t desc_count, uint32_t data_sectors) {
+    return calcDescSectors(desc_count) + data_sectors;
+}
+
+/* the write index never catches up with the read index, one sector of the log stays unused */
+uint32_t LogSection::maxEntrySectors() const {
+    return header_->logLength() / kLogEntrySectorSize - 1;
+}
+
+/* sectors taken by the entries not checkpointed yet */
+uint32_t LogSection::usedSectors() const {
+    uint32_t used = (log_entry_.write + log_entry_.length - log_entry_.read) % log_entry_.length;
+    return used / kLogEntrySectorSize;
+}
+
+/* zero ranges go first, as in the replay */
+static void overlaySectors(const std::map<uint64_t, uint64_t>& zeros, const std::map<uint64_t, std::vector<uint8_t>>& sectors,
+        uint64_t offset, uint8_t* dst, uint32_t length) {
+    uint64_t end = offset + length;
+
+    for (const auto& zero : zeros) {
+        uint64_t from = std::max(offset, zero.first);
+        uint64_t to = std::min(end, zero.first + zero.second);
+        if (from < to) {
+            memset(dst + (from - offset), 0, to - from);
+        }
+    }
+
+    for (auto it = sectors.lower_bound(libvdk::convert::roundDown(offset, kLogEntrySectorSize)); 
+            it != sectors.end() && it->first < end; ++it) {
+        uint64_t from = std::max(offset, it->first);
+        uint64_t to = std::min(end, it->first + kLogEntrySectorSize);
+        memcpy(dst + (from - offset), it->second.data() + (from - it->first), to - from);
+    }
+}
+
+uint64_t LogSection::pendingBytes() const {
+    return static_cast<uint64_t>(pending_sectors_.size() + 1) * kLogEntrySectorSize + 
+        pending_zeros_.size() * sizeof(ZeroDescriptor);
+}
+
+uint64_t LogSection::pendingAgeMs() const {
+    if (!hasUpdates()) {
+        return 0;
+    }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - pending_since_).count();
+}
+
+int LogSection::addUpdate(uint64_t offset, const void* data, uint32_t length) {
     int ret = 0;
-    LogSequence logs;
-    logs.count = 1;
-    logs.valid = true;
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+    uint64_t end = offset + length;
+    uint64_t first = libvdk::convert::roundDown(offset, kLogEntrySectorSize);
+    uint32_t new_sectors = 0;
 
     assert(offset > (1 * libvdk::kMiB));
 
+    for (uint64_t sector = first; sector < end; sector += kLogEntrySectorSize) {
+        if (pending_sectors_.find(sector) == pending_sectors_.end()) {
+            ++new_sectors;
+        }
+    }
+
+    /* an entry never outgrows the log, what is pending so far goes first */
+    if (hasUpdates() && entrySectors(pending_sectors_.size() + pending_zeros_.size() + new_sectors,
+            pending_sectors_.size() + new_sectors) > maxEntrySectors()) {
+        ret = commitUpdates();
+        if (ret) {
+            goto exit;
+        }
+    }
+
+    if (!hasUpdates()) {
+        pending_since_ = std::chrono::steady_clock::now();
+    }
+
+    for (uint64_t sector = first; sector < end; sector += kLogEntrySectorSize) {
+        uint64_t from = std::max(offset, sector);
+        uint64_t to = std::min(end, sector + kLogEntrySectorSize);
+
+        auto it = pending_sectors_.find(sector);
+        if (it == pending_sectors_.end()) {
+            std::vector<uint8_t> sector_buf(kLogEntrySectorSize, 0);
+            /* partial sector, the rest is the file as the log leaves it */
+            if (to - from < kLogEntrySectorSize) {
+                ret = storage_->read(sector, sector_buf.data(), kLogEntrySectorSize);
+                if (ret) {
+                    CONSLOG("read sector at offset: %" PRIu64 " failed", sector);
+                    goto exit;
+                }
+                overlayUpdates(sector, sector_buf.data(), kLogEntrySectorSize);
+            }
+            it = pending_sectors_.insert(std::make_pair(sector, std::move(sector_buf))).first;
+        }
+
+        memcpy(it->second.data() + (from - sector), src + (from - offset), to - from);
+    }
+
+exit:
+    return ret;
+}
+
+int LogSection::addZeroUpdate(uint64_t offset, uint64_t length) {
+    if ((offset % kLogEntrySectorSize) || (length % kLogEntrySectorSize) || length == 0) {
+        CONSLOG("zero range offset: %" PRIu64 ", length: %" PRIu64 " not aligned to log sector", offset, length);
+        return -EINVAL;
+    }
+
+    assert(offset > (1 * libvdk::kMiB));
+
+    if (hasUpdates() && entrySectors(pending_sectors_.size() + pending_zeros_.size() + 1,
+            pending_sectors_.size()) > maxEntrySectors()) {
+        int ret = commitUpdates();
+        if (ret) {
+            return ret;
+        }
+    }
+
+    if (!hasUpdates()) {
+        pending_since_ = std::chrono::steady_clock::now();
+    }
+
+    /* zero descriptors are replayed before the data ones, data inside the range is dropped */
+    pending_sectors_.erase(pending_sectors_.lower_bound(offset), pending_sectors_.lower_bound(offset + length));
+    uint64_t& zero_length = pending_zeros_[offset];
+    zero_length = std::max(zero_length, length);
+    return 0;
+}
+
+void LogSection::overlayUpdates(uint64_t offset, void* buf, uint32_t length) const {
+    uint8_t* dst = reinterpret_cast<uint8_t*>(buf);
+    overlaySectors(committed_zeros_, committed_sectors_, offset, dst, length);
+    overlaySectors(pending_zeros_, pending_sectors_, offset, dst, length);
+}
+
+int LogSection::commitUpdates() {
+    int ret = 0;
+    uint32_t sectors = 0;
+
+    if (!hasUpdates()) {
+        return 0;
+    }
+
+    /* the entries in the log are applied once the new one does not fit behind them */
+    sectors = entrySectors(pending_sectors_.size() + pending_zeros_.size(), pending_sectors_.size());
+    if (usedSectors() + sectors > maxEntrySectors()) {
+        ret = checkpoint();
+        if (ret) {
+            goto exit;
+        }
+    }
+
     /* Make sure data written (new and/or changed blocks) is stable
      * on disk, before creating log entry */
-    ret = libvdk::file::flush_file(fd_);
+    ret = storage_->flush();
     if (ret) {
         CONSLOG("flush file failed");
         goto exit;
     }
 
-    ret = writeLogEntry(offset, data, length);
+    if (libvdk::guid::kNullGuid == header_->logGuid()) {
+        /* a new sequence starts here, entries of an older one carry another guid */
+        libvdk::guid::GUID new_log_guid;
+        libvdk::guid::generate(&new_log_guid);
+        ret = header_->updateHeader(storage_, nullptr, &new_log_guid);
+        if (ret) {
+            CONSLOG("update header with log guid failed");
+            goto exit;
+        }
+        log_entry_.read = log_entry_.write;
+        log_entry_.tail = log_entry_.write;
+    }
+
+    ret = writeLogEntry();
     if (ret) {
         CONSLOG("write log entry failed");
         goto exit;
     }
-    logs.log = log_entry_;
 
-    /* Make sure log is stable on disk */
-    ret = libvdk::file::flush_file(fd_);
+    /* Make sure log is stable on disk, the header with the log guid goes with it */
+    ret = storage_->flush();
     if (ret) {
         CONSLOG("flush file failed");
         goto exit;
     }
-    
-    ret = flushLog(&logs);
+
+    /* the final locations are written by checkpoint(), until then reads see the updates through overlayUpdates() */
+    for (const auto& zero : pending_zeros_) {
+        committed_sectors_.erase(committed_sectors_.lower_bound(zero.first), 
+            committed_sectors_.lower_bound(zero.first + zero.second));
+        uint64_t& zero_length = committed_zeros_[zero.first];
+        zero_length = std::max(zero_length, zero.second);
+    }
+    for (auto& sector : pending_sectors_) {
+        committed_sectors_[sector.first].swap(sector.second);
+    }
+    pending_sectors_.clear();
+    pending_zeros_.clear();
+
+exit:
+    /* on failure the updates stay pending, they belong to writes that already returned
+     * and the next commit or flush() tries them again */
+    return ret;
+}
+
+int LogSection::checkpoint() {
+    int ret = 0;
+    std::map<uint64_t, const uint8_t*> sectors;
+
+    if (libvdk::guid::kNullGuid == header_->logGuid()) {
+        return 0;
+    }
+
+    /* committed sectors inside a committed zero range were written after it */
+    ret = writeZeros(committed_zeros_);
+    if (ret) {
+        goto exit;
+    }
+
+    for (const auto& sector : committed_sectors_) {
+        sectors.emplace_hint(sectors.end(), sector.first, sector.second.data());
+    }
+    ret = writeCoalesced(sectors);
+    if (ret) {
+        goto exit;
+    }
+
+    /* the final locations are stable before the log is let go */
+    ret = storage_->flush();
     if (ret) {
-        CONSLOG("flush log failed");
+        CONSLOG("flush file failed");
         goto exit;
     }
-    log_entry_ = logs.log;
+
+    resetLog();
+    log_entry_.read = log_entry_.write;
+    log_entry_.tail = log_entry_.write;
+    committed_sectors_.clear();
+    committed_zeros_.clear();
 
 exit:
     return ret;
 }
 
-int LogSection::writeLogEntry(uint64_t offset, const void* data, uint32_t length) {
+int LogSection::writeLogEntryAndFlush(uint64_t offset, const void* data, uint32_t length) {
+    int ret = addUpdate(offset, data, length);
+    if (ret) {
+        return ret;
+    }
+
+    return commitUpdates();
+}
+
+int LogSection::writeLogEntry() {
     int ret = 0;
-    libvdk::guid::GUID new_log_guid;
-    uint32_t i, written_sectors = 0;
-    uint32_t sector_offset;
-    uint32_t desc_sectors, sectors, total_length;
-    uint32_t aligned_length;
-    uint32_t leading_length = 0;
-    uint32_t trailing_length = 0;
-    uint32_t partial_sectors = 0;
-    uint32_t bytes_written = 0;
-    uint64_t file_offset;
+    uint32_t written_sectors = 0;
+    uint32_t desc_count, desc_sectors, sectors, total_length;
     int64_t file_length;
     EntryHeader eh;
-    std::vector<uint8_t> log_buf, merged_buf;
+    std::vector<uint8_t> log_buf;
     Descriptor* dd = nullptr;
     DataSector* ds = nullptr;    
-    const uint8_t *data_tmp = nullptr, *sector_write = nullptr;
+    const uint8_t *sector_write = nullptr;
 
     if (header_->logLength() <= 0) {
         CONSLOG("log length invalid");
@@ -803,39 +1088,19 @@ int LogSection::writeLogEntry(uint64_t offset, const void* data, uint32_t length
         goto exit;
     }
 
-    if (libvdk::guid::kNullGuid == header_->logGuid()) {
-        libvdk::guid::generate(&new_log_guid);
-        header_->updateHeader(fd_, nullptr, &new_log_guid);
-    } else {
-        /* currently, we require that the log be flushed after
-         * every write. */
-        ret = -ENOTSUP;
+    // count of DataSectors
+    sectors = pending_sectors_.size();
+    desc_count = sectors + pending_zeros_.size();
+    desc_sectors = calcDescSectors(desc_count);
+    if (desc_sectors + sectors > maxEntrySectors()) {
+        CONSLOG("log entry of %u sectors is larger than the log", desc_sectors + sectors);
+        ret = -EINVAL;
         goto exit;
-    }    
-
-    sector_offset = offset % kLogEntrySectorSize;
-    file_offset = libvdk::convert::roundDown(offset, kLogEntrySectorSize);
-
-    aligned_length = length;
-
-    /* add in the unaligned head and tail bytes */
-    if (sector_offset) {
-        leading_length = (kLogEntrySectorSize - sector_offset);
-        leading_length = leading_length > length ? length : leading_length;
-        aligned_length -= leading_length;
-        partial_sectors++;
-    }
-
-    sectors = aligned_length / kLogEntrySectorSize;
-    trailing_length = aligned_length - (sectors * kLogEntrySectorSize);
-    if (trailing_length) {
-        partial_sectors++;
     }
 
-    // count of DataSectors
-    sectors += partial_sectors;
 
-    ret = libvdk::file::get_file_sizes(fd_, &file_length);
+    /* the used length, space preallocated for new blocks is trimmed on close */
+    ret = vhdx_->fileLength(&file_length);
     if (ret) {
         CONSLOG("get file size failed");
         goto exit;
@@ -846,12 +1111,11 @@ int LogSection::writeLogEntry(uint64_t offset, const void* data, uint32_t length
     eh.entry_length = 0;
     eh.tail = log_entry_.tail;
     eh.seq_num = log_entry_.seq;
-    eh.desc_count = sectors;
-    memcpy(&eh.guid, &new_log_guid, sizeof(eh.guid));
+    eh.desc_count = desc_count;
+    memcpy(&eh.guid, &header_->logGuid(), sizeof(eh.guid));
     eh.flushed_file_offset = file_length;
     eh.last_file_offset = file_length;
 
-    desc_sectors = calcDescSectors(sectors);
     total_length = (desc_sectors + sectors) * kLogEntrySectorSize;
     eh.entry_length = total_length;
 
@@ -859,69 +1123,41 @@ int LogSection::writeLogEntry(uint64_t offset, const void* data, uint32_t length
 
     dd = reinterpret_cast<Descriptor*>(log_buf.data() + sizeof(EntryHeader));
     ds = reinterpret_cast<DataSector*>(log_buf.data() + (desc_sectors * kLogEntrySectorSize));
-    data_tmp = reinterpret_cast<const uint8_t *>(data);
 
-    merged_buf.resize(kLogEntrySectorSize, 0);
+    for (const auto& zero : pending_zeros_) {
+        memcpy(dd->signature, kZeroDescriptorSignature, sizeof(dd->signature));
+        dd->reserved = 0;
+        dd->zero_length = zero.second;
+        dd->file_offset = zero.first;
+        dd->seq_num = log_entry_.seq;
+        dd += 1;
+    }
 
-    for (i=0; i<sectors; ++i) {
+    for (const auto& sector : pending_sectors_) {
         memcpy(dd->signature, kDataDescriptorSignature, sizeof(dd->signature));
         dd->seq_num = log_entry_.seq;
-        dd->file_offset = file_offset;
-
-        if (i == 0 && leading_length) {
-            /* partial sector at the front of the buffer */
-            ret = libvdk::file::seek_file(fd_, file_offset, SEEK_SET);
-            if (ret) {
-                goto exit;
-            }
-            ret = libvdk::file::read_file(fd_, merged_buf.data(), kLogEntrySectorSize);
-            if (ret) {
-                goto exit;
-            }
-            memcpy(merged_buf.data() + sector_offset, data_tmp, leading_length);
-            bytes_written = leading_length;
-            sector_write = merged_buf.data();
-        } else if (i == sectors - 1 && trailing_length) {
-            /* partial sector at the end of the buffer */
-            ret = libvdk::file::seek_file(fd_, file_offset + trailing_length, SEEK_SET);
-            if (ret) {
-                goto exit;
-            }
-
-            ret = libvdk::file::read_file(fd_, merged_buf.data() + trailing_length, kLogEntrySectorSize - trailing_length);
-            if (ret) {
-                goto exit;
-            }
-            memcpy(merged_buf.data(), data_tmp, trailing_length);
-            bytes_written = trailing_length;
-            sector_write = merged_buf.data();
-        } else {
-            bytes_written = kLogEntrySectorSize;
-            sector_write = reinterpret_cast<const uint8_t*>(data_tmp);
-        }
+        dd->file_offset = sector.first;
 
         /* populate the raw sector data into the proper structures,
          * as well as update the descriptor, and convert to proper
          * endianness */
+        sector_write = sector.second.data();
         memcpy(&dd->leading_bytes, sector_write, sizeof(dd->leading_bytes));
-        //CONSLOG("leading bytes: 0x%lX\n", dd->leading_bytes);
         sector_write += sizeof(dd->leading_bytes);
         memcpy(ds->data, sector_write, sizeof(ds->data));
         sector_write += sizeof(ds->data);
         memcpy(&dd->trailing_bytes, sector_write, sizeof(dd->trailing_bytes));
-        //CONSLOG("trailing bytes bytes: 0x%08X\n", dd->trailing_bytes);
-        sector_write += sizeof(dd->trailing_bytes);
 
         memcpy(ds->signature, kDataDescriptorSignature, sizeof(ds->signature));
         ds->seq_high = static_cast<uint32_t>(log_entry_.seq >> 32);
         ds->seq_low = static_cast<uint32_t>(log_entry_.seq & 0xFFFFFFFF);
         
-        data_tmp += bytes_written;
         ds += 1;
         dd += 1;
-        file_offset += kLogEntrySectorSize; 
     }
             
+    /* the checksum covers the whole entry, the header with a zero checksum field included */
+    memcpy(log_buf.data(), &eh, sizeof(EntryHeader));
     eh.checksum = libvdk::encrypt::crc32c(reinterpret_cast<const char*>(log_buf.data()), log_buf.size());
     memcpy(log_buf.data(), &eh, sizeof(EntryHeader));
     
@@ -937,8 +1173,6 @@ int LogSection::writeLogEntry(uint64_t offset, const void* data, uint32_t length
     }
 
     log_entry_.seq++;
-    // write new tail
-    log_entry_.tail = log_entry_.write;
 
 exit:
     return ret;
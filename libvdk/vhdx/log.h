@@ -2,8 +2,11 @@
 #define LIBVDK_VHD_LOG_H_
 
 #include <stdint.h>
+#include <chrono>
+#include <map>
 #include <vector>
 #include "utils.h"
+#include "common.h"
 
 namespace vhdx {
 namespace header {
@@ -101,15 +104,37 @@ struct LogEntries {
 class LogSection {
 public:
     LogSection();
-    explicit LogSection(int fd, header::HeaderSection* header);
+    explicit LogSection(libvdk::storage::Storage* storage, header::HeaderSection* header);
     explicit LogSection(Vhdx* vhdx);
     ~LogSection() = default;
 
     void initContent(uint32_t file_payload_in_mb, uint64_t seq_num = 0);
-    int  writeContent(int fd);
+    int  writeContent(libvdk::storage::Storage* storage, uint64_t log_offset = kLogSectionInitOffset);
     int  parseContent();
     void setVhdx(Vhdx* v);
 
+    // metadata updates are merged into 4KiB sectors in memory, commitUpdates() writes all of them
+    // as one log entry with a descriptor per sector
+    int  addUpdate(uint64_t offset, const void* data, uint32_t length);
+    // offset and length are 4KiB aligned
+    int  addZeroUpdate(uint64_t offset, uint64_t length);
+    // copy the updates not at their final locations yet over buf, which holds the file range [offset, offset+length)
+    void overlayUpdates(uint64_t offset, void* buf, uint32_t length) const;
+    bool hasUpdates() const {
+        return !pending_sectors_.empty() || !pending_zeros_.empty();
+    }
+    // log bytes the pending updates take, and how long the oldest of them has been waiting
+    uint64_t pendingBytes() const;
+    uint64_t pendingAgeMs() const;
+    // the entry is durable in the log when this returns, its updates reach their final locations
+    // in checkpoint(), which runs once the log has no room for the next entry
+    int  commitUpdates();
+    // write the updates of all entries in the log to their final locations and empty the log
+    int  checkpoint();
+    bool hasCommitted() const {
+        return !committed_sectors_.empty() || !committed_zeros_.empty();
+    }
+
     int  writeLogEntryAndFlush(uint64_t offset, const void* data, uint32_t length);
     void show();
 private:
@@ -123,19 +148,40 @@ private:
     bool     validateEntryHeader(const LogEntries& log, const EntryHeader& hdr);    
     int      readDescriptors(LogEntries* log, const EntryHeader& eheader, std::vector<uint8_t>* desc_buf);
     int      readSectors(LogEntries* log, bool peek, std::vector<uint8_t>* sectors_buf, uint32_t num_sectors, uint32_t *readed_sectors);
+    // read from log_buf_ once the log is loaded, from the file otherwise
+    int      readLog(uint64_t offset, void* buf, size_t length);
     int      writeSectors(LogEntries* log, const std::vector<uint8_t>& sectors_buf, uint32_t num_sectors, uint32_t *written_sectors);
     bool     validateDescriptor(const EntryHeader& eheader, const Descriptor& desc);
-    int      flushDesciptor(const Descriptor& desc, std::vector<uint8_t>* sectors_buf);
-    int      writeLogEntry(uint64_t offset, const void* data, uint32_t length);
+    // entry_buf holds the whole entry, its data sectors are rebuilt in place
+    int      applyEntry(const EntryHeader& hdr, std::vector<uint8_t>* entry_buf);
+    // zero ranges, file offset -> length
+    int      writeZeros(const std::map<uint64_t, uint64_t>& zeros);
+    // 4KiB sectors, file offset -> data
+    int      writeCoalesced(const std::map<uint64_t, const uint8_t*>& sectors);
+    int      writeLogEntry();
+    uint32_t entrySectors(uint32_t desc_count, uint32_t data_sectors);
+    uint32_t maxEntrySectors() const;
+    uint32_t usedSectors() const;
 
     EntryHeader entry_header_;
 
-    int fd_;
+    libvdk::storage::Storage* storage_;
     header::HeaderSection *header_;
     Vhdx *vhdx_;
 
     // save log info after parse content
     LogEntries log_entry_;
+    // the whole log while it is searched and replayed on open
+    std::vector<uint8_t> log_buf_;
+
+    // updates of the next log entry, 4KiB aligned file offset -> whole sector
+    std::map<uint64_t, std::vector<uint8_t>> pending_sectors_;
+    // zero ranges of the next log entry, file offset -> length
+    std::map<uint64_t, uint64_t> pending_zeros_;
+    std::chrono::steady_clock::time_point pending_since_;
+    // updates of the entries in the log, not at their final locations yet
+    std::map<uint64_t, std::vector<uint8_t>> committed_sectors_;
+    std::map<uint64_t, uint64_t> committed_zeros_;
 };
 
 } // namespace log
@@ -17,6 +17,8 @@ void usage(const char* argv0) {
     printf("usage: %s -r sector_num[:sectors(default:1)] /path/to/vhdx_file\n", argv0);    
     printf("usage: %s -b sector_num /path/to/vhdx_file (read bat table per one chunk)\n", argv0);
     printf("usage: %s -l /path/to/vhdx_file (show log)\n", argv0);
+    printf("usage: %s -t engine(0:sync|1:io_uring|2:mmap)[:s|r] /path/to/vhdx_file (read benchmark)\n", argv0);
+    printf("usage: %s -o /path/to/new_vhdx_file /path/to/vhdx_file (clone or copy to a new image)\n", argv0);
 }
 
 int main(int argc, char* argv[]) {
@@ -25,15 +27,19 @@ int main(int argc, char* argv[]) {
     std::string file, parent_file;
     std::string parent_absolute_path, parent_relative_path;
     std::string disk_size;
+    std::string copy_file;
     bool read_sectors = false;
     bool read_bat = false;
     bool show_log = false;    
+    bool bench_read = false;
+    libvdk::file::IoEngine io_engine = libvdk::file::IoEngine::kSync;
+    libvdk::file::AccessHint access_hint = libvdk::file::AccessHint::kNormal;
     uint64_t sector_num = 0UL;
     uint32_t nb_sectors = 1;    
     int c;
     char unit;
 
-    while ((c = getopt(argc, argv, "c:p:s:hma:e:r:b:l")) != -1) {
+    while ((c = getopt(argc, argv, "c:p:s:hma:e:r:b:lt:o:")) != -1) {
         switch (c) {
         case 'c':
             disk_type = atoi(optarg);
@@ -82,11 +88,34 @@ int main(int argc, char* argv[]) {
         case 'l':
             show_log = true;
             break;
+        case 't':
+            {
+                std::string tp(optarg);
+                std::size_t pos = tp.find(':');
+                io_engine = static_cast<libvdk::file::IoEngine>(atoi(tp.substr(0, pos).c_str()));
+                if (io_engine != libvdk::file::IoEngine::kSync && io_engine != libvdk::file::IoEngine::kUring && 
+                    io_engine != libvdk::file::IoEngine::kMmap) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                if (pos != std::string::npos) {
+                    if (tp.substr(pos+1) == "s") {
+                        access_hint = libvdk::file::AccessHint::kSequential;
+                    } else if (tp.substr(pos+1) == "r") {
+                        access_hint = libvdk::file::AccessHint::kRandom;
+                    }
+                }
+                bench_read = true;
+            }
+            break;
+        case 'o':
+            copy_file = optarg;
+            break;
         case 'h':
             usage(argv[0]);
             return 0;
         case '?':
-            if (optopt == 'c' || optopt == 'p' || optopt == 's')
+            if (optopt == 'c' || optopt == 'p' || optopt == 's' || optopt == 'o')
                 fprintf(stderr, "Option -%c requires an argument.\n", optopt);            
             else if (isprint (optopt))
                 fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -203,6 +232,21 @@ int main(int argc, char* argv[]) {
                 ascii_index = 0;
             }
         }
+    } else if (!copy_file.empty()) {
+        int ret = vhdx::Vhdx::copy(file, copy_file);
+        if (ret) {
+            printf("copy file: %s to %s failed - %d\n", file.c_str(), copy_file.c_str(), ret);
+            return -1;
+        }
+    } else if (bench_read) {
+        vhdx::Vhdx vhdx(file);
+        if (vhdx.parse()) {
+            return -1;
+        }
+
+        vhdx.setIoEngine(io_engine, access_hint);
+        return libvdk::bench::read_benchmark(vhdx.diskSize(), vhdx.logicalSectorSizeBits(),
+            [&vhdx](uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) { return vhdx.read(sector_num, nb_sectors, buf); });
     } else if (read_bat) {
         vhdx::Vhdx vhdx(file);
         if (vhdx.parse()) {
@@ -214,7 +258,10 @@ int main(int argc, char* argv[]) {
 
         vhdx::bat::PayloadBatEntryStatus pstatus;
         uint64_t poffset;
-        vhdx::bat::BatEntry pe = vhdx.bat()[bat_index];
+        vhdx::bat::BatEntry pe = 0;
+        if (vhdx.batEntry(bat_index, &pe)) {
+            return -1;
+        }
         vhdx::bat::payloadBatStatusOffset(pe, &pstatus, &poffset);
         printf("#sector: %" PRIu64 ", payload bat index: %u, raw value: 0x%016lX\n", sector_num, bat_index, pe);
         printf("status: %s, offset: 0x%016lX\n\n", vhdx::Vhdx::payloadStatusToString(pstatus), poffset);
@@ -225,14 +272,16 @@ int main(int argc, char* argv[]) {
 
             vhdx::bat::BitmapBatEntryStatus bstatus;
             uint64_t boffset;
-            vhdx::bat::BatEntry be = vhdx.bat()[bbat_index];
+            vhdx::bat::BatEntry be = 0;
+            if (vhdx.batEntry(bbat_index, &be)) {
+                return -1;
+            }
             vhdx::bat::bitmapBatStatusOffset(be, &bstatus, &boffset);
 
             printf("#sector: %" PRIu64 ", bitmap bat index: %u, raw value: 0x%016lX\n", sector_num, bbat_index, be);
             printf("status: %s, offset: 0x%016lX\n\n", vhdx::Vhdx::bitmapStatusToString(bstatus), boffset);
 
             uint32_t line = 0;
-            const vhdx::bat::BatEntry* p = vhdx.bat();
             //printf("total bat count: %u\n", vhdx.totalBatCount());
             uint32_t bat_idx_begin = bat_idx_in_chunk * vhdx.chunkRatio() + bat_idx_in_chunk;
             printf("bat index: %u, chunk bat index begin: %u\n", bat_index, bat_idx_begin);
@@ -246,7 +295,9 @@ int main(int argc, char* argv[]) {
                 //uint32_t bat_idx_in_chunk = i >> vhdx.chunkRatioBits();
                 //uint32_t bitmap_idx = ((bat_idx_in_chunk + 1) << vhdx.chunkRatioBits()) + bat_idx_in_chunk;
                 //printf("%016lx [%u:%u]", p[i], i, bitmap_idx);
-                printf("%016lx ", p[bat_idx_begin++]);
+                vhdx::bat::BatEntry e = 0;
+                vhdx.batEntry(bat_idx_begin++, &e);
+                printf("%016lx ", e);
                 // if (i != 0 && i == (bitmap_idx - vhdx.chunkRatio() - 1)) {
                 //     printf("* ");
                 // } else {
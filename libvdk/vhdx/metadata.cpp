@@ -195,28 +195,13 @@ void MetadataSection::initContent(vhdx::metadata::VirtualDiskType type,
 int MetadataSection::initParentLocatorContent(const std::string& file, const std::string& parent_file, 
     const std::string& linkage, const std::string& parent_absolute_path, const std::string& parent_relative_path) {
     int ret = 0, err;
-    struct stat stats;
-    char *absolute_path;
-    std::string relative_path;       
+    std::string absolute_path, relative_path;
     
     if (parent_absolute_path.empty()) {
-        absolute_path = realpath(parent_file.c_str(), NULL);
-        if (!absolute_path) {
-            CONSLOG("get parent file: %s absolute path failed - %d", parent_file.c_str(), errno);
-            ret = -errno;
-            goto out;
-        }
-
-        ret = stat(absolute_path, &stats);
-        if (ret) {
-            CONSLOG("stat parent file: %s failed - %d", parent_file.c_str(), errno);
-            ret = -errno;
-            goto out;
-        }
-
-        if (!S_ISREG(stats.st_mode)) {
-            CONSLOG("parent file: %s is not normal file", parent_file.c_str());
-            ret = -EINVAL;
+        absolute_path = libvdk::storage::absolute_path(parent_file, &err);
+        if (err) {
+            CONSLOG("get parent file: %s absolute path failed - %d", parent_file.c_str(), err);
+            ret = err;
             goto out;
         }
 
@@ -226,7 +211,7 @@ int MetadataSection::initParentLocatorContent(const std::string& file, const std
     }
 
     if (parent_relative_path.empty()) {
-        relative_path = libvdk::file::relative_path_to(file, parent_file, &err);
+        relative_path = libvdk::storage::relative_path_to(file, parent_file, &err);
         if (err) {
             CONSLOG("get parent file: %s relative path failed - %d", parent_file.c_str(), err);
             //ret = err;
@@ -394,16 +379,10 @@ void MetadataSection::calcBatInfo() {
     sectors_per_block_bits_ = libvdk::convert::ctz32(sectors_per_block_);
 }
 
-int  MetadataSection::parseContent(int fd, uint64_t offset) {
+int  MetadataSection::parseContent(libvdk::storage::Storage* storage, uint64_t offset) {
     int ret = 0;
 
-    ret = libvdk::file::seek_file(fd, offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to offset: %" PRIu64 " failed", offset);
-        return ret;
-    }
-       
-    ret = libvdk::file::read_file(fd, static_cast<void *>(&table_header_entries_), sizeof(table_header_entries_));
+    ret = storage->read(offset, static_cast<void *>(&table_header_entries_), sizeof(table_header_entries_));
     if (ret) {
         CONSLOG("read metadata header & entries failed");
         return ret;
@@ -423,13 +402,7 @@ int  MetadataSection::parseContent(int fd, uint64_t offset) {
         pv_buf.resize(te->length, 0);
 
         uint64_t data_offset = offset + te->offset;
-        ret = libvdk::file::seek_file(fd, data_offset, SEEK_SET);
-        if (ret) {
-            CONSLOG("seek to metadata entry[0x%08X] data failed", te->item_id.Data1);
-            break;
-        }
-
-        ret = libvdk::file::read_file(fd, pv_buf.data(), te->length);
+        ret = storage->read(data_offset, pv_buf.data(), te->length);
         if (ret) {
             CONSLOG("read metadata entry[0x%08X] data failed", te->item_id.Data1);
             break;
@@ -514,7 +487,7 @@ int  MetadataSection::parseContent(int fd, uint64_t offset) {
     return ret;
 }
 
-int MetadataSection::modifyParentLocator(int fd, uint64_t metadata_offset, 
+int MetadataSection::modifyParentLocator(libvdk::storage::Storage* storage, uint64_t metadata_offset, 
     const std::string& parent_absolute_path, const std::string& parent_relative_path) {
 
     int ret = 0;
@@ -533,11 +506,6 @@ int MetadataSection::modifyParentLocator(int fd, uint64_t metadata_offset,
 
     //std::vector<uint8_t> bak_buf(pl_length, '\0');
     uint64_t pl_offset = metadata_offset + pl_inner_offset;
-    ret = libvdk::file::seek_file(fd, pl_offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek file to offset: %" PRIu64 "(0x%lx) failed", pl_offset, pl_offset);
-        return ret;
-    }
 
     // ret = libvdk::file::read_file(fd, bak_buf.data(), pl_length);
     // if (ret) {
@@ -545,7 +513,7 @@ int MetadataSection::modifyParentLocator(int fd, uint64_t metadata_offset,
     // }
     
     std::vector<uint8_t> clear_buf(pl_length, '\0'); 
-    ret = libvdk::file::write_file(fd, clear_buf.data(), clear_buf.size());
+    ret = storage->write(pl_offset, clear_buf.data(), clear_buf.size());
     if (ret) {
         CONSLOG("write file for clear parent locator info failed");
         return ret;
@@ -563,26 +531,14 @@ int MetadataSection::modifyParentLocator(int fd, uint64_t metadata_offset,
 
     pl_entry_offset = metadata_offset + sizeof(TableHeader) + (pl_entry_index * sizeof(TableEntry));
     // rewrite parent locator table entry
-    ret = libvdk::file::seek_file(fd, pl_entry_offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek file to offset: %" PRIu64 "(0x%lx) failed", pl_entry_offset, pl_entry_offset);
-        return ret;
-    }
-
-    ret = libvdk::file::write_file(fd, &table_header_entries_.well_known_table_entries_[pl_entry_index], sizeof(TableEntry));
+    ret = storage->write(pl_entry_offset, &table_header_entries_.well_known_table_entries_[pl_entry_index], sizeof(TableEntry));
     if (ret) {
         CONSLOG("write parent locator table entry failed");
         return ret;
     }
 
     // rewrite parent locator header & data
-    ret = libvdk::file::seek_file(fd, pl_offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek file to offset: %" PRIu64 "(0x%lx) failed", pl_offset, pl_offset);
-        return ret;
-    }
-
-    ret = writeParentLocatorContent(fd);
+    ret = writeParentLocatorContent(storage, pl_offset);
 
     return ret;
 }
@@ -613,28 +569,16 @@ void MetadataSection::show() const {
     printf("total bat count      : %u\n\n", total_bat_count_);
 }
 
-int  MetadataSection::writeContent(int fd) {
+int  MetadataSection::writeContent(libvdk::storage::Storage* storage) {
     int ret = 0;
     
     // metadata table header entries
-    ret = libvdk::file::seek_file(fd, kMetadataSectionInitOffset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to offset: %u failed", kMetadataSectionInitOffset);
-        return ret;
-    }    
-
-    ret = libvdk::file::write_file(fd, &table_header_entries_, sizeof(table_header_entries_));
+    ret = storage->write(kMetadataSectionInitOffset, &table_header_entries_, sizeof(table_header_entries_));
     if (ret) {
         CONSLOG("write metadata table header entry failed");
         return ret;
     }
 
-    ret = libvdk::file::seek_file(fd, kMetadataSectionInitOffset + kMetadataValueOffsetFromTableHeader, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to offset: %u failed", kMetadataSectionInitOffset + kMetadataValueOffsetFromTableHeader);
-        return ret;
-    }
-
     std::vector<char> value_buf{'\0'};
     value_buf.reserve(128);
     uint32_t value_len = 0;
@@ -662,38 +606,42 @@ int  MetadataSection::writeContent(int fd) {
         }
     }
 
-    ret = libvdk::file::write_file(fd, value_buf.data(), value_len);
+    ret = storage->write(kMetadataSectionInitOffset + kMetadataValueOffsetFromTableHeader, value_buf.data(), value_len);
     if (ret) {
         CONSLOG("write metadata entry value failed");
         return ret;
     }
 
     if (diskType() == vhdx::metadata::VirtualDiskType::kDifferencing) {
-        ret = writeParentLocatorContent(fd);
+        ret = writeParentLocatorContent(storage, kMetadataSectionInitOffset + kMetadataValueOffsetFromTableHeader + value_len);
     }
 
     return ret;
 }
 
-int MetadataSection::writeParentLocatorContent(int fd) {
+int MetadataSection::writeParentLocatorContent(libvdk::storage::Storage* storage, uint64_t offset) {
     int ret = 0;
-    ret = libvdk::file::write_file(fd, 
+    size_t entries_size = sizeof(parent_locator_with_data_.locator.entries[0]) * parent_locator_with_data_.locator.header.key_value_count;
+
+    ret = storage->write(offset,
             &parent_locator_with_data_.locator.header, 
             sizeof(parent_locator_with_data_.locator.header));
     if (ret) {
         CONSLOG("write parent locator header failed");
         return ret;
     }
+    offset += sizeof(parent_locator_with_data_.locator.header);
 
-    ret = libvdk::file::write_file(fd, 
+    ret = storage->write(offset,
             parent_locator_with_data_.locator.entries,                 
-            sizeof(parent_locator_with_data_.locator.entries[0]) * parent_locator_with_data_.locator.header.key_value_count);
+            entries_size);
     if (ret) {
         CONSLOG("write parent locator entries failed");
         return ret;
     }
+    offset += entries_size;
 
-    ret = libvdk::file::write_file(fd, 
+    ret = storage->write(offset,
             parent_locator_with_data_.data.data(),
             parent_locator_with_data_.data.size());
     if (ret) {
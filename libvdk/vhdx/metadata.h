@@ -128,10 +128,10 @@ public:
     // linkage value MUST populate the parent's DataWriteGuid field 
     int initParentLocatorContent(const std::string& file, const std::string& parent_file, 
         const std::string& linkage, const std::string& parent_absolute_path, const std::string& parent_relative_path);
-    int writeContent(int fd);
-    int parseContent(int fd, uint64_t offset);
+    int writeContent(libvdk::storage::Storage* storage);
+    int parseContent(libvdk::storage::Storage* storage, uint64_t offset);
 
-    int modifyParentLocator(int fd, uint64_t metadata_offset, 
+    int modifyParentLocator(libvdk::storage::Storage* storage, uint64_t metadata_offset, 
         const std::string& parent_absolute_path, const std::string& parent_relative_path);
 
     // const FileParameters& fileParameters() const {
@@ -272,7 +272,7 @@ private:
     void initParentLocatorEntryKeyValue(const wchar_t* key, 
             size_t *ple_index, size_t *kv_offset, std::string* buf, size_t* buf_len);
     void initParentLocatorHeader();
-    int  writeParentLocatorContent(int fd);
+    int  writeParentLocatorContent(libvdk::storage::Storage* storage, uint64_t offset);
 
     TableHeaderEntry table_header_entries_;
 
@@ -1,5 +1,6 @@
 #include "vhdx.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cinttypes>
 
@@ -22,21 +23,27 @@ struct SectorInfo {
 
     uint32_t bitmap_idx;    /* bitmap entry index */
     uint64_t bitmap_offset; /* bitmap offset for differencing, in bytes */
+
+    vhdx::bat::BatEntry bat_entry;  /* payload BAT entry of the block */
 };
 
 #define WRITE_LOG
 
+// first prefetch of a sequential stream, doubled on each following one
+const uint32_t kInitialReadaheadBytes = 128 * 1024;
+
 } // namespace detail
 
 int Vhdx::createVdkFile(const std::string& file, const std::string& parent_file, uint64_t size_in_bytes, 
-    bool is_fixed/* = false*/, const std::string& parent_absolute_path, const std::string& parent_relative_path) {
+    bool is_fixed/* = false*/, const std::string& parent_absolute_path, const std::string& parent_relative_path, 
+    uint32_t log_bytes/* = kDefaultLogBytes*/) {
     int ret = 0;
-    int fd = 0;
-    size_t write_bytes_left = 0;
-    uint8_t* p = nullptr;
+    std::unique_ptr<libvdk::storage::Storage> storage;
     uint64_t round_size = libvdk::convert::roundUp(size_in_bytes, libvdk::kMiB);
     uint32_t block_size = 0, logical_sector_size = 0, physicial_sector_size = 0;
     uint64_t file_size = 0UL;
+    uint64_t log_offset = vhdx::log::kLogSectionInitOffset;
+    uint64_t extra_log_size = 0UL;
     std::vector<uint8_t> bat_buf;    
     
     header::HeaderSection hdr;
@@ -54,12 +61,16 @@ int Vhdx::createVdkFile(const std::string& file, const std::string& parent_file,
         assert(round_size != 0);
     }
 
+    if (log_bytes == 0 || log_bytes % libvdk::kMiB) {
+        CONSLOG("log size: %u must be a multiple of 1MiB", log_bytes);
+        return -EINVAL;
+    }
+
     // create file first, to make initParentLocatorContent happy
-    fd = libvdk::file::create_file(file.c_str());
-    if (fd <= 0) {
-        CONSLOG("create file: %s failed", file.c_str());
-        ret = -1;
-        goto end;
+    ret = libvdk::storage::create_storage(file, &storage);
+    if (ret) {
+        CONSLOG("create file: %s failed - %d", file.c_str(), ret);
+        return ret;
     }
     
     if (type == vhdx::metadata::VirtualDiskType::kDifferencing) {
@@ -88,35 +99,35 @@ int Vhdx::createVdkFile(const std::string& file, const std::string& parent_file,
     }
     mtd.initContent(type, round_size, block_size, logical_sector_size, physicial_sector_size);
 
-    hdr.initContent(mtd.batOccupyMbCount());
-    log.initContent(mtd.batOccupyMbCount() + 
+    /* the default log fits in the 1MiB before the metadata region, a larger one goes behind the BAT */
+    if (log_bytes > vhdx::log::kLogSectionInitSize) {
+        log_offset = vhdx::bat::kBatInitOffsetInBytes + mtd.batOccupySizeInBytes();
+        extra_log_size = log_bytes;
+    }
+
+    hdr.initContent(mtd.batOccupyMbCount(), 0, log_bytes, log_offset);
+    log.initContent(mtd.batOccupyMbCount() + (extra_log_size >> libvdk::kMibShift) + 
         (is_fixed ? (round_size >> libvdk::kMibShift) : 0));    
     
     // write content
-    ret = hdr.writeContent(fd);
+    ret = hdr.writeContent(storage.get());
     if (ret) {
         goto end;
     }
-    ret = log.writeContent(fd);
+    ret = log.writeContent(storage.get(), log_offset);
     if (ret) {
         goto end;
     }
-    ret = mtd.writeContent(fd);
+    ret = mtd.writeContent(storage.get());
     if (ret) {
         goto end;
     }
 
-    ret = libvdk::file::seek_file(fd, vhdx::bat::kBatInitOffsetInBytes, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to bat offset: %u failed", vhdx::bat::kBatInitOffsetInBytes);
-        return ret;
-    }
-    
     // init & write bat
     bat_buf.resize(mtd.totalBatSizeInBytes(), 0x0);    
     if (is_fixed) {
         vhdx::bat::BatEntry* bat_entries = reinterpret_cast<vhdx::bat::BatEntry *>(bat_buf.data());
-        uint64_t payload_offset = vhdx::bat::kBatInitOffsetInBytes + mtd.batOccupySizeInBytes();
+        uint64_t payload_offset = vhdx::bat::kBatInitOffsetInBytes + mtd.batOccupySizeInBytes() + extra_log_size;
         for (uint32_t i=0; i<mtd.totalBatCount(); ++i) {
             *bat_entries = vhdx::bat::makePayloadBatEntry(vhdx::bat::PayloadBatEntryStatus::kBlockFullPresent, payload_offset);
 
@@ -125,93 +136,130 @@ int Vhdx::createVdkFile(const std::string& file, const std::string& parent_file,
         }
     }
     
-    write_bytes_left = bat_buf.size();
-    p = bat_buf.data();
-    while (write_bytes_left > 0) {
-        size_t write_bytes = 0;
-        if (write_bytes_left >= 4 * libvdk::kKiB) {
-            write_bytes = 4 * libvdk::kKiB;
-        } else {
-            write_bytes = write_bytes_left;
-        }
-
-        ret = libvdk::file::write_file(fd, p, write_bytes);
-        if (ret) {
-            CONSLOG("write bat failed - %d", ret);
-            break;
-        }
-
-        p += write_bytes;
-        write_bytes_left -= write_bytes;
+    ret = storage->write(vhdx::bat::kBatInitOffsetInBytes, bat_buf.data(), bat_buf.size());
+    if (ret) {
+        CONSLOG("write bat failed - %d", ret);
+        goto end;
     }
 
-    file_size = static_cast<uint64_t>(vhdx::bat::kBatInitOffsetInBytes) + mtd.batOccupySizeInBytes();
+    file_size = static_cast<uint64_t>(vhdx::bat::kBatInitOffsetInBytes) + mtd.batOccupySizeInBytes() + extra_log_size;
     if (is_fixed) {
         file_size += round_size;
     }
 
-    ret = libvdk::file::truncate_file(fd, file_size);
+    ret = storage->truncate(file_size);
     if (ret) {
         CONSLOG("truncate file: %s to size: %" PRIu64 " failed - %d", file.c_str(), file_size, ret);
     }
     
 end:
-    if (fd > 0) {
-        libvdk::file::close_file(fd);
-    }
+    storage.reset();
 
     if (ret) {
-        libvdk::file::delete_file(file);
+        libvdk::storage::delete_storage(file);
     }
 
     return ret;
 }
 
-int Vhdx::createDynamic(const std::string& file, uint64_t size_in_bytes) {
-    return createVdkFile(file, "", size_in_bytes); 
+int Vhdx::createDynamic(const std::string& file, uint64_t size_in_bytes, uint32_t log_bytes/* = kDefaultLogBytes*/) {
+    return createVdkFile(file, "", size_in_bytes, false, "", "", log_bytes); 
 }
 
 int Vhdx::createDifferencing(const std::string& file, const std::string& parent_file,
-    const std::string& parent_absolute_path, const std::string& parent_relative_path) {
-    return createVdkFile(file, parent_file, 0UL, false, parent_absolute_path, parent_relative_path);
+    const std::string& parent_absolute_path, const std::string& parent_relative_path, uint32_t log_bytes/* = kDefaultLogBytes*/) {
+    return createVdkFile(file, parent_file, 0UL, false, parent_absolute_path, parent_relative_path, log_bytes);
 }
 
-int Vhdx::createFixed(const std::string& file, uint64_t size_in_bytes) {
-    return createVdkFile(file, "", size_in_bytes, true);
+int Vhdx::createFixed(const std::string& file, uint64_t size_in_bytes, uint32_t log_bytes/* = kDefaultLogBytes*/) {
+    return createVdkFile(file, "", size_in_bytes, true, "", "", log_bytes);
+}
+
+int Vhdx::copy(const std::string& src_file, const std::string& dst_file) {
+    int ret = libvdk::storage::copy_storage(src_file, dst_file);
+    if (ret) {
+        CONSLOG("copy file: %s to %s failed - %d", src_file.c_str(), dst_file.c_str(), ret);
+        return ret;
+    }
+
+    {
+        Vhdx vhdx;
+        ret = vhdx.load(dst_file, false);
+        if (ret == 0) {
+            /* a dirty log is replayed into the copy here */
+            ret = vhdx.parse();
+        }
+        if (ret == 0) {
+            /* both headers get the new file write guid and a new data write guid */
+            ret = vhdx.hdr_section_.updateHeader(vhdx.storage(), &vhdx.file_rw_guid_);
+        }
+        if (ret == 0) {
+            ret = vhdx.storage()->flush();
+        }
+        if (ret) {
+            CONSLOG("update header of file: %s failed - %d", dst_file.c_str(), ret);
+        }
+    }
+
+    if (ret) {
+        libvdk::storage::delete_storage(dst_file);
+    }
+    return ret;
 }
 
 Vhdx::Vhdx()
-    : bat_entries_(nullptr),       
-      fd_(-1),
-      first_visible_write_(true) {
+    : read_only_(true),
+      direct_io_(false),
+      first_visible_write_(true),
+      growth_blocks_(kDefaultGrowthBlocks),
+      io_engine_(libvdk::file::IoEngine::kSync),
+      access_hint_(libvdk::file::AccessHint::kNormal),
+      readahead_(detail::kInitialReadaheadBytes, kDefaultReadaheadBytes),
+      bitmap_cache_(kDefaultBitmapCacheBytes / libvdk::storage::PageCache::kPageSize, 
+            [this](uint64_t offset, void* buf, size_t len) { return readMetadata(offset, buf, len); }),
+      group_commit_bytes_(0),
+      group_commit_age_ms_(kDefaultGroupCommitAgeMs),
+      shared_cache_(false),
+      cache_key_() {
 
 }
 
-Vhdx::Vhdx(const std::string& file, bool read_only/* = true*/) 
-    : bat_entries_(nullptr), 
-      file_(file), 
-      fd_(-1),
-      first_visible_write_(true) {
+Vhdx::Vhdx(const std::string& file, bool read_only/* = true*/, bool direct_io/* = false*/) 
+    : file_(file), 
+      read_only_(true),
+      direct_io_(false),
+      first_visible_write_(true),
+      growth_blocks_(kDefaultGrowthBlocks),
+      io_engine_(libvdk::file::IoEngine::kSync),
+      access_hint_(libvdk::file::AccessHint::kNormal),
+      readahead_(detail::kInitialReadaheadBytes, kDefaultReadaheadBytes),
+      bitmap_cache_(kDefaultBitmapCacheBytes / libvdk::storage::PageCache::kPageSize, 
+            [this](uint64_t offset, void* buf, size_t len) { return readMetadata(offset, buf, len); }),
+      group_commit_bytes_(0),
+      group_commit_age_ms_(kDefaultGroupCommitAgeMs),
+      shared_cache_(false),
+      cache_key_() {
     
-    load(file, read_only);
+    load(file, read_only, direct_io);
 }
 
 Vhdx::~Vhdx() {
     unload();
 }
 
-int Vhdx::load(const std::string& file, bool read_only/* = true*/) {
+int Vhdx::load(const std::string& file, bool read_only/* = true*/, bool direct_io/* = false*/) {
     int ret = 0;
     file_ = file;
+    read_only_ = read_only;
+    direct_io_ = direct_io;
     if (read_only) {
-        fd_ = libvdk::file::open_file_ro(file.c_str());
         memset(&file_rw_guid_, 0, sizeof(libvdk::guid::GUID));
     } else {
-        fd_ = libvdk::file::open_file_rw(file.c_str());
         libvdk::guid::generate(&file_rw_guid_);
     }
 
-    if (fd_ <= 0) {
+    ret = libvdk::storage::open_storage(file, read_only, direct_io, &storage_);
+    if (ret) {
         ret = -1;
         CONSLOG("open file: %s for %s failed", 
             file.c_str(), (read_only ? "RO" : "RW"));
@@ -221,35 +269,68 @@ int Vhdx::load(const std::string& file, bool read_only/* = true*/) {
 }
 
 void Vhdx::unload() {
+    if (storage_ && !read_only_ && write_back_.dirtyBytes() > 0) {
+        int ret = flushWriteBack();
+        if (ret) {
+            CONSLOG("write back cached data of file: %s failed - %d", file_.c_str(), ret);
+        }
+    }
+    write_back_.clear();
+    if (storage_ && !read_only_ && log_section_.hasUpdates()) {
+        int ret = commitMetadata(true);
+        if (ret) {
+            CONSLOG("commit metadata of file: %s failed - %d", file_.c_str(), ret);
+        }
+    }
+    /* the entries in the log go to their final locations, the next open has nothing to replay */
+    if (storage_ && !read_only_ && log_section_.hasCommitted()) {
+        int ret = log_section_.checkpoint();
+        if (ret) {
+            CONSLOG("checkpoint log of file: %s failed - %d", file_.c_str(), ret);
+        }
+    }
+    group_commit_bytes_ = 0;
+
     memset(&hdr_section_, 0, sizeof(hdr_section_));
-    memset(&log_section_, 0, sizeof(log_section_));
+    /* the log section owns containers of pending updates, it is not plain data */
+    log_section_ = vhdx::log::LogSection();
     memset(&mtd_section_, 0, sizeof(mtd_section_));
 
-    bat_entries_ = nullptr;
-    bat_buf_.clear();
+    bat_table_.unload();
+    bitmap_cache_.clear();
 
     first_visible_write_ = false;
 
     memset(&file_rw_guid_, 0, sizeof(file_rw_guid_));
 
     parents_.clear();    
-
-    if (fd_ > 0) {
-        libvdk::file::close_file(fd_);
-        fd_ = -1;
+    chain_map_.reset(0);
+    parent_blocks_.reset(0);
+    io_batch_.reset();
+    mapping_.reset();
+    shared_cache_ = false;
+
+    if (storage_ && !read_only_) {
+        int ret = tail_allocator_.trim(storage_.get());
+        if (ret) {
+            CONSLOG("trim file: %s to length: %" PRIu64 " failed - %d", file_.c_str(), tail_allocator_.tail(), ret);
+        }
     }
+    tail_allocator_.reset();
+
+    storage_.reset();
 
     file_.clear();
 }
 
 int Vhdx::parse() {
     int ret = 0;
-    if (fd_ == -1) {
+    if (!storage_) {
         CONSLOG("file: %s not load", file_.c_str());
         return -1;
     }
     
-    if (hdr_section_.parseContent(fd_) != 0) {
+    if (hdr_section_.parseContent(storage_.get()) != 0) {
         CONSLOG("parse file: %s header section failed", file_.c_str());
         ret = -1;
     } else {
@@ -263,7 +344,7 @@ int Vhdx::parse() {
             // printf("current header index: %d, bat offset: %" PRIu64 ", meta offset: %" PRIu64 "\n", 
             //     hs.getCurrentHeaderIndex(), hs.batEntry().file_offset, hs.metadataEntry().file_offset);
 
-            if (mtd_section_.parseContent(fd_, hdr_section_.metadataEntry().file_offset)) {
+            if (mtd_section_.parseContent(storage_.get(), hdr_section_.metadataEntry().file_offset)) {
                 CONSLOG("parse file: %s metadata section failed", file_.c_str());
                 ret = -1;
             } 
@@ -272,33 +353,27 @@ int Vhdx::parse() {
 
     if (ret == 0) {
         // read bat
-        uint32_t bat_offset = hdr_section_.batEntry().file_offset;
-        uint64_t total_bat_size_in_bytes = mtd_section_.totalBatSizeInBytes();
-        ret = libvdk::file::seek_file(fd_, bat_offset, SEEK_SET);
-        if (ret) {
-            CONSLOG("seek to bat offset: %u failed", bat_offset);
-            return ret;
-        }
-
-        bat_buf_.resize(total_bat_size_in_bytes, '\0');
-        ret = libvdk::file::read_file(fd_, bat_buf_.data(), total_bat_size_in_bytes);
-        if (ret) {
-            CONSLOG("read bat at offset: %u failed", bat_offset);
-            return ret;
-        }
-
-        bat_entries_ = reinterpret_cast<vhdx::bat::BatEntry*>(bat_buf_.data());
+        /* pages of the bat are read on first use */
+        ret = bat_table_.load(storage_.get(), hdr_section_.batEntry().file_offset, mtd_section_.totalBatCount());
+        /* an evicted page read again needs the updates still waiting in the log */
+        bat_table_.setReader([this](uint64_t offset, void* buf, size_t len) {
+            int read_ret = storage_->read(offset, buf, len);
+            if (read_ret == 0) {
+                log_section_.overlayUpdates(offset, buf, len);
+            }
+            return read_ret;
+        });
     }
 
     return ret;
 }
 
 int Vhdx::modifyParentLocator(const std::string& parent_absolute_path, const std::string& parent_relative_path) {
-    return mtd_section_.modifyParentLocator(fd_, hdr_section_.metadataEntry().file_offset, 
+    return mtd_section_.modifyParentLocator(storage_.get(), hdr_section_.metadataEntry().file_offset, 
             parent_absolute_path, parent_relative_path);
 }
 
-void Vhdx::blockTranslate(uint64_t sector_num, uint32_t nb_sectors, detail::SectorInfo* si) {
+int Vhdx::blockTranslate(uint64_t sector_num, uint32_t nb_sectors, detail::SectorInfo* si, bool cached_only/* = false*/) {
     uint32_t block_offset;
 
     si->bat_idx = sector_num >> mtd_section_.sectorsPerBlockBits();
@@ -323,7 +398,16 @@ void Vhdx::blockTranslate(uint64_t sector_num, uint32_t nb_sectors, detail::Sect
 
     si->bytes_avail = si->sectors_avail << mtd_section_.logicalSectorSizeBits();
     
-    vhdx::bat::payloadBatStatusOffset(bat_entries_[si->bat_idx], nullptr, &si->file_offset);
+    int ret = 0;
+    if (!cached_only) {
+        ret = batEntry(si->bat_idx, &si->bat_entry);
+    } else if (!peekBatEntry(si->bat_idx, &si->bat_entry)) {
+        ret = -EAGAIN;
+    }
+    if (ret) {
+        return ret;
+    }
+    vhdx::bat::payloadBatStatusOffset(si->bat_entry, nullptr, &si->file_offset);
     
     si->block_offset = block_offset << mtd_section_.logicalSectorSizeBits();
 
@@ -334,7 +418,7 @@ void Vhdx::blockTranslate(uint64_t sector_num, uint32_t nb_sectors, detail::Sect
 
     /* The file offset must be past the header section, so must be > 0 */
     if (si->file_offset == 0) {
-        return;
+        return 0;
     }
 
     /* block offset is the offset in vhdx logical sectors, in
@@ -342,11 +426,25 @@ void Vhdx::blockTranslate(uint64_t sector_num, uint32_t nb_sectors, detail::Sect
      * in the block, and add in the payload data block offset
      * in the file, in bytes, to get the final read address */
     si->file_offset += si->block_offset;     
+    return 0;
 }
 
 int Vhdx::read(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = static_cast<size_t>(nb_sectors) << logicalSectorSizeBits();
+
+    return readv(sector_num, nb_sectors, &iov, 1);
+}
+
+int Vhdx::readv(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt) {
     int ret = 0;
 
+    if (libvdk::iov::total_size(iov, iovcnt) < (static_cast<size_t>(nb_sectors) << logicalSectorSizeBits())) {
+        CONSLOG("iovec is too small for %u sectors", nb_sectors);
+        return -EINVAL;
+    }
+
     if (diskType() == vhdx::metadata::VirtualDiskType::kDifferencing) {
         ret = buildParentList();
         if (ret) {
@@ -354,17 +452,199 @@ int Vhdx::read(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
         }        
     }
 
-    ret = readRecursion(-1, sector_num, nb_sectors, buf);
+    if (io_engine_ == libvdk::file::IoEngine::kUring && !io_batch_) {
+        setupIoBatch();
+    }
+
+    ret = readRecursion(-1, sector_num, nb_sectors, iov, iovcnt);
+    if (io_batch_) {
+        /* always wait, queued reads still point into the caller's buffers */
+        int wait_ret = io_batch_->wait();
+        if (ret == 0) {
+            ret = wait_ret;
+        }
+    }
+    if (ret == 0 && write_back_.dirtyBytes() > 0) {
+        /* the file is behind the cache for sectors not written back yet, the write back
+         * itself is left to writes and flush(), its failure is not the read's */
+        write_back_.overlay(sector_num, nb_sectors, iov, iovcnt);
+    }
+    /* O_DIRECT bypasses the page cache, there is nothing to read ahead into */
+    if (ret == 0 && !direct_io_) {
+        uint32_t bits = logicalSectorSizeBits();
+        uint64_t ra_start, ra_len;
+        if (readahead_.update(sector_num << bits, static_cast<uint64_t>(nb_sectors) << bits, &ra_start, &ra_len)) {
+            uint64_t total_sectors = diskSize() >> bits;
+            uint64_t ra_sector = ra_start >> bits;
+            uint64_t ra_end = std::min(total_sectors, (ra_start + ra_len + logicalSectorSize() - 1) >> bits);
+            if (ra_sector < ra_end) {
+                prefetchRecursion(-1, ra_sector, ra_end - ra_sector);
+            }
+        }
+    }
 exit:
     return ret;
 }
 
-int Vhdx::readRecursion(int vhdx_index, uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
+void Vhdx::setIoEngine(libvdk::file::IoEngine engine, libvdk::file::AccessHint hint) {
+    bool changed = (engine != io_engine_ || hint != access_hint_);
+    if (changed || (engine == libvdk::file::IoEngine::kMmap && !mapping_)) {
+        io_engine_ = engine;
+        access_hint_ = hint;
+
+        mapping_.reset();
+        /* a writable image grows under the mapping, only read only layers are mapped */
+        if (engine == libvdk::file::IoEngine::kMmap && read_only_ && fd() >= 0) {
+            mapping_.reset(new libvdk::file::MappedFile());
+            int ret = mapping_->map(fd());
+            if (ret) {
+                CONSLOG("mmap file: %s failed - %d, use sync io", file_.c_str(), ret);
+                mapping_.reset();
+            } else {
+                mapping_->advise(hint);
+            }
+        }
+    }
+
+    /* shared parents keep the engine they were opened with, other chains read through them.
+     * The chain is opened again under the new engine, the old parents go with the last user */
+    if (changed && !parents_.empty()) {
+        parents_.clear();
+        io_batch_.reset();
+        if (buildParentList()) {
+            CONSLOG("open parents of file: %s with the new io engine failed", file_.c_str());
+        }
+    }
+}
+
+int Vhdx::fileLength(int64_t* length) {
+    if (tail_allocator_.loaded()) {
+        *length = tail_allocator_.tail();
+        return 0;
+    }
+
+    return storage_->getSize(length);
+}
+
+int Vhdx::setupIoBatch() {
+    std::vector<int> fds;
+
+    io_batch_.reset(new libvdk::file::IoBatch());
+    if (!io_batch_->async()) {
+        CONSLOG("io_uring is not available, use sync io");
+        return 0;
+    }
+
+    /* layers not backed by a file are read through their storage */
+    if (fd() >= 0) {
+        fds.push_back(fd());
+    }
+    for (const auto& parent : parents_) {
+        if (parent->fd() >= 0) {
+            fds.push_back(parent->fd());
+        }
+    }
+
+    int ret = io_batch_->registerFiles(fds);
+    if (ret) {
+        /* not fatal, requests use the plain fd */
+        CONSLOG("register files failed - %d", ret);
+    }
+
+    return 0;
+}
+
+void Vhdx::setBatCacheBytes(uint64_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        bat_table_.setCacheBytes(bytes);
+    }
+
+    for (auto& parent : parents_) {
+        parent->setBatCacheBytes(bytes);
+    }
+}
+
+void Vhdx::setBitmapCacheBytes(uint64_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        bitmap_cache_.setMaxPages(bytes / libvdk::storage::PageCache::kPageSize);
+    }
+
+    for (auto& parent : parents_) {
+        parent->setBitmapCacheBytes(bytes);
+    }
+}
+
+void Vhdx::setReadahead(uint32_t max_bytes) {
+    readahead_.setWindow(detail::kInitialReadaheadBytes, max_bytes);
+}
+
+void Vhdx::prefetchCurrent(uint64_t offset, uint32_t len) {
+    if (mapping_) {
+        mapping_->prefetch(offset, len);
+    } else {
+        storage_->prefetch(offset, len);
+    }
+}
+
+void Vhdx::prefetchRecursion(int vhdx_index, uint64_t sector_num, uint32_t nb_sectors) {
+    using vhdx::bat::PayloadBatEntryStatus;
+
+    detail::SectorInfo si;
+    PayloadBatEntryStatus status;
+    Vhdx* current_vhdx = nullptr;
+    if (parents_.empty() ? vhdx_index >= 0 : vhdx_index >= static_cast<int>(parents_.size())) {
+        return;
+    }
+
+    if (vhdx_index == -1) {
+        current_vhdx = this;
+    } else {
+        current_vhdx = parents_[vhdx_index].get();
+    }
+
+    while (nb_sectors > 0) {
+        /* prefetch never blocks on metadata: a BAT page not cached yet is only hinted for the coming read */
+        int ret = current_vhdx->blockTranslate(sector_num, nb_sectors, &si, true);
+        if (ret == -EAGAIN) {
+            current_vhdx->prefetchCurrent(current_vhdx->bat_table_.pageOffset(si.bat_idx), vhdx::bat::BatTable::kPageSize);
+        }
+        if (ret) {
+            return;
+        }
+        vhdx::bat::payloadBatStatusOffset(si.bat_entry, &status, nullptr);
+
+        bool differencing = (current_vhdx->diskType() == vhdx::metadata::VirtualDiskType::kDifferencing);
+        switch (status) {
+        case PayloadBatEntryStatus::kBlockFullPresent:
+            current_vhdx->prefetchCurrent(si.file_offset, si.bytes_avail);
+            break;
+        case PayloadBatEntryStatus::kBlockPartiallyPresent:
+            /* without reading the bitmap: prefetch the whole range here and in the parents */
+            current_vhdx->prefetchCurrent(si.file_offset, si.bytes_avail);
+            prefetchRecursion(vhdx_index+1, sector_num, si.sectors_avail);
+            break;
+        default:
+            if (differencing) {
+                prefetchRecursion(vhdx_index+1, sector_num, si.sectors_avail);
+            }
+            break;
+        }
+
+        sector_num += si.sectors_avail;
+        nb_sectors -= si.sectors_avail;
+    }
+}
+
+int Vhdx::readRecursion(int vhdx_index, uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt) {
     using vhdx::bat::PayloadBatEntryStatus;
 
     int ret = 0;
     detail::SectorInfo si;
     PayloadBatEntryStatus status;    
+    // bytes of iov already done
+    size_t iov_offset = 0;
     //uint64_t bytes_done;
     //CONSLOG("parents size: %lu", parents_.size());
     Vhdx* current_vhdx = nullptr;
@@ -379,9 +659,26 @@ int Vhdx::readRecursion(int vhdx_index, uint64_t sector_num, uint32_t nb_sectors
     }
 
     while (nb_sectors > 0) {        
-        current_vhdx->blockTranslate(sector_num, nb_sectors, &si);
+        if (vhdx_index == -1 && !chain_map_.empty()) {
+            uint32_t owned_sectors = 0;
+            ret = readOwnedBlock(sector_num, nb_sectors, iov, iovcnt, iov_offset, &owned_sectors);
+            if (ret) {
+                goto exit;
+            }
+            if (owned_sectors > 0) {
+                sector_num += owned_sectors;
+                nb_sectors -= owned_sectors;
+                iov_offset += static_cast<size_t>(owned_sectors) << logicalSectorSizeBits();
+                continue;
+            }
+        }
+
+        ret = current_vhdx->blockTranslate(sector_num, nb_sectors, &si);
+        if (ret) {
+            goto exit;
+        }
         uint64_t offset;
-        vhdx::bat::payloadBatStatusOffset(current_vhdx->bat()[si.bat_idx], &status, &offset);
+        vhdx::bat::payloadBatStatusOffset(si.bat_entry, &status, &offset);
 
 #ifdef RW_DEBUG
         CONSLOG("offset: %" PRIu64 ", status: %s", offset, payloadStatusToString(status));
@@ -393,19 +690,19 @@ int Vhdx::readRecursion(int vhdx_index, uint64_t sector_num, uint32_t nb_sectors
         case PayloadBatEntryStatus::kBlockUnmapped:
         case PayloadBatEntryStatus::kBlockZero:
             if (current_vhdx->diskType() == vhdx::metadata::VirtualDiskType::kDifferencing) {
-                ret = readFromParents(vhdx_index+1, sector_num, nb_sectors, buf);
+                ret = readFromParents(vhdx_index+1, sector_num, si.sectors_avail, iov, iovcnt, iov_offset);
                 if (ret) {
                     CONSLOG("read from parent failed");
                     goto exit;
                 }
             } else if (current_vhdx->diskType() == vhdx::metadata::VirtualDiskType::kDynamic) {
-                memset(buf, 0, si.bytes_avail);
+                libvdk::iov::fill(iov, iovcnt, iov_offset, 0, si.bytes_avail);
             } else {
                 assert(false);
             }
             break;
         case PayloadBatEntryStatus::kBlockFullPresent:
-            ret = current_vhdx->readFromCurrent(si.file_offset, buf, si.bytes_avail);
+            ret = current_vhdx->readFromCurrent(si.file_offset, iov, iovcnt, iov_offset, si.bytes_avail, io_batch_.get());
             if (ret) {
                 CONSLOG("read from current failed");
                 goto exit;
@@ -414,7 +711,11 @@ int Vhdx::readRecursion(int vhdx_index, uint64_t sector_num, uint32_t nb_sectors
         case PayloadBatEntryStatus::kBlockPartiallyPresent:
             {
                 // read bitmap entry
-                vhdx::bat::BatEntry bitmap_entry = current_vhdx->bat()[si.bitmap_idx];
+                vhdx::bat::BatEntry bitmap_entry = 0;
+                ret = current_vhdx->batEntry(si.bitmap_idx, &bitmap_entry);
+                if (ret) {
+                    goto exit;
+                }
                 uint64_t bitmap_offset = 0UL;
                 vhdx::bat::BitmapBatEntryStatus bitmap_status;
                 vhdx::bat::bitmapBatStatusOffset(bitmap_entry, &bitmap_status, &bitmap_offset);
@@ -423,10 +724,8 @@ int Vhdx::readRecursion(int vhdx_index, uint64_t sector_num, uint32_t nb_sectors
                         bitmap_offset != 0UL);
                 
                 std::vector<uint8_t> bitmap_buf;
-                uint8_t* p;
-                uint8_t* tmp_buf;
+                std::vector<libvdk::bitmap::Run> runs;
                 uint32_t secs = 0; //sector_num % vhdx::bat::kSectorsPerBitmap;
-                uint32_t avail_sectors = 0, unavail_sectors = 0;                
                 //ret = current_vhdx->loadBlockBitmap(bitmap_offset, &bitmap_buf);
                 ret = current_vhdx->loadPartiallyBlockBitmap(sector_num, si.sectors_avail, &bitmap_offset, &secs, &bitmap_buf);
                 if (ret) {
@@ -434,89 +733,32 @@ int Vhdx::readRecursion(int vhdx_index, uint64_t sector_num, uint32_t nb_sectors
                     goto exit;
                 }
 
-                p = bitmap_buf.data();
-                uint64_t partially_sector_num = sector_num;                
-                tmp_buf = buf;
-                for (uint32_t i=0; i<si.sectors_avail; ++i) {
-                    if (testBit(p, secs+i)) {
-                        if (unavail_sectors > 0) {
-                            uint32_t unavail_bytes = unavail_sectors << current_vhdx->logicalSectorSizeBits();
-
-                            ret = readFromParents(vhdx_index+1, partially_sector_num, unavail_sectors, tmp_buf);
-                            if (ret) {
-                                CONSLOG("read from parent failed");
-                                goto exit;
-                            }
+                libvdk::bitmap::runs(bitmap_buf.data(), secs, si.sectors_avail, &runs);
+                for (const auto& run : runs) {
+                    uint64_t partially_sector_num = sector_num + (run.start - secs);
+                    size_t tmp_offset = iov_offset + (static_cast<size_t>(run.start - secs) << current_vhdx->logicalSectorSizeBits());
 
-                            partially_sector_num += unavail_sectors;
-                            tmp_buf += unavail_bytes;
+                    if (run.set) {
+                        uint32_t avail_bytes = run.count << current_vhdx->logicalSectorSizeBits();
+                        uint64_t avail_offset = si.file_offset + ((partially_sector_num - sector_num) << current_vhdx->logicalSectorSizeBits());
 
-                            unavail_sectors = 0;                                                      
+#ifdef RW_DEBUG
+                        CONSLOG("read in diff, idx:%d, sector_num: %" PRIu64 ", sectors: %u", 
+                            vhdx_index, partially_sector_num, run.count);
+#endif
+                        ret = current_vhdx->readFromCurrent(avail_offset, iov, iovcnt, tmp_offset, avail_bytes, io_batch_.get());
+                        if (ret) {
+                            CONSLOG("read from current failed");
+                            goto exit;
                         }
-
-                        ++avail_sectors;
                     } else {
-                        if (avail_sectors > 0) {
-                            uint32_t avail_bytes = avail_sectors << current_vhdx->logicalSectorSizeBits();
-
-                            uint64_t avail_offset = si.file_offset + ((partially_sector_num - sector_num) << current_vhdx->logicalSectorSizeBits());
-
-#ifdef RW_DEBUG
-                            CONSLOG("read in diff, idx:%d, sector_num: %" PRIu64 ", sectors: %u", 
-                                vhdx_index, partially_sector_num, avail_sectors);
-#endif                         
-                            ret = current_vhdx->readFromCurrent(avail_offset, tmp_buf, avail_bytes);
-                            if (ret) {
-                                CONSLOG("read from current failed");
-                                goto exit;
-                            }                            
-
-                            partially_sector_num += avail_sectors;
-                            tmp_buf += avail_bytes;
-
-                            avail_sectors = 0;                            
+                        ret = readFromParents(vhdx_index+1, partially_sector_num, run.count, iov, iovcnt, tmp_offset);
+                        if (ret) {
+                            CONSLOG("read from parent failed");
+                            goto exit;
                         }
-                        
-                        ++unavail_sectors;
                     }
                 }
-
-                if (avail_sectors > 0) {
-                    uint32_t avail_bytes = avail_sectors << current_vhdx->logicalSectorSizeBits();
-
-                    uint64_t avail_offset = si.file_offset + ((partially_sector_num - sector_num) << current_vhdx->logicalSectorSizeBits());
-
-#ifdef RW_DEBUG
-                    CONSLOG("read in diff, idx:%d, sector_num: %" PRIu64 ", sectors: %u", 
-                        vhdx_index, partially_sector_num, avail_sectors);
-#endif                        
-
-                    ret = current_vhdx->readFromCurrent(avail_offset, tmp_buf, avail_bytes);
-                    if (ret) {
-                        CONSLOG("read from current failed");
-                        goto exit;
-                    }                    
-
-                    partially_sector_num += avail_sectors;
-                    tmp_buf += avail_bytes;
-
-                    avail_sectors = 0; 
-                } else if (unavail_sectors > 0) {
-                    uint32_t unavail_bytes = unavail_sectors << current_vhdx->logicalSectorSizeBits();
-
-                    ret = readFromParents(vhdx_index+1, partially_sector_num, unavail_sectors, tmp_buf);
-                    if (ret) {
-                        CONSLOG("read from parent failed");
-                        goto exit;
-                    }
-
-                    partially_sector_num += unavail_sectors;
-                    tmp_buf += unavail_bytes;
-
-                    unavail_sectors = 0; 
-                } else {
-                    assert(false);
-                }                
             }
 
             break;
@@ -528,7 +770,7 @@ int Vhdx::readRecursion(int vhdx_index, uint64_t sector_num, uint32_t nb_sectors
 
         sector_num += si.sectors_avail;
         nb_sectors -= si.sectors_avail;        
-        buf += si.bytes_avail;          
+        iov_offset += si.bytes_avail;          
     }
     ret = 0;
         
@@ -536,7 +778,109 @@ exit:
     return ret;
 }
 
-int Vhdx::readFromParents(int parents_index, uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
+void Vhdx::buildChainMap() {
+    chain_map_.reset(0);
+    parent_blocks_.reset(0);
+    if (parents_.empty() || parents_.size() >= libvdk::storage::ChainMap::kMaxLayers) {
+        return;
+    }
+    /* a parent of another block or sector size maps one block to several */
+    for (const auto& parent : parents_) {
+        if (parent->blockSize() != blockSize() || parent->logicalSectorSize() != logicalSectorSize()) {
+            return;
+        }
+    }
+
+    /* entries are resolved on first read, opening a deep chain reads no BAT pages */
+    chain_map_.reset((diskSize() + blockSize() - 1) / blockSize());
+    parent_blocks_.reset(bat_table_.count());
+}
+
+int Vhdx::resolveOwner(uint64_t block, uint64_t* owner) {
+    using vhdx::bat::PayloadBatEntryStatus;
+    using libvdk::storage::ParentBlockSet;
+
+    uint32_t top_bat_idx = block + (block >> chunkRatioBits());
+    for (size_t i = 0; i <= parents_.size(); ++i) {
+        if (i == 1 && parent_blocks_.get(top_bat_idx) == ParentBlockSet::State::kUnallocated) {
+            break;
+        }
+
+        Vhdx* layer = (i == 0 ? this : parents_[i-1].get());
+        uint32_t bat_idx = block + (block >> layer->chunkRatioBits());
+        vhdx::bat::BatEntry bat_entry = 0;
+        int ret = layer->batEntry(bat_idx, &bat_entry);
+        if (ret) {
+            return ret;
+        }
+
+        PayloadBatEntryStatus status;
+        uint64_t offset = 0;
+        vhdx::bat::payloadBatStatusOffset(bat_entry, &status, &offset);
+        if (status == PayloadBatEntryStatus::kBlockFullPresent ||
+            status == PayloadBatEntryStatus::kBlockPartiallyPresent) {
+            if (i > 0) {
+                parent_blocks_.set(top_bat_idx, ParentBlockSet::State::kAllocated);
+            }
+            *owner = (status == PayloadBatEntryStatus::kBlockFullPresent ? 
+                    libvdk::storage::ChainMap::owned(i, offset) : libvdk::storage::ChainMap::kPartial);
+            return 0;
+        }
+        if (layer->diskType() != vhdx::metadata::VirtualDiskType::kDifferencing) {
+            break;
+        }
+    }
+
+    parent_blocks_.set(top_bat_idx, ParentBlockSet::State::kUnallocated);
+    *owner = libvdk::storage::ChainMap::kAbsent;
+    return 0;
+}
+
+int Vhdx::readOwnedBlock(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt, size_t iov_offset,
+        uint32_t* sectors) {
+    using libvdk::storage::ChainMap;
+
+    uint64_t block = sector_num >> sectorsPerBlockBits();
+    uint32_t block_offset = sector_num - (block << sectorsPerBlockBits());
+    uint32_t avail = sectorsPerBlocks() - block_offset;
+    if (avail > nb_sectors) {
+        avail = nb_sectors;
+    }
+
+    *sectors = 0;
+    uint64_t owner = chain_map_.get(block);
+    if (owner == ChainMap::kUnknown) {
+        int ret = resolveOwner(block, &owner);
+        if (ret) {
+            return ret;
+        }
+        chain_map_.set(block, owner);
+    }
+
+    if (owner == ChainMap::kPartial) {
+        return 0;
+    }
+
+    uint32_t bits = logicalSectorSizeBits();
+    if (owner == ChainMap::kAbsent) {
+        libvdk::iov::fill(iov, iovcnt, iov_offset, 0, static_cast<size_t>(avail) << bits);
+    } else {
+        uint32_t layer = ChainMap::layerOf(owner);
+        Vhdx* current_vhdx = (layer == 0 ? this : parents_[layer-1].get());
+        uint64_t offset = ChainMap::offsetOf(owner) + (static_cast<uint64_t>(block_offset) << bits);
+        int ret = current_vhdx->readFromCurrent(offset, iov, iovcnt, iov_offset, avail << bits, io_batch_.get());
+        if (ret) {
+            CONSLOG("read from current failed");
+            return ret;
+        }
+    }
+
+    *sectors = avail;
+    return 0;
+}
+
+int Vhdx::readFromParents(int parents_index, uint64_t sector_num, uint32_t nb_sectors, 
+        const struct iovec* iov, int iovcnt, size_t iov_offset) {
     // uint64_t parent_sector_num = partially_sector_num;
     // uint32_t parent_nb_sectors = unavail_sectors;
     // int v_idx = vhdx_index + 1;
@@ -546,7 +890,24 @@ int Vhdx::readFromParents(int parents_index, uint64_t sector_num, uint32_t nb_se
         parents_index, sector_num, nb_sectors);
 #endif
 
-    int ret = readRecursion(parents_index, sector_num, nb_sectors, buf);
+    int ret = 0;
+    if (parents_index == 0 && !chain_map_.empty()) {
+        /* the sectors lie in one block, no parent holding it means zeros without walking the chain */
+        uint64_t block = sector_num >> sectorsPerBlockBits();
+        bool allocated = true;
+        ret = isParentAlreadyAllocBlock(block + (block >> chunkRatioBits()), &allocated);
+        if (ret == 0 && !allocated) {
+            libvdk::iov::fill(iov, iovcnt, iov_offset, 0, static_cast<size_t>(nb_sectors) << logicalSectorSizeBits());
+            return 0;
+        }
+    }
+
+    std::vector<struct iovec> parent_iov;
+    ret = libvdk::iov::slice(iov, iovcnt, iov_offset, 
+            static_cast<size_t>(nb_sectors) << logicalSectorSizeBits(), &parent_iov);
+    if (ret == 0) {
+        ret = readRecursion(parents_index, sector_num, nb_sectors, parent_iov.data(), parent_iov.size());
+    }
     if (ret) {
         CONSLOG("recursion read sector: %" PRIu64 " , sectors: %u with parents index: %d failed",
                 sector_num, nb_sectors, parents_index);        
@@ -555,14 +916,24 @@ int Vhdx::readFromParents(int parents_index, uint64_t sector_num, uint32_t nb_se
     return ret;
 }
 
-int Vhdx::readFromCurrent(uint64_t offset, uint8_t* buf, uint32_t len) {
-    int ret = libvdk::file::seek_file(fd_, offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to %" PRIu64 " failed", offset);
-        return ret;
+int Vhdx::readFromCurrent(uint64_t offset, const struct iovec* iov, int iovcnt, size_t iov_offset, uint32_t len, 
+        libvdk::file::IoBatch* batch) {
+    std::vector<struct iovec> current_iov;
+    int ret = libvdk::iov::slice(iov, iovcnt, iov_offset, len, &current_iov);
+    if (ret == 0) {
+        /* one contiguous extent of the file, a single preadv whatever the iovec layout is */
+        if (mapping_) {
+            ret = mapping_->readv(offset, current_iov.data(), current_iov.size());
+        } else if (shared_cache_ && libvdk::storage::BlockCache::instance().enabled()) {
+            libvdk::storage::Storage* storage = storage_.get();
+            ret = libvdk::storage::BlockCache::instance().readv(cache_key_, offset, current_iov.data(), current_iov.size(),
+                [storage](uint64_t off, const struct iovec* v, int n) { return storage->readv(off, v, n); });
+        } else if (batch && fd() >= 0) {
+            ret = batch->readv(fd(), offset, current_iov.data(), current_iov.size());
+        } else {
+            ret = storage_->readv(offset, current_iov.data(), current_iov.size());
+        }
     }
-    
-    ret = libvdk::file::read_file(fd_, buf, len);
     if (ret) {
         CONSLOG("read from offset %" PRIu64 " with length %u failed", offset, len);        
     }
@@ -571,6 +942,113 @@ int Vhdx::readFromCurrent(uint64_t offset, uint8_t* buf, uint32_t len) {
 }
 
 int Vhdx::write(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = static_cast<size_t>(nb_sectors) << logicalSectorSizeBits();
+
+    return writev(sector_num, nb_sectors, &iov, 1);
+}
+
+int Vhdx::writev(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt) {
+    if (!write_back_.enabled()) {
+        return writeThrough(sector_num, nb_sectors, iov, iovcnt);
+    }
+
+    if (libvdk::iov::total_size(iov, iovcnt) < (static_cast<size_t>(nb_sectors) << logicalSectorSizeBits())) {
+        CONSLOG("iovec is too small for %u sectors", nb_sectors);
+        return -EINVAL;
+    }
+    if (read_only_) {
+        CONSLOG("file: %s is read only", file_.c_str());
+        return -EROFS;
+    }
+    if (sector_num + nb_sectors > (diskSize() >> logicalSectorSizeBits())) {
+        CONSLOG("write sector: %" PRIu64 " , sectors: %u beyond the disk", sector_num, nb_sectors);
+        return -EINVAL;
+    }
+
+    write_back_.write(sector_num, nb_sectors, iov, iovcnt);
+    if (write_back_.needFlush()) {
+        return flushWriteBack();
+    }
+    return 0;
+}
+
+int Vhdx::flushWriteBack() {
+    return write_back_.flush([this](uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt) {
+        return writeThrough(sector_num, nb_sectors, iov, iovcnt);
+    });
+}
+
+int Vhdx::setWriteBack(uint64_t max_bytes, uint32_t max_age_ms/* = kDefaultWriteBackAgeMs*/) {
+    int ret = 0;
+    if (diskSize() == 0) {
+        CONSLOG("file: %s is not parsed", file_.c_str());
+        return -EINVAL;
+    }
+    if (max_bytes == 0 && write_back_.dirtyBytes() > 0) {
+        ret = flushWriteBack();
+        if (ret) {
+            return ret;
+        }
+    }
+
+    write_back_.setup(logicalSectorSizeBits(), max_bytes, max_age_ms);
+    return ret;
+}
+
+int Vhdx::setGroupCommit(uint64_t max_bytes, uint32_t max_age_ms/* = kDefaultGroupCommitAgeMs*/) {
+    if (diskSize() == 0) {
+        CONSLOG("file: %s is not parsed", file_.c_str());
+        return -EINVAL;
+    }
+
+    group_commit_bytes_ = max_bytes;
+    group_commit_age_ms_ = max_age_ms;
+    return (max_bytes == 0 ? commitMetadata(true) : 0);
+}
+
+int Vhdx::commitMetadata(bool force) {
+    int ret = 0;
+    if (!log_section_.hasUpdates()) {
+        return 0;
+    }
+
+    if (!force && group_commit_bytes_ > 0 &&
+        log_section_.pendingBytes() < group_commit_bytes_ &&
+        log_section_.pendingAgeMs() < group_commit_age_ms_) {
+        return 0;
+    }
+
+    ret = log_section_.commitUpdates();
+    if (ret) {
+        CONSLOG("commit log updates of file: %s failed - %d", file_.c_str(), ret);
+    }
+    return ret;
+}
+
+int Vhdx::flush() {
+    int ret = 0;
+    if (write_back_.dirtyBytes() > 0) {
+        ret = flushWriteBack();
+        if (ret) {
+            CONSLOG("write back cached data of file: %s failed - %d", file_.c_str(), ret);
+            return ret;
+        }
+    }
+
+    /* the commit flushes the data before the log entry, the last flush covers the header it resets */
+    if (log_section_.hasUpdates()) {
+        ret = commitMetadata(true);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return storage_->flush();
+}
+
+int Vhdx::writeThrough(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt) {
     using vhdx::bat::PayloadBatEntryStatus;
 
     int ret = -ENOTSUP;
@@ -579,8 +1057,17 @@ int Vhdx::write(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
     uint64_t bat_entry_offset, bitmap_bat_entry_offset;
     PayloadBatEntryStatus status;     
     bool bat_update = false, bitmap_bat_update = false, bitmap_update = false; 
-    uint64_t bat_prior_offset = 0;
+    /* the cached entries before the block is allocated, put back if the write fails before they are logged */
+    vhdx::bat::BatEntry prior_bat_entry = 0, prior_bitmap_bat_entry = 0;
     std::vector<uint8_t> partially_bitmap_buf;   
+    // bytes of iov already done
+    size_t iov_offset = 0;
+    std::vector<struct iovec> block_iov;
+
+    if (libvdk::iov::total_size(iov, iovcnt) < (static_cast<size_t>(nb_sectors) << logicalSectorSizeBits())) {
+        CONSLOG("iovec is too small for %u sectors", nb_sectors);
+        return -EINVAL;
+    }
 
     ret = userVisibleWrite();
     if (ret) {
@@ -594,16 +1081,29 @@ int Vhdx::write(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
         }        
     }
 
+    /* the blocks written may change owner, they are resolved again on next read */
+    if (!chain_map_.empty() && nb_sectors > 0) {
+        chain_map_.invalidate(sector_num >> sectorsPerBlockBits(), (sector_num + nb_sectors - 1) >> sectorsPerBlockBits());
+    }
+
     while (nb_sectors > 0) {
         bool use_zero_buffers = false;        
         bool parent_already_alloc_block = false; 
+        bool bitmap_block_present = false;
         uint64_t block_partially_present_offset = 0;
         uint64_t partially_bitmap_offset = 0;
 
         bat_update = bitmap_bat_update = bitmap_update = false;
         
-        blockTranslate(sector_num, nb_sectors, &si);
-        vhdx::bat::payloadBatStatusOffset(bat_entries_[si.bat_idx], &status, &block_partially_present_offset);
+        ret = blockTranslate(sector_num, nb_sectors, &si);
+        if (ret) {
+            goto exit;
+        }
+
+        /* the data inside one block is one contiguous extent of the file */
+        block_iov.clear();
+        libvdk::iov::slice(iov, iovcnt, iov_offset, si.bytes_avail, &block_iov);
+        vhdx::bat::payloadBatStatusOffset(si.bat_entry, &status, &block_partially_present_offset);
 
         switch (status) {
         case PayloadBatEntryStatus::kBlockZero:
@@ -615,18 +1115,35 @@ int Vhdx::write(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
         case PayloadBatEntryStatus::kBlockNotPresent:
         case PayloadBatEntryStatus::kBlockUndefined:
         case PayloadBatEntryStatus::kBlockUnmapped:
-            bat_prior_offset = si.file_offset;
+            prior_bat_entry = si.bat_entry;
 
             if (diskType() == vhdx::metadata::VirtualDiskType::kDifferencing) {
-                parent_already_alloc_block = isParentAlreadyAllocBlock(si.bat_idx);
+                ret = isParentAlreadyAllocBlock(si.bat_idx, &parent_already_alloc_block);
+                if (ret) {
+                    goto exit;
+                }
 
 #ifdef RW_DEBUG
                 CONSLOG("disk type: %d, parent already alloc block: %d", static_cast<int32_t>(diskType()), parent_already_alloc_block);
 #endif                
             }
 
-            //bat_prior_offset = si.file_offset;
-            ret = allocateBlock(parent_already_alloc_block, &si.file_offset, &si.bitmap_offset, &use_zero_buffers);
+            /* one sector bitmap block covers the whole chunk, it may be there for another block */
+            si.bitmap_offset = 0UL;
+            if (parent_already_alloc_block) {
+                vhdx::bat::BitmapBatEntryStatus bm_status;
+                vhdx::bat::BatEntry bm_entry = 0;
+                ret = batEntry(si.bitmap_idx, &bm_entry);
+                if (ret) {
+                    goto exit;
+                }
+                vhdx::bat::bitmapBatStatusOffset(bm_entry, &bm_status, &si.bitmap_offset);
+                bitmap_block_present = (bm_status == vhdx::bat::BitmapBatEntryStatus::kBlockPresent);
+                prior_bitmap_bat_entry = bm_entry;
+            }
+
+            ret = allocateBlock(parent_already_alloc_block && !bitmap_block_present, 
+                    &si.file_offset, &si.bitmap_offset, &use_zero_buffers);
             if (ret) {
                 goto exit;
             }  
@@ -635,15 +1152,19 @@ int Vhdx::write(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
              * once we support differencing files, this may also be
              * partially present
              */
+            bat_update = true;
             if (parent_already_alloc_block) {
-                updateBatTablePayloadEntry(si, vhdx::bat::PayloadBatEntryStatus::kBlockPartiallyPresent, &bat_entry, &bat_entry_offset);
-                updateBatTableBitmapEntry(si, vhdx::bat::BitmapBatEntryStatus::kBlockPresent, &bitmap_bat_entry, &bitmap_bat_entry_offset);
-                bitmap_bat_update = true;
+                ret = updateBatTablePayloadEntry(si, vhdx::bat::PayloadBatEntryStatus::kBlockPartiallyPresent, &bat_entry, &bat_entry_offset);
+                if (ret == 0 && !bitmap_block_present) {
+                    bitmap_bat_update = true;
+                    ret = updateBatTableBitmapEntry(si, vhdx::bat::BitmapBatEntryStatus::kBlockPresent, &bitmap_bat_entry, &bitmap_bat_entry_offset);
+                }
             } else {
-                updateBatTablePayloadEntry(si, vhdx::bat::PayloadBatEntryStatus::kBlockFullPresent, &bat_entry, &bat_entry_offset);
+                ret = updateBatTablePayloadEntry(si, vhdx::bat::PayloadBatEntryStatus::kBlockFullPresent, &bat_entry, &bat_entry_offset);
             }            
-
-            bat_update = true;
+            if (ret) {
+                goto exit;
+            }
 
             /*
             * Since we just allocated a block, file_offset is the
@@ -662,19 +1183,13 @@ int Vhdx::write(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
             if (si.file_offset < (1 * libvdk::kMiB)) {
                 CONSLOG("write file offset: %" PRIu64 " too small", si.file_offset);
                 ret = -EFAULT;
-                goto error_bat_restore;
+                goto exit;
             }
 
-            ret = libvdk::file::seek_file(fd_, si.file_offset, SEEK_SET);
-            if (ret) {
-                CONSLOG("seek to %" PRIu64 " failed", si.file_offset);
-                goto error_bat_restore;
-            }
-            
-            ret = libvdk::file::write_file(fd_, buf, si.bytes_avail);
+            ret = storage_->writev(si.file_offset, block_iov.data(), block_iov.size());
             if (ret) {
                 CONSLOG("write to offset %" PRIu64 " with length %u failed", si.file_offset, si.bytes_avail);
-                goto error_bat_restore;
+                goto exit;
             }           
 
 #ifndef WRITE_LOG
@@ -716,16 +1231,15 @@ int Vhdx::write(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
             si.file_offset = block_partially_present_offset + si.block_offset;
 
             vhdx::bat::BitmapBatEntryStatus bm_status;
-            vhdx::bat::bitmapBatStatusOffset(bat_entries_[si.bitmap_idx], &bm_status, &si.bitmap_offset);
-            assert(bm_status == vhdx::bat::BitmapBatEntryStatus::kBlockPresent);
-
-            ret = libvdk::file::seek_file(fd_, si.file_offset, SEEK_SET);
+            vhdx::bat::BatEntry bm_entry;
+            ret = batEntry(si.bitmap_idx, &bm_entry);
             if (ret) {
-                CONSLOG("seek to %" PRIu64 " failed", si.file_offset);
                 goto exit;
             }
-            
-            ret = libvdk::file::write_file(fd_, buf, si.bytes_avail);
+            vhdx::bat::bitmapBatStatusOffset(bm_entry, &bm_status, &si.bitmap_offset);
+            assert(bm_status == vhdx::bat::BitmapBatEntryStatus::kBlockPresent);
+
+            ret = storage_->writev(si.file_offset, block_iov.data(), block_iov.size());
             if (ret) {
                 CONSLOG("write to offset %" PRIu64 " with length %u failed", si.file_offset, si.bytes_avail);
                 goto exit;
@@ -755,112 +1269,134 @@ int Vhdx::write(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
         }
 
 #ifdef WRITE_LOG
-        if (bat_update) {
-            /* this will update the BAT entry into the log journal, and
-                * then flush the log journal out to disk */            
-            ret = log_section_.writeLogEntryAndFlush(bat_entry_offset, &bat_entry, sizeof(vhdx::bat::BatEntry));
+        /* the updates of all blocks go into one log entry, committed when the write is done */
+        if (bitmap_bat_update) {
+            ret = log_section_.addUpdate(bitmap_bat_entry_offset, &bitmap_bat_entry, sizeof(vhdx::bat::BatEntry));
             if (ret) {
-                CONSLOG("write payload bat log entry failed");
+                CONSLOG("add bitmap bat log update failed");
                 goto exit;
             }
         }
 
         if (bitmap_update) {
-            ret = log_section_.writeLogEntryAndFlush(partially_bitmap_offset, partially_bitmap_buf.data(), partially_bitmap_buf.size());
+            ret = log_section_.addUpdate(partially_bitmap_offset, partially_bitmap_buf.data(), partially_bitmap_buf.size());
             if (ret) {
-                CONSLOG("write partially bitmap log entry failed");
+                CONSLOG("add partially bitmap log update failed");
                 goto exit;
             }
+            /* like the cached BAT pages, the cached bitmap pages are ahead of the file until the commit */
+            bitmap_cache_.update(partially_bitmap_offset, partially_bitmap_buf.data(), partially_bitmap_buf.size());
         }
 
-        if (bitmap_bat_update) {
-            ret = log_section_.writeLogEntryAndFlush(bitmap_bat_entry_offset, &bitmap_bat_entry, sizeof(vhdx::bat::BatEntry));
+        if (bat_update) {
+            ret = log_section_.addUpdate(bat_entry_offset, &bat_entry, sizeof(vhdx::bat::BatEntry));
             if (ret) {
-                CONSLOG("write bitmap bat log entry failed");
+                CONSLOG("add payload bat log update failed");
                 goto exit;
             }
         }
 #endif
         nb_sectors -= si.sectors_avail;
         sector_num += si.sectors_avail;
-        buf += si.bytes_avail;             
+        iov_offset += si.bytes_avail;             
     }
     ret = 0;
     goto exit;
 
-error_bat_restore:
-    if (bat_update) {
-        si.file_offset = bat_prior_offset;
-        updateBatTablePayloadEntry(si, status, nullptr, nullptr);
+exit:
+    /* a block that failed between its BAT update and the last log update is not allocated,
+     * otherwise the next write finds it present and logs nothing for it */
+    if (ret) {
+        if (bat_update) {
+            bat_table_.set(si.bat_idx, prior_bat_entry);
+        }
+        if (bitmap_bat_update) {
+            bat_table_.set(si.bitmap_idx, prior_bitmap_bat_entry);
+        }
     }
 
-exit:
+#ifdef WRITE_LOG
+    /* the blocks written before a failure keep their updates, with group commit they wait for flush() */
+    if (log_section_.hasUpdates()) {
+        int commit_ret = commitMetadata(false);
+        ret = (ret ? ret : commit_ret);
+    }
+#endif
     return ret;
 }
 
-int Vhdx::allocateBlock(bool parent_already_alloc_block, uint64_t* new_offset, uint64_t* bitmap_offset, bool* need_zero) {
+int Vhdx::allocateBlock(bool alloc_bitmap_block, uint64_t* new_offset, uint64_t* bitmap_offset, bool* need_zero) {
     int ret;
-    uint64_t current_len, new_file_size;
+    uint64_t alloc_offset, alloc_len;
 
-    ret = libvdk::file::get_file_sizes(fd_, reinterpret_cast<int64_t *>(&current_len));
-    if (ret) {
-        return ret;
-    }    
-
-    *new_offset = current_len;
-
-    *new_offset = libvdk::convert::roundUp(*new_offset, 1 * libvdk::kMiB);
-
-    if (parent_already_alloc_block) {
-        *bitmap_offset = *new_offset;
+    alloc_len = mtd_section_.blockSize();
+    if (alloc_bitmap_block) {
         // added bitmap block size (default 1MiB)
-        *new_offset += 1 * libvdk::kMiB;   
-    } else {
-        *bitmap_offset = 0UL;
-    }    
-
-    new_file_size = *new_offset + mtd_section_.blockSize();
+        alloc_len += 1 * libvdk::kMiB;
+    }
 
-    ret = libvdk::file::truncate_file(fd_, new_file_size);
+    /* the tail is kept in memory and the file grows growth_blocks_ blocks at a time with
+     * fallocate, the block gets contiguous extents up front. Allocated space reads as zero,
+     * kBlockZero asks for the zeroes explicitly */
+    tail_allocator_.setChunkBytes(static_cast<uint64_t>(growth_blocks_) * mtd_section_.blockSize());
+    ret = tail_allocator_.allocate(storage_.get(), 1 * libvdk::kMiB, alloc_len, *need_zero, &alloc_offset);
     if (ret) {
-        CONSLOG("truncate file: %s to size: %" PRIu64 " failed - %d", file_.c_str(), new_file_size, ret);
+        CONSLOG("allocate %" PRIu64 " bytes in file: %s failed - %d", alloc_len, file_.c_str(), ret);
+        return ret;
+    }
+
+    *new_offset = alloc_offset;
+    if (alloc_bitmap_block) {
+        *bitmap_offset = alloc_offset;
+        *new_offset += 1 * libvdk::kMiB;
     }
+    *need_zero = false;
 
     return ret;
 }
 
-void Vhdx::updateBatTablePayloadEntry(const detail::SectorInfo& si, vhdx::bat::PayloadBatEntryStatus status, 
+int Vhdx::updateBatTablePayloadEntry(const detail::SectorInfo& si, vhdx::bat::PayloadBatEntryStatus status, 
             vhdx::bat::BatEntry* bat_entry, uint64_t* bat_entry_offset) {
 
-    bat_entries_[si.bat_idx] = vhdx::bat::makePayloadBatEntry(status, si.file_offset);
+    vhdx::bat::BatEntry entry = vhdx::bat::makePayloadBatEntry(status, si.file_offset);
+    int ret = bat_table_.set(si.bat_idx, entry);
+    if (ret) {
+        return ret;
+    }
 
     if (bat_entry) {
-        *bat_entry = bat_entries_[si.bat_idx];
+        *bat_entry = entry;
     }
     if (bat_entry_offset) {
         *bat_entry_offset = hdr_section_.batEntry().file_offset + si.bat_idx * sizeof(vhdx::bat::BatEntry);
     }
+    return 0;
 }
 
-void Vhdx::updateBatTableBitmapEntry(const detail::SectorInfo& si, vhdx::bat::BitmapBatEntryStatus status,
+int Vhdx::updateBatTableBitmapEntry(const detail::SectorInfo& si, vhdx::bat::BitmapBatEntryStatus status,
     vhdx::bat::BatEntry* bat_entry, uint64_t* bat_entry_offset) {
 
-    bat_entries_[si.bitmap_idx] = vhdx::bat::makeBitmapBatEntry(status, si.bitmap_offset); 
+    vhdx::bat::BatEntry entry = vhdx::bat::makeBitmapBatEntry(status, si.bitmap_offset);
+    int ret = bat_table_.set(si.bitmap_idx, entry);
+    if (ret) {
+        return ret;
+    }
 
     if (bat_entry) {
-        *bat_entry = bat_entries_[si.bitmap_idx];
+        *bat_entry = entry;
     }
 
     if (bat_entry_offset) {
         *bat_entry_offset = hdr_section_.batEntry().file_offset + si.bitmap_idx * sizeof(vhdx::bat::BatEntry);
     }   
+    return 0;
 }
 
 int Vhdx::userVisibleWrite() {
     int ret = 0;
     if (first_visible_write_) {
         first_visible_write_ = false;
-        ret = hdr_section_.updateHeader(fd_, &file_rw_guid_);
+        ret = hdr_section_.updateHeader(storage_.get(), &file_rw_guid_);
     }
 
     return ret;
@@ -874,9 +1410,9 @@ int Vhdx::buildParentList() {
             std::string pa_path = current->mtd_section_.parentAbsoluteWin32Path();
             std::string pr_path = current->mtd_section_.parentRelativePath();
             std::string parent_path;
-            if (libvdk::file::exist_file(pa_path) == 0) {
+            if (libvdk::storage::exist_storage(pa_path) == 0) {
                 parent_path = pa_path;
-            } else if (libvdk::file::exist_file(pr_path) == 0) {
+            } else if (libvdk::storage::exist_storage(pr_path) == 0) {
                 parent_path = pr_path;
             }
             if (parent_path.empty()) {
@@ -886,31 +1422,23 @@ int Vhdx::buildParentList() {
                 break;
             }
 
-            Vhdx* parent = new Vhdx(parent_path);
-            if (parent->parse()) {
-                CONSLOG("parse parent file: %s failed", parent_path.c_str());
-                ret = -1;
-                break;
-            }
-
-            std::string parent_data_write_guid = libvdk::guid::toWinString(&parent->dataWriteGuid(), false);
-            std::string current_linkage = current->mtd_section_.parentLinkageForCompare();
-            if (parent_data_write_guid != current_linkage) {
-                CONSLOG("linkage mismatch[%s|%s]", 
-                    current_linkage.c_str(),
-                    parent_data_write_guid.c_str());
-                ret = -1;
+            std::shared_ptr<Vhdx> parent;
+            ret = openParent(parent_path, current->mtd_section_.parentLinkageForCompare(), &parent);
+            if (ret) {
                 break;
             }
-
-            parents_.emplace_back(parent);
+            parents_.push_back(parent);
 
             if (parent->diskType() != vhdx::metadata::VirtualDiskType::kDifferencing) {
                 break;
             }
 
-            current = parent;
+            current = parent.get();
         };
+
+        if (ret == 0) {
+            buildChainMap();
+        }
     }
 
     if (ret) {
@@ -922,31 +1450,105 @@ int Vhdx::buildParentList() {
     return ret;
 }
 
+int Vhdx::openParent(const std::string& path, const std::string& linkage, std::shared_ptr<Vhdx>* parent) {
+    using Registry = libvdk::storage::LayerRegistry<Vhdx>;
+
+    int err = 0;
+    std::string canonical_path = libvdk::storage::absolute_path(path, &err);
+    if (err) {
+        CONSLOG("get absolute path of parent file: %s failed - %d", path.c_str(), err);
+        return -1;
+    }
+
+    /* the data write guid changes with the first write, a modified parent gets a new key */
+    std::string key = Registry::key(canonical_path, linkage, direct_io_, io_engine_, access_hint_);
+    *parent = Registry::instance().find(key);
+    if (*parent) {
+        return 0;
+    }
+
+    std::shared_ptr<Vhdx> layer = std::make_shared<Vhdx>(path, true, direct_io_);
+    if (layer->parse()) {
+        CONSLOG("parse parent file: %s failed", path.c_str());
+        return -1;
+    }
+
+    std::string parent_data_write_guid = libvdk::guid::toWinString(&layer->dataWriteGuid(), false);
+    if (parent_data_write_guid != linkage) {
+        CONSLOG("linkage mismatch[%s|%s]", 
+            linkage.c_str(),
+            parent_data_write_guid.c_str());
+        return -1;
+    }
+
+    /* parents are never written while children use them, their data can be shared process wide */
+    layer->shared_cache_ = (libvdk::storage::BlockCache::fileKey(layer->fd(), &layer->cache_key_) == 0);
+    layer->setIoEngine(io_engine_, access_hint_);
+    layer->setBatCacheBytes(bat_table_.cacheBytes());
+    layer->setBitmapCacheBytes(bitmap_cache_.maxPages() * static_cast<uint64_t>(libvdk::storage::PageCache::kPageSize));
+
+    *parent = Registry::instance().add(key, layer);
+    return 0;
+}
+
 void Vhdx::showParentInfo() {
     printf("=== parent ===\n");
     for (size_t i=0; i<parents_.size(); ++i) {
-        std::unique_ptr<Vhdx>& parent = parents_[i];
+        std::shared_ptr<Vhdx>& parent = parents_[i];
 
         parent->showMetadataSection();
     }
 }
 
-bool Vhdx::isParentAlreadyAllocBlock(uint32_t bat_index) {
-    bool ret = false;
+int Vhdx::isParentAlreadyAllocBlock(uint32_t bat_index, bool* allocated) {
+    using libvdk::storage::ParentBlockSet;
+
+    int ret = 0;
+    ParentBlockSet::State state = parent_blocks_.get(bat_index);
+    if (state != ParentBlockSet::State::kUnknown) {
+        *allocated = (state == ParentBlockSet::State::kAllocated);
+        return 0;
+    }
+
+    *allocated = false;
     for (size_t i=0; i<parents_.size(); ++i) {
-        std::unique_ptr<Vhdx>& parent = parents_[i];
+        std::shared_ptr<Vhdx>& parent = parents_[i];
 
-        vhdx::bat::BatEntry bat_entry = parent->bat()[bat_index];
+        vhdx::bat::BatEntry bat_entry = 0;
+        ret = parent->batEntry(bat_index, &bat_entry);
+        if (ret) {
+            break;
+        }
         vhdx::bat::PayloadBatEntryStatus status;
         vhdx::bat::payloadBatStatusOffset(bat_entry, &status, nullptr);
 
         if (status == vhdx::bat::PayloadBatEntryStatus::kBlockFullPresent ||
             status == vhdx::bat::PayloadBatEntryStatus::kBlockPartiallyPresent) {
-            ret = true;
+            *allocated = true;
             break;
         }
     }
 
+    if (ret == 0) {
+        parent_blocks_.set(bat_index, *allocated ? ParentBlockSet::State::kAllocated : ParentBlockSet::State::kUnallocated);
+    }
+
+    return ret;
+}
+
+int Vhdx::readAt(uint64_t offset, void* buf, size_t len) {
+    if (mapping_) {
+        return mapping_->read(offset, buf, len);
+    }
+
+    return storage_->read(offset, buf, len);
+}
+
+int Vhdx::readMetadata(uint64_t offset, void* buf, size_t len) {
+    int ret = readAt(offset, buf, len);
+    if (ret == 0) {
+        log_section_.overlayUpdates(offset, buf, len);
+    }
     return ret;
 }
 
@@ -954,13 +1556,7 @@ int Vhdx::loadBlockBitmap(uint64_t bitmap_offset, std::vector<uint8_t>* bitmap_b
     int ret = 0;
     bitmap_buf->resize(1 * libvdk::kMiB);
 
-    ret = libvdk::file::seek_file(fd_, bitmap_offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to %" PRIu64 " failed", bitmap_offset); 
-        return ret;       
-    }
-    
-    ret = libvdk::file::read_file(fd_, bitmap_buf->data(), bitmap_buf->size());
+    ret = readAt(bitmap_offset, bitmap_buf->data(), bitmap_buf->size());
     if (ret) {
         CONSLOG("read from offset %" PRIu64 " with length %lu failed", bitmap_offset, bitmap_buf->size());
     }
@@ -975,11 +1571,16 @@ int Vhdx::loadPartiallyBlockBitmap(uint64_t sector_num, uint32_t nb_sectors,
     uint32_t secs_index = sector_num % vhdx::bat::kSectorsPerBitmap;
     uint32_t byte_index = secs_index / 8;
     assert(byte_index < (1 * libvdk::kMiB));
+
+    /* load whole aligned sectors of the bitmap, so O_DIRECT needs no bounce buffer,
+     * the sector bitmap block is 1MB aligned in the file */
+    uint32_t aligned_index = libvdk::convert::roundDown(byte_index, libvdk::file::kDirectIoAlignment);
     
-    *bitmap_offset += byte_index;    
-    *secs = secs_index % 8;
+    *bitmap_offset += aligned_index;    
+    *secs = secs_index - (aligned_index * 8);
 
-    uint32_t need_bytes = libvdk::convert::divRoundUp((*secs + nb_sectors), 8);
+    uint32_t need_bytes = libvdk::convert::roundUp(libvdk::convert::divRoundUp((*secs + nb_sectors), 8), 
+            libvdk::file::kDirectIoAlignment);
     bitmap_buf->resize(need_bytes);
 
 #ifdef RW_DEBUG
@@ -987,15 +1588,17 @@ int Vhdx::loadPartiallyBlockBitmap(uint64_t sector_num, uint32_t nb_sectors,
         sector_num, nb_sectors, need_bytes, byte_index, *secs, *bitmap_offset);
 #endif
 
-    ret = libvdk::file::seek_file(fd_, *bitmap_offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to %" PRIu64 " failed", *bitmap_offset); 
-        return ret;       
-    }
-    
-    ret = libvdk::file::read_file(fd_, bitmap_buf->data(), bitmap_buf->size());
-    if (ret) {
-        CONSLOG("read from offset %" PRIu64 " with length %lu failed", *bitmap_offset, bitmap_buf->size());
+    /* the pages come from the bitmap cache, hot partially present blocks need no reads */
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    for (uint32_t done = 0; done < need_bytes; done += libvdk::storage::PageCache::kPageSize) {
+        uint8_t* page = nullptr;
+        ret = bitmap_cache_.get(*bitmap_offset + done, libvdk::storage::PageCache::kPageSize, &page);
+        if (ret) {
+            CONSLOG("read from offset %" PRIu64 " with length %u failed", *bitmap_offset + done, 
+                libvdk::storage::PageCache::kPageSize);
+            break;
+        }
+        memcpy(bitmap_buf->data() + done, page, libvdk::storage::PageCache::kPageSize);
     }
 
     return ret;
@@ -1004,13 +1607,7 @@ int Vhdx::loadPartiallyBlockBitmap(uint64_t sector_num, uint32_t nb_sectors,
 int Vhdx::saveBlockBitmap(uint64_t bitmap_offset, const std::vector<uint8_t>& bitmap_buf) {
     int ret = 0;    
 
-    ret = libvdk::file::seek_file(fd_, bitmap_offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to %" PRIu64 " failed", bitmap_offset); 
-        return ret;       
-    }
-    
-    ret = libvdk::file::write_file(fd_, reinterpret_cast<const void *>(bitmap_buf.data()), bitmap_buf.size());
+    ret = storage_->write(bitmap_offset, reinterpret_cast<const void *>(bitmap_buf.data()), bitmap_buf.size());
     if (ret) {
         CONSLOG("write to offset %" PRIu64 " with length %lu failed", bitmap_offset, bitmap_buf.size());
     }
@@ -1021,9 +1618,7 @@ int Vhdx::saveBlockBitmap(uint64_t bitmap_offset, const std::vector<uint8_t>& bi
 int Vhdx::writeBitmap(uint64_t bitmap_offset, uint64_t sector_num, uint32_t nb_sectors) {
     int ret = 0;
     std::vector<uint8_t> bitmap_buf;
-    uint8_t *p = nullptr;
     uint32_t secs = 0; //sector_num % vhdx::bat::kSectorsPerBitmap;
-    uint32_t i;    
 
     // ret = loadBlockBitmap(bitmap_offset, &bitmap_buf);
     ret = loadPartiallyBlockBitmap(sector_num, nb_sectors, &bitmap_offset, &secs, &bitmap_buf);
@@ -1032,59 +1627,39 @@ int Vhdx::writeBitmap(uint64_t bitmap_offset, uint64_t sector_num, uint32_t nb_s
         goto exit;
     }
 
-    p = bitmap_buf.data();    
-    for (i = 0; i < nb_sectors; ++i) {
-        setBit(p, secs + i);
-    }
+    libvdk::bitmap::set_range(bitmap_buf.data(), secs, nb_sectors);
 
     ret = saveBlockBitmap(bitmap_offset, bitmap_buf);
     if (ret) {
         CONSLOG("save block bitmap failed");
         goto exit;
     }
+    bitmap_cache_.update(bitmap_offset, bitmap_buf.data(), bitmap_buf.size());
 exit:
     return ret;
 }
 
 int Vhdx::modifyPartiallyBitmap(uint64_t *bitmap_offset, uint64_t sector_num, uint32_t nb_sectors, std::vector<uint8_t>* partially_bitmap_buf) {
     int ret = 0;
-    uint8_t *p = nullptr;
     uint32_t secs = 0; //sector_num % vhdx::bat::kSectorsPerBitmap;
-    uint32_t i;
 
     ret = loadPartiallyBlockBitmap(sector_num, nb_sectors, bitmap_offset, &secs, partially_bitmap_buf);
     if (ret) {
         CONSLOG("load block bitmap failed");
         goto exit;
     }
+    /* an earlier block of this write may have set bits of the same bitmap sectors */
+    log_section_.overlayUpdates(*bitmap_offset, partially_bitmap_buf->data(), partially_bitmap_buf->size());
 
-    p = partially_bitmap_buf->data();    
-    for (i = 0; i < nb_sectors; ++i) {
-        setBit(p, secs + i);
-    }
+    libvdk::bitmap::set_range(partially_bitmap_buf->data(), secs, nb_sectors);
 
 exit:
     return ret;
 }
 
 int Vhdx::writeBatTableEntry(uint32_t bat_index) {
-    int ret = 0;    
-
-    vhdx::bat::BatEntry bat_entry = bat_entries_[bat_index];
-    uint64_t bat_entry_offset = hdr_section_.batEntry().file_offset + bat_index * sizeof(vhdx::bat::BatEntry);
-    
-    ret = libvdk::file::seek_file(fd_, bat_entry_offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to %" PRIu64 " failed", bat_entry_offset); 
-        return ret;       
-    }
-    
-    ret = libvdk::file::write_file(fd_, &bat_entry, sizeof(bat_entry));
-    if (ret) {
-        CONSLOG("write to offset %" PRIu64 " with length %u failed", bat_entry_offset, static_cast<uint32_t>(sizeof(bat_entry)));
-    }
-
-    return ret;
+    /* write the cached page holding the entry, not the 8 bytes alone */
+    return bat_table_.writeEntry(bat_index);
 }
 
 const char* Vhdx::payloadStatusToString(vhdx::bat::PayloadBatEntryStatus status) {
@@ -7,6 +7,7 @@
 #include "common.h"
 #include "utils.h"
 
+#include "bat.h"
 #include "header.h"
 #include "log.h"
 #include "metadata.h"
@@ -18,20 +19,40 @@ struct SectorInfo;
 
 class Vhdx {
 public:
-    static int createFixed(const std::string& file, uint64_t size_in_bytes);    
-    static int createDynamic(const std::string& file, uint64_t size_in_bytes);
+    // new blocks are preallocated this many at a time, the unused tail is trimmed on unload
+    static const uint32_t kDefaultGrowthBlocks = 4;
+    // sequential readers get up to this much prefetched ahead of them
+    static const uint32_t kDefaultReadaheadBytes = 4 * 1024 * 1024;
+    // sector bitmap pages of partially present blocks kept in memory, one 4KiB page covers 32768 sectors
+    static const uint32_t kDefaultBitmapCacheBytes = 2 * 1024 * 1024;
+    // dirty data of the write back cache is written once it is this old
+    static const uint32_t kDefaultWriteBackAgeMs = 5000;
+    // pending metadata updates of group commit are committed once they are this old
+    static const uint32_t kDefaultGroupCommitAgeMs = 5000;
+
+    // size of the metadata log of new files, a larger log holds more entries before they are checkpointed
+    static const uint32_t kDefaultLogBytes = 1 * 1024 * 1024;
+
+    // log_bytes: a multiple of 1MiB, logs larger than the default are placed behind the BAT
+    static int createFixed(const std::string& file, uint64_t size_in_bytes, uint32_t log_bytes = kDefaultLogBytes);    
+    static int createDynamic(const std::string& file, uint64_t size_in_bytes, uint32_t log_bytes = kDefaultLogBytes);
     static int createDifferencing(const std::string& file, const std::string& parent_file, 
                 const std::string& parent_absolute_path = std::string(""), 
-                const std::string& parent_relative_path = std::string(""));
+                const std::string& parent_relative_path = std::string(""),
+                uint32_t log_bytes = kDefaultLogBytes);
+    // clone (reflink where the file system supports it) or copy src_file to dst_file,
+    // the copy gets new file and data write guids so it is a distinct image
+    static int copy(const std::string& src_file, const std::string& dst_file);
 
     Vhdx();
-    explicit Vhdx(const std::string& file, bool read_only = true);
+    // direct_io: open with O_DIRECT, parents found by buildParentList are opened the same way
+    explicit Vhdx(const std::string& file, bool read_only = true, bool direct_io = false);
     Vhdx(const Vhdx& rhs) = delete;
     Vhdx& operator=(const Vhdx& rhs) = delete;
 
     ~Vhdx();
 
-    int load(const std::string& file, bool read_only = true);
+    int load(const std::string& file, bool read_only = true, bool direct_io = false);
     void unload();
 
     int parse();
@@ -40,11 +61,50 @@ public:
 
     int read(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf);
     int write(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf);
-
+    // scatter-gather version, iov must hold at least nb_sectors of logical sectors
+    int readv(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt);
+    int writev(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt);
+    // write the dirty data of the write back cache, commit the pending metadata updates and flush the file,
+    // unload() does the same
+    int flush();
+
+    libvdk::storage::Storage* storage() {
+        return storage_.get();
+    }
+    // -1 if the storage is not a file
     int fd() const {
-        return fd_;
+        return (storage_ ? storage_->fd() : -1);
+    }
+
+    // kUring: data reads of one readv() across the whole parent chain go in one io_uring batch
+    // kMmap: read only layers of the chain are mapped, payload and bitmap reads are memcpy
+    // parents are opened again with the engine and hint, shared parents never change engine
+    void setIoEngine(libvdk::file::IoEngine engine, 
+            libvdk::file::AccessHint hint = libvdk::file::AccessHint::kNormal);
+
+    // 1: grow the file one block at a time
+    void setGrowthBlocks(uint32_t blocks) {
+        growth_blocks_ = (blocks == 0 ? 1 : blocks);
     }
 
+    // 0: no readahead, direct io images never read ahead
+    void setReadahead(uint32_t max_bytes);
+
+    // writes are kept in memory and merged, they reach the file on flush(), when more than max_bytes
+    // are dirty or when the oldest is max_age_ms old (checked by the next write)
+    // max_bytes 0: write through (default), the cached data is written first. max_age_ms 0: no age
+    // limit. Call after parse()
+    int setWriteBack(uint64_t max_bytes, uint32_t max_age_ms = kDefaultWriteBackAgeMs);
+
+    // BAT and sector bitmap updates of writes are kept in the log section and committed together as
+    // one log entry on flush(), when more than max_bytes are pending or when the oldest is max_age_ms
+    // old (checked by the next write). Writes since the last commit may be lost on a crash
+    // 0: every write commits its updates (default), the pending ones are committed first. Call after parse()
+    int setGroupCommit(uint64_t max_bytes, uint32_t max_age_ms = kDefaultGroupCommitAgeMs);
+
+    // end of the used part of the file, preallocated space excluded
+    int fileLength(int64_t* length);
+
     header::HeaderSection* headerSection() {
         return &hdr_section_;
     }
@@ -126,9 +186,20 @@ public:
         return mtd_section_.sectorsPerBlockBits();
     }
 
-    const vhdx::bat::BatEntry* bat() const {
-        return bat_entries_;
-    }    
+    // through the BAT page cache, the page is read from the file on first use
+    int batEntry(uint32_t index, vhdx::bat::BatEntry* entry) {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        return bat_table_.get(index, entry);
+    }
+    // only from a cached BAT page, never reads the file or waits for the cache
+    bool peekBatEntry(uint32_t index, vhdx::bat::BatEntry* entry) {
+        std::unique_lock<std::mutex> lock(cache_mutex_, std::try_to_lock);
+        return lock.owns_lock() && bat_table_.peek(index, entry);
+    }
+    // memory cap of the BAT page cache of this image and its parents
+    void setBatCacheBytes(uint64_t bytes);
+    // memory cap of the sector bitmap page cache of this image and its parents
+    void setBitmapCacheBytes(uint64_t bytes);
     
     void showHeaderSection() const {
         hdr_section_.show();
@@ -144,7 +215,9 @@ public:
     void showParentInfo();
 
     int buildParentList();
-    bool isParentAlreadyAllocBlock(uint32_t bat_index);
+    // parents are shared through libvdk::storage::LayerRegistry by every handle whose chain reaches them
+    int openParent(const std::string& path, const std::string& linkage, std::shared_ptr<Vhdx>* parent);
+    int isParentAlreadyAllocBlock(uint32_t bat_index, bool* allocated);
 
     /* Per the spec, on the first write of guest-visible data to the file the
      * data write guid must be updated in the header */
@@ -171,18 +244,26 @@ private:
     static int createVdkFile(const std::string& file, const std::string& parent_file, uint64_t size_in_bytes, 
         bool is_fixed = false, 
         const std::string& parent_absolute_path = std::string(""), 
-        const std::string& parent_relative_path = std::string(""));
+        const std::string& parent_relative_path = std::string(""),
+        uint32_t log_bytes = kDefaultLogBytes);
 
     // Perform sector to block offset translations, to get various sector and file offsets into the image.
-    void blockTranslate(uint64_t sector_num, uint32_t nb_sectors, detail::SectorInfo* si);
+    // cached_only: -EAGAIN instead of reading the BAT page from the file
+    int blockTranslate(uint64_t sector_num, uint32_t nb_sectors, detail::SectorInfo* si, bool cached_only = false);
 
-    int  allocateBlock(bool parent_already_alloc_block, uint64_t* new_offset, uint64_t* bitmap_offset, bool* need_zero);
-    void updateBatTablePayloadEntry(const detail::SectorInfo& si, vhdx::bat::PayloadBatEntryStatus status, 
+    // alloc_bitmap_block: put a new sector bitmap block in front of the payload block
+    // need_zero: the block must read as zero (kBlockZero), cleared once that is ensured
+    int  allocateBlock(bool alloc_bitmap_block, uint64_t* new_offset, uint64_t* bitmap_offset, bool* need_zero);
+    int updateBatTablePayloadEntry(const detail::SectorInfo& si, vhdx::bat::PayloadBatEntryStatus status, 
             vhdx::bat::BatEntry* bat_entry, uint64_t* bat_entry_offset);
-    void updateBatTableBitmapEntry(const detail::SectorInfo& si, vhdx::bat::BitmapBatEntryStatus status,
+    int updateBatTableBitmapEntry(const detail::SectorInfo& si, vhdx::bat::BitmapBatEntryStatus status,
             vhdx::bat::BatEntry* bat_entry, uint64_t* bat_entry_offset);
 
     int writeBitmap(uint64_t bitmap_offset, uint64_t sector_num, uint32_t nb_sectors);
+    // read from the mapping if there is one, otherwise from storage_
+    int readAt(uint64_t offset, void* buf, size_t len);
+    // readAt with the metadata updates not committed yet on top, the bat and bitmap pages are read with it
+    int readMetadata(uint64_t offset, void* buf, size_t len);
     int loadBlockBitmap(uint64_t bitmap_offset, std::vector<uint8_t>* bitmap_buf);
     int saveBlockBitmap(uint64_t bitmap_offset, const std::vector<uint8_t>& bitmap_buf);
     int loadPartiallyBlockBitmap(uint64_t sector_num, uint32_t nb_sectors, 
@@ -192,28 +273,71 @@ private:
 
     int writeBatTableEntry(uint32_t bat_index);
 
-    int readRecursion(int vhdx_index, uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf);
-    int readFromParents(int parents_index, uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf);
-    int readFromCurrent(uint64_t offset, uint8_t* buf, uint32_t len);
+    // the write path behind the write back cache
+    int writeThrough(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt);
+    int flushWriteBack();
+    // commit the pending log updates if force, group commit is off or a threshold is reached
+    int commitMetadata(bool force);
+    int readRecursion(int vhdx_index, uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt);
+    // read nb_sectors into iov starting at byte iov_offset
+    // a block fully present in one layer of the chain is read straight from that layer,
+    // *sectors is 0 if the block needs the layer by layer walk
+    int readOwnedBlock(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt, size_t iov_offset,
+            uint32_t* sectors);
+    int resolveOwner(uint64_t block, uint64_t* owner);
+    void buildChainMap();
+    int readFromParents(int parents_index, uint64_t sector_num, uint32_t nb_sectors, 
+            const struct iovec* iov, int iovcnt, size_t iov_offset);
+    // queue the read into batch if not null, it is done when batch->wait() returns
+    int readFromCurrent(uint64_t offset, const struct iovec* iov, int iovcnt, size_t iov_offset, uint32_t len, 
+            libvdk::file::IoBatch* batch);
+    int setupIoBatch();
+    // hint the layers holding the data of the sectors, the parent chain is resolved like readRecursion
+    // from cached BAT pages only, an uncached page is hinted and ends the walk
+    void prefetchRecursion(int vhdx_index, uint64_t sector_num, uint32_t nb_sectors);
+    void prefetchCurrent(uint64_t offset, uint32_t len);
 
     header::HeaderSection hdr_section_;
     log::LogSection log_section_;
     metadata::MetadataSection mtd_section_;
 
-    std::vector<uint8_t> bat_buf_;
-    // point to the begin of bat_buf_.data()
-    vhdx::bat::BatEntry* bat_entries_;
+    vhdx::bat::BatTable bat_table_;
 
     std::string file_;
-    int fd_;
+    std::unique_ptr<libvdk::storage::Storage> storage_;
+    bool read_only_;
+    bool direct_io_;
 
     bool first_visible_write_;
+    uint32_t growth_blocks_;
+    libvdk::storage::TailAllocator tail_allocator_;
     /* This is used for any header updates, for the file_write_guid.
      * The spec dictates that a new value should be used for the first
      * header update */
     libvdk::guid::GUID file_rw_guid_;
 
-    std::vector<std::unique_ptr<Vhdx>> parents_;
+    std::vector<std::shared_ptr<Vhdx>> parents_;
+    // owning layer of each virtual block, only for a chain of one block size
+    libvdk::storage::ChainMap chain_map_;
+    // by payload bat index of this image, whether any parent holds the block
+    libvdk::storage::ParentBlockSet parent_blocks_;
+
+    libvdk::file::IoEngine io_engine_;
+    libvdk::file::AccessHint access_hint_;
+    std::unique_ptr<libvdk::file::IoBatch> io_batch_;
+    std::unique_ptr<libvdk::file::MappedFile> mapping_;
+    libvdk::file::StreamDetector readahead_;
+    // sector bitmap pages by file offset, updated with the bitmap written or added to the log
+    libvdk::storage::PageCache bitmap_cache_;
+    libvdk::storage::WriteBackCache write_back_;
+    // 0: group commit off
+    uint64_t group_commit_bytes_;
+    uint32_t group_commit_age_ms_;
+    // payload reads of a parent go through libvdk::storage::BlockCache when it is enabled
+    bool shared_cache_;
+    libvdk::storage::BlockCache::FileKey cache_key_;
+    // a shared parent is read by handles in other threads, guards the bat and bitmap caches
+    std::mutex cache_mutex_;
 };
 } //namespace vhdx
 
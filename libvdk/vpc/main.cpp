@@ -19,6 +19,7 @@ void usage(const char* argv0) {
     printf("usage: %s -w sector_num[:sectors(default:1)] /path/to/vhd_file (for test)\n", argv0);
     printf("usage: %s -b sector_num /path/to/vhd_file\n", argv0);    
     printf("usage: %s -c 0 /path/to/vhd_file (empty dynamic or differencing)\n", argv0); 
+    printf("usage: %s -t engine(0:sync|1:io_uring|2:mmap)[:s|r] /path/to/vhd_file (read benchmark)\n", argv0);
 }
 
 int main(int argc, char* argv[]) {
@@ -31,6 +32,9 @@ int main(int argc, char* argv[]) {
     bool write_sectors = false;
     bool read_bat_bitmap = false;
     bool empty_disk = false;
+    bool bench_read = false;
+    libvdk::file::IoEngine io_engine = libvdk::file::IoEngine::kSync;
+    libvdk::file::AccessHint access_hint = libvdk::file::AccessHint::kNormal;
     // uint32_t bat_index = 0;
     // uint32_t bat_count = 1;
     uint64_t sector_num = 0UL;
@@ -38,7 +42,7 @@ int main(int argc, char* argv[]) {
     int c;
     char unit;
 
-    while ((c = getopt(argc, argv, "c:p:s:hma:e:r:w:b:")) != -1) {
+    while ((c = getopt(argc, argv, "c:p:s:hma:e:r:w:b:t:")) != -1) {
         switch (c) {
         case 'c':
             disk_type = atoi(optarg);            
@@ -71,6 +75,26 @@ int main(int argc, char* argv[]) {
         case 'm':
             modify_parent_locator = true;
             break;
+        case 't':
+            {
+                std::string tp(optarg);
+                std::size_t pos = tp.find(':');
+                io_engine = static_cast<libvdk::file::IoEngine>(atoi(tp.substr(0, pos).c_str()));
+                if (io_engine != libvdk::file::IoEngine::kSync && io_engine != libvdk::file::IoEngine::kUring && 
+                    io_engine != libvdk::file::IoEngine::kMmap) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                if (pos != std::string::npos) {
+                    if (tp.substr(pos+1) == "s") {
+                        access_hint = libvdk::file::AccessHint::kSequential;
+                    } else if (tp.substr(pos+1) == "r") {
+                        access_hint = libvdk::file::AccessHint::kRandom;
+                    }
+                }
+                bench_read = true;
+            }
+            break;
         case 'b':
             {
                 // std::string rp(optarg);
@@ -199,6 +223,15 @@ int main(int argc, char* argv[]) {
         }
 
         printContent(buf.data(), buf.size(), true);
+    } else if (bench_read) {
+        vpc::Vpc v(file);
+        if (v.parse()) {
+            return -1;
+        }
+
+        v.setIoEngine(io_engine, access_hint);
+        return libvdk::bench::read_benchmark(v.diskSize(), vpc::kSectorBytesShift,
+            [&v](uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) { return v.read(sector_num, nb_sectors, buf); });
     } else if (read_bat_bitmap) {
         vpc::Vpc v(file);
         if (v.parse()) {
@@ -286,4 +319,4 @@ void printContent(const uint8_t *buf, size_t len, bool show_ascii) {
             printf("\n");            
         }
     }
-}
\ No newline at end of file
+}
@@ -22,6 +22,9 @@ const char kW2ku[5] = "W2ku";
  * the start of the VHD epoch. */
 #define VHD_EPOCH_START 946684800
 
+// first prefetch of a sequential stream, doubled on each following one
+const uint32_t kInitialReadaheadBytes = 128 * 1024;
+
 struct SectorInfo {
     uint32_t bat_idx;       /* BAT entry index */
     uint32_t sectors_avail; /* sectors available in payload block */
@@ -50,18 +53,18 @@ int Vpc::createVdkFile(const std::string& file, const std::string& parent_file,
     uint64_t total_sectors = 0UL;
     uint32_t max_bat_entries = 0, bat_table_offset = 0;
     uint64_t footer_data_offset = 0xFFFFFFFFFFFFFFFFUL;
+    uint64_t write_offset = 0UL;
     libvdk::convert::Utf8ToUnicodeWrapper pr_path_wrapper, pa_path_wrapper;
-    int fd = -1;
+    std::unique_ptr<libvdk::storage::Storage> storage;
     Footer f;    
     Header h;
     std::vector<uint8_t> parent_path_buf, bat_buf;
 
     // create file first, to make initParentLocatorContent happy
-    fd = libvdk::file::create_file(file.c_str());
-    if (fd <= 0) {
-        CONSLOG("create file: %s failed", file.c_str());
-        ret = -1;
-        goto end;
+    ret = libvdk::storage::create_storage(file, &storage);
+    if (ret) {
+        CONSLOG("create file: %s failed - %d", file.c_str(), ret);
+        return ret;
     }
 
     if (size_in_bytes != 0) {
@@ -98,7 +101,7 @@ int Vpc::createVdkFile(const std::string& file, const std::string& parent_file,
             int path_err;
             std::string pa_path, pr_path;            
             if (parent_absolute_path.empty()) {
-                pa_path = libvdk::file::absolute_path(parent_file, &path_err);
+                pa_path = libvdk::storage::absolute_path(parent_file, &path_err);
                 if (path_err) {
                     CONSLOG("get parent file: %s absolute path failed - %d", parent_file.c_str(), path_err);
                     ret = path_err;
@@ -111,7 +114,7 @@ int Vpc::createVdkFile(const std::string& file, const std::string& parent_file,
             assert(pa_path_wrapper.str());
 
             if (parent_relative_path.empty()) {
-                pr_path = libvdk::file::relative_path_to(file, parent_file, &path_err);
+                pr_path = libvdk::storage::relative_path_to(file, parent_file, &path_err);
                 if (path_err) {
                     CONSLOG("get parent file: %s relative path failed - %d", parent_file.c_str(), path_err);
                     ret = path_err;
@@ -171,77 +174,68 @@ int Vpc::createVdkFile(const std::string& file, const std::string& parent_file,
     f.checksum = calcChecksum(&f, sizeof(f));           
     footerOut(&f);
 
-    ret = libvdk::file::seek_file(fd, 0, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to file start failed");
-        goto end;
-    }    
-
     if (disk_type != VpcDiskType::kFixed) {
-        ret = libvdk::file::write_file(fd, &f, sizeof(Footer));
+        ret = storage->write(write_offset, &f, sizeof(Footer));
         if (ret) {
             CONSLOG("write footer failed");
             goto end;
         }
+        write_offset += sizeof(Footer);
 
-        ret = libvdk::file::write_file(fd, &h, sizeof(Header));
+        ret = storage->write(write_offset, &h, sizeof(Header));
         if (ret) {
             CONSLOG("write header failed");
             goto end;
         }
-
+        write_offset += sizeof(Header);
 
         if (pr_path_wrapper.str()) {
             parent_path_buf.resize(kSectorSize, 0);
             memcpy(parent_path_buf.data(), pr_path_wrapper.str(), pr_path_wrapper.len());
 
-            ret = libvdk::file::write_file(fd, parent_path_buf.data(), parent_path_buf.size());
+            ret = storage->write(write_offset, parent_path_buf.data(), parent_path_buf.size());
             if (ret) {
                 CONSLOG("write parent relative path failed");
                 goto end;
             }
+            write_offset += parent_path_buf.size();
         }
         if (pa_path_wrapper.str()) {
             parent_path_buf.resize(kSectorSize, 0);
             memcpy(parent_path_buf.data(), pa_path_wrapper.str(), pa_path_wrapper.len());
 
-            ret = libvdk::file::write_file(fd, parent_path_buf.data(), parent_path_buf.size());
+            ret = storage->write(write_offset, parent_path_buf.data(), parent_path_buf.size());
             if (ret) {
                 CONSLOG("write parent absolute path failed");
                 goto end;
             }
+            write_offset += parent_path_buf.size();
         }
 
         // write bat
         uint64_t max_bat_entry_bytes = libvdk::convert::roundUp(max_bat_entries << 2, 512);
         bat_buf.resize(max_bat_entry_bytes, 0xFF);        
 
-        ret = writeBatTable(fd, bat_table_offset, bat_buf.data(), bat_buf.size());
+        ret = writeBatTable(storage.get(), bat_table_offset, bat_buf.data(), bat_buf.size());
         if (ret) {
             goto end;
         }
+        write_offset = bat_table_offset + bat_buf.size();
     } else {
-        ret = libvdk::file::seek_file(fd, round_disk_size, SEEK_CUR);
-
-        if (ret) {
-            CONSLOG("seek file: %s to offset: %" PRIu64 " failed - %d", file.c_str(), round_disk_size, ret);
-            goto end;
-        }
+        write_offset = round_disk_size;
     }
 
-    ret = libvdk::file::write_file(fd, &f, sizeof(Footer));
+    ret = storage->write(write_offset, &f, sizeof(Footer));
     if (ret) {
         CONSLOG("write last footer failed");
         goto end;
     }
 
 end:
-    if (fd > 0) {
-        libvdk::file::close_file(fd);
-    }
+    storage.reset();
 
     if (ret) {
-        libvdk::file::delete_file(file);
+        libvdk::storage::delete_storage(file);
     }
 
     return ret;  
@@ -283,7 +277,7 @@ int Vpc::emptyDisk(const std::string& file) {
     max_bat_entry_bytes = libvdk::convert::roundUp(v.maxBatTableEntries() << 2, 512);
     bat_buf.resize(max_bat_entry_bytes, 0xFF);        
 
-    ret = writeBatTable(v.fd(), v.batTableOffset(), bat_buf.data(), bat_buf.size());
+    ret = writeBatTable(v.storage(), v.batTableOffset(), bat_buf.data(), bat_buf.size());
     if (ret) {
         CONSLOG("write bat table failed");
         goto end;
@@ -291,14 +285,14 @@ int Vpc::emptyDisk(const std::string& file) {
 
     memcpy(footer_buf, &v.footer(), sizeof(Footer));
     footerOut(reinterpret_cast<Footer *>(footer_buf));
-    ret = libvdk::file::write_file(v.fd(), footer_buf, sizeof(Footer));
+    ret = v.storage()->write(v.batTableOffset() + max_bat_entry_bytes, footer_buf, sizeof(Footer));
     if (ret) {
         CONSLOG("write footer failed");
         goto end;
     }
 
     new_file_size = v.batTableOffset() + max_bat_entry_bytes + sizeof(Footer);
-    ret = libvdk::file::truncate_file(v.fd(), new_file_size);
+    ret = v.storage()->truncate(new_file_size);
     if (ret) {
         CONSLOG("truncate file failed");
         goto end;
@@ -310,41 +304,56 @@ end:
 }
 
 Vpc::Vpc()
-    : fd_(-1),
+    : read_only_(true),
+      direct_io_(false),
       bat_entries_(nullptr),
       sectors_per_block_(0),
-      rewriter_footer_(false) {
+      rewriter_footer_(false),
+      growth_blocks_(kDefaultGrowthBlocks),
+      io_engine_(libvdk::file::IoEngine::kSync),
+      access_hint_(libvdk::file::AccessHint::kNormal),
+      readahead_(kInitialReadaheadBytes, kDefaultReadaheadBytes),
+      bitmap_cache_(kDefaultBitmapCacheBytes / kBitmapSize, libvdk::storage::PageCache::Reader(), kBitmapSize),
+      shared_cache_(false),
+      cache_key_() {
     memset(&footer_, 0, sizeof(footer_));
     memset(&header_, 0, sizeof(header_));
+    setupBitmapCache();
 }
 
-Vpc::Vpc(const std::string& file, bool read_only/*=true*/)
-    : fd_(-1),
+Vpc::Vpc(const std::string& file, bool read_only/*=true*/, bool direct_io/*=false*/)
+    : read_only_(true),
+      direct_io_(false),
       bat_entries_(nullptr),
       sectors_per_block_(0),
-      rewriter_footer_(false) {
+      rewriter_footer_(false),
+      growth_blocks_(kDefaultGrowthBlocks),
+      io_engine_(libvdk::file::IoEngine::kSync),
+      access_hint_(libvdk::file::AccessHint::kNormal),
+      readahead_(kInitialReadaheadBytes, kDefaultReadaheadBytes),
+      bitmap_cache_(kDefaultBitmapCacheBytes / kBitmapSize, libvdk::storage::PageCache::Reader(), kBitmapSize),
+      shared_cache_(false),
+      cache_key_() {
     memset(&footer_, 0, sizeof(footer_));
     memset(&header_, 0, sizeof(header_));
+    setupBitmapCache();
 
-    load(file, read_only);
+    load(file, read_only, direct_io);
 }
 
 Vpc::~Vpc() {
     unload();
 }
 
-int Vpc::load(const std::string& file, bool read_only/*=true*/) {
+int Vpc::load(const std::string& file, bool read_only/*=true*/, bool direct_io/*=false*/) {
     int ret = 0;
 
-    if (fd_ <= 0) {
+    if (!storage_) {
         file_ = file;
-        if (read_only) {
-            fd_ = libvdk::file::open_file_ro(file.c_str());        
-        } else {
-            fd_ = libvdk::file::open_file_rw(file.c_str());        
-        }
-
-        if (fd_ <= 0) {
+        read_only_ = read_only;
+        direct_io_ = direct_io;
+        ret = libvdk::storage::open_storage(file, read_only, direct_io, &storage_);
+        if (ret) {
             ret = -1;
             CONSLOG("open file: %s for %s failed", 
                 file.c_str(), (read_only ? "RO" : "RW"));
@@ -356,18 +365,33 @@ int Vpc::load(const std::string& file, bool read_only/*=true*/) {
 
 void Vpc::unload() {
     int ret = 0;
+    int64_t file_size = 0;
+    if (storage_ && !read_only_) {
+        ret = bitmap_cache_.flush();
+        if (ret) {
+            CONSLOG("write back bitmaps of file: %s failed - %d", file_.c_str(), ret);
+        }
+    }
+    bitmap_cache_.clear();
+
     if (rewriter_footer_) {
         rewriter_footer_ = false;
 
-        ret = libvdk::file::seek_file(fd_, 0, SEEK_END);
+        /* the footer goes right after the last block, not after the preallocated space */
+        ret = tail_allocator_.trim(storage_.get());
         if (ret) {
-            CONSLOG("seek to end file failed");
+            CONSLOG("trim file: %s to length: %" PRIu64 " failed - %d", file_.c_str(), tail_allocator_.tail(), ret);
+        }
+
+        ret = storage_->getSize(&file_size);
+        if (ret) {
+            CONSLOG("get file size failed");
             goto end;
         }
 
         footerOut(&footer_);
 
-        ret = libvdk::file::write_file(fd_, &footer_, sizeof(Footer));
+        ret = storage_->write(file_size, &footer_, sizeof(Footer));
         if (ret) {
             CONSLOG("write end file footer failed");
             goto end;
@@ -385,18 +409,21 @@ end:
     parent_absolute_path_.clear();
     parent_relative_path_.clear();
     parents_.clear();
-
-    if (fd_ > 0) {
-        libvdk::file::close_file(fd_);
-        fd_ = -1;
-    }
+    chain_map_.reset(0);
+    parent_blocks_.reset(0);
+    io_batch_.reset();
+    mapping_.reset();
+    shared_cache_ = false;
+    tail_allocator_.reset();
+
+    storage_.reset();
     file_.clear();
 }
 
 int Vpc::parse(bool build_parent_list/*=true*/) {
     int ret = 0;
     uint32_t checksum = 0, calc_chksum = 0;
-    if (fd_ <= 0) {
+    if (!storage_) {
         CONSLOG("file: %s not load", file_.c_str());
         return -1;
     }
@@ -408,12 +435,12 @@ int Vpc::parse(bool build_parent_list/*=true*/) {
         
     int64_t footer_offset = 0;
     bool footer_ok = false;
-    ret = libvdk::file::get_file_sizes(fd_, &footer_offset);
+    ret = storage_->getSize(&footer_offset);
     if (ret) {
         CONSLOG("get file size failed, read copy footer");        
     } else {
         footer_offset = footer_offset - sizeof(Footer);
-        ret = readFooter(fd_, footer_offset, reinterpret_cast<uint8_t*>(&footer_));
+        ret = readFooter(storage_.get(), footer_offset, reinterpret_cast<uint8_t*>(&footer_));
         if (ret) {
             CONSLOG("read footer failed, try copy footer");
             footer_offset = 0;
@@ -426,7 +453,7 @@ int Vpc::parse(bool build_parent_list/*=true*/) {
     }
 
     if (!footer_ok) {
-        ret = readFooter(fd_, footer_offset, reinterpret_cast<uint8_t*>(&footer_));
+        ret = readFooter(storage_.get(), footer_offset, reinterpret_cast<uint8_t*>(&footer_));
         if (ret) {
             CONSLOG("read copy footer failed");
             goto end;
@@ -452,13 +479,7 @@ int Vpc::parse(bool build_parent_list/*=true*/) {
         
 
     if (diskType() != VpcDiskType::kFixed) {
-        ret = libvdk::file::seek_file(fd_, footer_.data_offset, SEEK_SET);
-        if (ret) {
-            CONSLOG("seek to file: %s header failed", file_.c_str());
-            goto end;
-        }
-
-        ret = libvdk::file::read_file(fd_, &header_, sizeof(Header));
+        ret = storage_->read(footer_.data_offset, &header_, sizeof(Header));
         if (ret) {
             CONSLOG("read file: %s header failed", file_.c_str());
             goto end;
@@ -493,13 +514,7 @@ int Vpc::parse(bool build_parent_list/*=true*/) {
                     data_len = ple->Platform_data_length;
                     std::vector<uint8_t> ple_data_buf(data_len+sizeof(wchar_t), 0);                    
 
-                    int ple_ret = libvdk::file::seek_file(fd_, data_offset, SEEK_SET);
-                    if (ple_ret) {
-                        CONSLOG("seek to file: %s platform locator data with index: %d failed", file_.c_str(), i);
-                        continue;
-                    }
-
-                    ple_ret = libvdk::file::read_file(fd_, ple_data_buf.data(), data_len);
+                    int ple_ret = storage_->read(data_offset, ple_data_buf.data(), data_len);
                     if (ple_ret) {
                         CONSLOG("read file: %s platform locator data with index: %d failed", file_.c_str(), i);
                         continue;
@@ -532,7 +547,7 @@ int Vpc::parse(bool build_parent_list/*=true*/) {
         uint64_t max_table_entry_bytes = header_.max_table_entries << 2;
         bat_buf_.resize(max_table_entry_bytes, 0);
 
-        ret = readBatTable(fd_, header_.table_offset, bat_buf_.data(), max_table_entry_bytes);
+        ret = readBatTable(storage_.get(), header_.table_offset, bat_buf_.data(), max_table_entry_bytes);
         if (ret) {
             CONSLOG("read bat table failed");
             goto end;
@@ -542,6 +557,8 @@ int Vpc::parse(bool build_parent_list/*=true*/) {
         for (uint32_t i=0; i<header_.max_table_entries; ++i) {
             libvdk::byteorder::swap32(&bat_entries_[i]);
         }
+
+        buildChainMap();
     }
 
 end:
@@ -549,14 +566,117 @@ end:
 }
 
 int Vpc::read(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
-    return readRecursion(-1, sector_num, nb_sectors, buf);
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = static_cast<size_t>(nb_sectors) << kSectorBytesShift;
+
+    return readv(sector_num, nb_sectors, &iov, 1);
 }
 
-int Vpc::readRecursion(int32_t parent_index, uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
+int Vpc::readv(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt) {
+    if (libvdk::iov::total_size(iov, iovcnt) < (static_cast<size_t>(nb_sectors) << kSectorBytesShift)) {
+        CONSLOG("iovec is too small for %u sectors", nb_sectors);
+        return -EINVAL;
+    }
+
+    if (io_engine_ == libvdk::file::IoEngine::kUring && !io_batch_) {
+        setupIoBatch();
+    }
+
+    int ret = readRecursion(-1, sector_num, nb_sectors, iov, iovcnt);
+    if (io_batch_) {
+        /* always wait, queued reads still point into the caller's buffers */
+        int wait_ret = io_batch_->wait();
+        if (ret == 0) {
+            ret = wait_ret;
+        }
+    }
+
+    /* O_DIRECT bypasses the page cache, there is nothing to read ahead into */
+    if (ret == 0 && !direct_io_) {
+        uint64_t ra_start, ra_len;
+        if (readahead_.update(sector_num << kSectorBytesShift, 
+                static_cast<uint64_t>(nb_sectors) << kSectorBytesShift, &ra_start, &ra_len)) {
+            uint64_t total_sectors = diskSize() >> kSectorBytesShift;
+            uint64_t ra_sector = ra_start >> kSectorBytesShift;
+            uint64_t ra_end = std::min(total_sectors, (ra_start + ra_len + kSectorSize - 1) >> kSectorBytesShift);
+            if (ra_sector < ra_end) {
+                prefetchRecursion(-1, ra_sector, ra_end - ra_sector);
+            }
+        }
+    }
+
+    return ret;
+}
+
+void Vpc::setIoEngine(libvdk::file::IoEngine engine, libvdk::file::AccessHint hint) {
+    bool changed = (engine != io_engine_ || hint != access_hint_);
+    if (changed || (engine == libvdk::file::IoEngine::kMmap && !mapping_)) {
+        io_engine_ = engine;
+        access_hint_ = hint;
+
+        mapping_.reset();
+        /* a writable image grows under the mapping, only read only layers are mapped */
+        if (engine == libvdk::file::IoEngine::kMmap && read_only_ && fd() >= 0) {
+            mapping_.reset(new libvdk::file::MappedFile());
+            int ret = mapping_->map(fd());
+            if (ret) {
+                CONSLOG("mmap file: %s failed - %d, use sync io", file_.c_str(), ret);
+                mapping_.reset();
+            } else {
+                mapping_->advise(hint);
+            }
+        }
+    }
+
+    /* shared parents keep the engine they were opened with, other chains read through them.
+     * The chain is opened again under the new engine, the old parents go with the last user */
+    if (changed && !parents_.empty()) {
+        parents_.clear();
+        io_batch_.reset();
+        if (buildParentList()) {
+            CONSLOG("open parents of file: %s with the new io engine failed", file_.c_str());
+        }
+        buildChainMap();
+    }
+}
+
+int Vpc::setupIoBatch() {
+    std::vector<int> fds;
+
+    io_batch_.reset(new libvdk::file::IoBatch());
+    if (!io_batch_->async()) {
+        CONSLOG("io_uring is not available, use sync io");
+        return 0;
+    }
+
+    /* layers not backed by a file are read through their storage */
+    if (fd() >= 0) {
+        fds.push_back(fd());
+    }
+    for (const auto& parent : parents_) {
+        if (parent->fd() >= 0) {
+            fds.push_back(parent->fd());
+        }
+    }
+
+    int ret = io_batch_->registerFiles(fds);
+    if (ret) {
+        /* not fatal, requests use the plain fd */
+        CONSLOG("register files failed - %d", ret);
+    }
+
+    return 0;
+}
+
+int Vpc::readRecursion(int32_t parent_index, uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt) {
     int ret = -ENOTSUP;
     SectorInfo si;
     uint64_t bitmap_offset;
+    // bytes of iov already done
+    size_t iov_offset = 0;
     std::vector<uint8_t> bitmap_buf(kBitmapSize, 0);
+    std::vector<libvdk::bitmap::Run> runs;
     Vpc* current = nullptr;
 
     if (!parents_.empty() && parent_index >= static_cast<int32_t>(parents_.size())) {
@@ -570,6 +690,20 @@ int Vpc::readRecursion(int32_t parent_index, uint64_t sector_num, uint32_t nb_se
     }
 
     while (nb_sectors > 0) {
+        if (parent_index == -1 && !chain_map_.empty()) {
+            uint32_t owned_sectors = 0;
+            ret = readOwnedBlock(sector_num, nb_sectors, iov, iovcnt, iov_offset, &owned_sectors);
+            if (ret) {
+                goto exit;
+            }
+            if (owned_sectors > 0) {
+                sector_num += owned_sectors;
+                nb_sectors -= owned_sectors;
+                iov_offset += static_cast<size_t>(owned_sectors) << kSectorBytesShift;
+                continue;
+            }
+        }
+
         current->blockTranslate(sector_num, nb_sectors, &si);
 
         if (current->diskType() != VpcDiskType::kFixed) {
@@ -578,143 +712,54 @@ int Vpc::readRecursion(int32_t parent_index, uint64_t sector_num, uint32_t nb_se
             if (bentry != kBatEntryUnused) {
                 bitmap_offset = static_cast<uint64_t>(bentry) << kSectorBytesShift;
                 
-                ret = readBitmap(current->fd(), bitmap_offset, bitmap_buf.data(), kBitmapSize);
+                ret = current->readLayerBitmap(bitmap_offset, bitmap_buf.data(), kBitmapSize);
                 if (ret) {
                     CONSLOG("sector num: %" PRIu64 ", bat table[%u]: %u, read bitmap failed",
                         sector_num, si.bat_idx, bentry);
                     goto exit;
                 }                
 
-                uint8_t* p;
-                uint8_t* tmp_buf;
                 uint32_t secs = sector_num % kSectorsPerBitmap;
-                uint32_t avail_sectors = 0, unavail_sectors = 0;
-                uint64_t partially_sector_num = sector_num;                
-
-                p = bitmap_buf.data();                
-                tmp_buf = buf;
-                for (uint32_t i=0; i<si.sectors_avail; ++i) {
-                    if (testBit(p, secs+i)) {
-                        if (unavail_sectors > 0) {
-                            uint32_t unavail_bytes = unavail_sectors << kSectorBytesShift;
-
-                            if (current->diskType() == VpcDiskType::kDifferencing) {                                
-                                // read from parent
-                                uint64_t parent_sector_num = partially_sector_num;
-                                uint32_t parent_nb_sectors = unavail_sectors;
-                                int v_idx = parent_index + 1;
 
-#ifdef RW_DEBUG
-                                CONSLOG("read recursion, idx:%d, sector_num: %" PRIu64 ", sectors: %u", 
-                                    v_idx, parent_sector_num, parent_nb_sectors);
-#endif                                
-                                ret = readRecursion(v_idx, parent_sector_num, parent_nb_sectors, tmp_buf);
-                                if (ret) {
-                                    CONSLOG("recursion read sector: %" PRIu64 " , sectors: %u with parents index: %d failed",
-                                            parent_sector_num, parent_nb_sectors, v_idx);
-                                    goto exit;
-                                }                                
-                            } else {
-                                memset(tmp_buf, 0, unavail_bytes);
-                            }
-
-                            partially_sector_num += unavail_sectors;
-                            tmp_buf += unavail_bytes;
-
-                            unavail_sectors = 0;                                                      
-                        }
+                runs.clear();
+                libvdk::bitmap::runs(bitmap_buf.data(), secs, si.sectors_avail, &runs);
+                for (const auto& run : runs) {
+                    uint64_t partially_sector_num = sector_num + (run.start - secs);
+                    size_t tmp_offset = iov_offset + (static_cast<size_t>(run.start - secs) << kSectorBytesShift);
 
-                        ++avail_sectors;
-                    } else {
-                        if (avail_sectors > 0) {
-                            uint32_t avail_bytes = avail_sectors << kSectorBytesShift;
-
-                            uint64_t avail_offset = si.file_offset + ((partially_sector_num - sector_num) << kSectorBytesShift);
+                    if (run.set) {
+                        uint32_t avail_bytes = run.count << kSectorBytesShift;
+                        uint64_t avail_offset = si.file_offset + ((partially_sector_num - sector_num) << kSectorBytesShift);
 
 #ifdef RW_DEBUG
-                            CONSLOG("read in diff, idx:%d, sector_num: %" PRIu64 ", sectors: %u", 
-                                parent_index, partially_sector_num, avail_sectors);
-#endif                                
-
-                            ret = readPayloadData(current->fd(), avail_offset, tmp_buf, avail_bytes);
-                            if (ret) {
-                                CONSLOG("read payload failed");
-                                goto exit;
-                            }
-                            // ret = libvdk::file::seek_file(current->fd(), avail_offset, SEEK_SET);
-                            // if (ret) {
-                            //     CONSLOG("seek to %" PRIu64 " failed", avail_offset);
-                            //     goto exit;
-                            // }
-                            
-                            // ret = libvdk::file::read_file(current->fd(), tmp_buf, avail_bytes);
-                            // if (ret) {
-                            //     CONSLOG("read from offset %" PRIu64 " with length %u failed", si.file_offset, avail_bytes);
-                            //     goto exit;
-                            // }
-
-                            partially_sector_num += avail_sectors;
-                            tmp_buf += avail_bytes;
-
-                            avail_sectors = 0;                            
+                        CONSLOG("read in diff, idx:%d, sector_num: %" PRIu64 ", sectors: %u", 
+                            parent_index, partially_sector_num, run.count);
+#endif
+                        ret = current->readLayerPayload(avail_offset, iov, iovcnt, tmp_offset, avail_bytes, io_batch_.get());
+                        if (ret) {
+                            CONSLOG("read payload failed");
+                            goto exit;
                         }
-                        
-                        ++unavail_sectors;
-                    }
-                }
-
-                if (avail_sectors > 0) {
-                    uint32_t avail_bytes = avail_sectors << kSectorBytesShift;
-
-                    uint64_t avail_offset = si.file_offset + ((partially_sector_num - sector_num) << kSectorBytesShift);
-
-#ifdef RW_DEBUG
-                    CONSLOG("read in diff, idx:%d, sector_num: %" PRIu64 ", sectors: %u", 
-                        parent_index, partially_sector_num, avail_sectors);
-#endif                        
-
-                    ret = readPayloadData(current->fd(), avail_offset, tmp_buf, avail_bytes);
-                    if (ret) {
-                        CONSLOG("read payload failed");
-                        goto exit;
-                    }
-
-                    partially_sector_num += avail_sectors;
-                    tmp_buf += avail_bytes;
-
-                    avail_sectors = 0; 
-                } else if (unavail_sectors > 0) {
-                    uint32_t unavail_bytes = unavail_sectors << kSectorBytesShift;
-
-                    if (current->diskType() == VpcDiskType::kDifferencing) {                                
+                    } else if (current->diskType() == VpcDiskType::kDifferencing) {
                         // read from parent
-                        uint64_t parent_sector_num = partially_sector_num;
-                        uint32_t parent_nb_sectors = unavail_sectors;
                         int v_idx = parent_index + 1;
 
 #ifdef RW_DEBUG
                         CONSLOG("read recursion, idx:%d, sector_num: %" PRIu64 ", sectors: %u", 
-                            v_idx, parent_sector_num, parent_nb_sectors);
-#endif                                
-                        ret = readRecursion(v_idx, parent_sector_num, parent_nb_sectors, tmp_buf);
+                            v_idx, partially_sector_num, run.count);
+#endif
+                        ret = readParent(v_idx, partially_sector_num, run.count, iov, iovcnt, tmp_offset);
                         if (ret) {
                             CONSLOG("recursion read sector: %" PRIu64 " , sectors: %u with parents index: %d failed",
-                                    parent_sector_num, parent_nb_sectors, v_idx);
+                                    partially_sector_num, run.count, v_idx);
                             goto exit;
-                        }                                
+                        }
                     } else {
-                        memset(tmp_buf, 0, unavail_bytes);
+                        libvdk::iov::fill(iov, iovcnt, tmp_offset, 0, static_cast<size_t>(run.count) << kSectorBytesShift);
                     }
-
-                    partially_sector_num += unavail_sectors;
-                    tmp_buf += unavail_bytes;
-
-                    unavail_sectors = 0;
-                } else {
-                    assert(false);
                 }
             } else if (current->diskType() == VpcDiskType::kDifferencing) {
-                ret = readRecursion(parent_index+1, sector_num, nb_sectors, buf);
+                ret = readParent(parent_index+1, sector_num, si.sectors_avail, iov, iovcnt, iov_offset);
                 if (ret) {
                     goto exit;
                 }
@@ -722,11 +767,11 @@ int Vpc::readRecursion(int32_t parent_index, uint64_t sector_num, uint32_t nb_se
 #ifdef RW_DEBUG                
                 CONSLOG("Dynamic file: %s, block is not allocated at bat index: %u", current->file().c_str(), si.bat_idx);
 #endif                
-                memset(buf, 0, si.bytes_avail);
+                libvdk::iov::fill(iov, iovcnt, iov_offset, 0, si.bytes_avail);
             }
         } else {
             // read block data
-            ret = readPayloadData(current->fd(), si.file_offset, buf, si.bytes_avail);
+            ret = current->readLayerPayload(si.file_offset, iov, iovcnt, iov_offset, si.bytes_avail, io_batch_.get());
             if (ret) {
                 CONSLOG("read fixed payload failed");
                 goto exit;
@@ -735,7 +780,7 @@ int Vpc::readRecursion(int32_t parent_index, uint64_t sector_num, uint32_t nb_se
 
         sector_num += si.sectors_avail;
         nb_sectors -= si.sectors_avail;
-        buf += si.bytes_avail;
+        iov_offset += si.bytes_avail;
     }
 
     ret = 0;
@@ -743,12 +788,403 @@ exit:
     return ret;
 }
 
+void Vpc::setReadahead(uint32_t max_bytes) {
+    readahead_.setWindow(kInitialReadaheadBytes, max_bytes);
+}
+
+void Vpc::prefetchLayer(uint64_t offset, uint32_t len) {
+    if (mapping_) {
+        mapping_->prefetch(offset, len);
+    } else {
+        storage_->prefetch(offset, len);
+    }
+}
+
+void Vpc::prefetchRecursion(int32_t parent_index, uint64_t sector_num, uint32_t nb_sectors) {
+    SectorInfo si;
+    std::vector<uint8_t> bitmap_buf(kBitmapSize, 0);
+    Vpc* current = nullptr;
+
+    if (parents_.empty() ? parent_index >= 0 : parent_index >= static_cast<int32_t>(parents_.size())) {
+        return;
+    }
+
+    if (parent_index == -1) {
+        current = this;
+    } else {
+        current = parents_[parent_index].get();
+    }
+
+    while (nb_sectors > 0) {
+        current->blockTranslate(sector_num, nb_sectors, &si);
+
+        if (current->diskType() == VpcDiskType::kFixed) {
+            current->prefetchLayer(si.file_offset, si.bytes_avail);
+        } else {
+            BatEntry bentry = current->batTable()[si.bat_idx];
+            bool from_parent = (current->diskType() == VpcDiskType::kDifferencing);
+            if (bentry != kBatEntryUnused) {
+                current->prefetchLayer(si.file_offset, si.bytes_avail);
+
+                /* prefetch never blocks on a read: a cached bitmap tells whether the parent is used,
+                 * an uncached one is only hinted for the coming read and the parent is hinted too */
+                uint64_t bitmap_offset = static_cast<uint64_t>(bentry) << kSectorBytesShift;
+                if (from_parent && current->peekLayerBitmap(bitmap_offset, bitmap_buf.data(), kBitmapSize)) {
+                    uint32_t secs = sector_num % kSectorsPerBitmap;
+                    bool set = false;
+                    uint32_t n = libvdk::bitmap::run_length(bitmap_buf.data(), secs, secs + si.sectors_avail, &set);
+                    from_parent = !(set && n == si.sectors_avail);
+                } else if (from_parent) {
+                    current->prefetchLayer(bitmap_offset, kBitmapSize);
+                }
+            }
+
+            if (from_parent) {
+                prefetchRecursion(parent_index+1, sector_num, si.sectors_avail);
+            }
+        }
+
+        sector_num += si.sectors_avail;
+        nb_sectors -= si.sectors_avail;
+    }
+}
+
+void Vpc::buildChainMap() {
+    chain_map_.reset(0);
+    parent_blocks_.reset(0);
+    if (parents_.empty() || parents_.size() >= libvdk::storage::ChainMap::kMaxLayers) {
+        return;
+    }
+    /* a parent of another block size maps one block to several */
+    for (const auto& parent : parents_) {
+        if (parent->diskType() != VpcDiskType::kFixed && parent->sectors_per_block_ != sectors_per_block_) {
+            return;
+        }
+    }
+
+    /* entries are resolved on first read */
+    chain_map_.reset(header_.max_table_entries);
+    parent_blocks_.reset(header_.max_table_entries);
+}
+
+int Vpc::isParentAlreadyAllocBlock(uint32_t block, bool* allocated) {
+    using libvdk::storage::ParentBlockSet;
+
+    ParentBlockSet::State state = parent_blocks_.get(block);
+    if (state != ParentBlockSet::State::kUnknown) {
+        *allocated = (state == ParentBlockSet::State::kAllocated);
+        return 0;
+    }
+
+    uint8_t bitmap[kBitmapSize];
+    *allocated = false;
+    for (size_t i = 0; i < parents_.size() && !*allocated; ++i) {
+        Vpc* parent = parents_[i].get();
+        if (parent->diskType() == VpcDiskType::kFixed) {
+            *allocated = true;
+            break;
+        }
+
+        BatEntry bentry = parent->batTable()[block];
+        if (bentry == kBatEntryUnused) {
+            continue;
+        }
+        int ret = parent->readLayerBitmap(static_cast<uint64_t>(bentry) << kSectorBytesShift, bitmap, kBitmapSize);
+        if (ret) {
+            return ret;
+        }
+        bool set = false;
+        *allocated = (libvdk::bitmap::run_length(bitmap, 0, sectors_per_block_, &set) < sectors_per_block_ || set);
+    }
+
+    parent_blocks_.set(block, *allocated ? ParentBlockSet::State::kAllocated : ParentBlockSet::State::kUnallocated);
+    return 0;
+}
+
+int Vpc::resolveOwner(uint32_t block, uint64_t* owner) {
+    using libvdk::storage::ParentBlockSet;
+
+    uint8_t bitmap[kBitmapSize];
+
+    for (size_t i = 0; i <= parents_.size(); ++i) {
+        if (i == 1 && parent_blocks_.get(block) == ParentBlockSet::State::kUnallocated) {
+            break;
+        }
+
+        Vpc* layer = (i == 0 ? this : parents_[i-1].get());
+        if (layer->diskType() == VpcDiskType::kFixed) {
+            parent_blocks_.set(block, ParentBlockSet::State::kAllocated);
+            *owner = libvdk::storage::ChainMap::owned(i, static_cast<uint64_t>(block) * sectors_per_block_ << kSectorBytesShift);
+            return 0;
+        }
+
+        BatEntry bentry = layer->batTable()[block];
+        if (bentry != kBatEntryUnused) {
+            /* the block is owned by a layer only if every sector of it is present there */
+            uint64_t bitmap_offset = static_cast<uint64_t>(bentry) << kSectorBytesShift;
+            int ret = layer->readLayerBitmap(bitmap_offset, bitmap, kBitmapSize);
+            if (ret) {
+                return ret;
+            }
+
+            bool set = false;
+            bool full = (libvdk::bitmap::run_length(bitmap, 0, sectors_per_block_, &set) == sectors_per_block_);
+            if (set || !full) {
+                full = full && set;
+                if (i > 0) {
+                    parent_blocks_.set(block, ParentBlockSet::State::kAllocated);
+                }
+                *owner = (full ? libvdk::storage::ChainMap::owned(i, static_cast<uint64_t>(bentry + 1) << kSectorBytesShift) :
+                        libvdk::storage::ChainMap::kPartial);
+                return 0;
+            }
+        }
+
+        if (layer->diskType() != VpcDiskType::kDifferencing) {
+            break;
+        }
+    }
+
+    parent_blocks_.set(block, ParentBlockSet::State::kUnallocated);
+    *owner = libvdk::storage::ChainMap::kAbsent;
+    return 0;
+}
+
+int Vpc::readOwnedBlock(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt, size_t iov_offset,
+        uint32_t* sectors) {
+    using libvdk::storage::ChainMap;
+
+    uint32_t block = sector_num / sectors_per_block_;
+    uint32_t block_offset = sector_num % sectors_per_block_;
+    uint32_t avail = sectors_per_block_ - block_offset;
+    if (avail > nb_sectors) {
+        avail = nb_sectors;
+    }
+
+    *sectors = 0;
+    uint64_t owner = chain_map_.get(block);
+    if (owner == ChainMap::kUnknown) {
+        int ret = resolveOwner(block, &owner);
+        if (ret) {
+            return ret;
+        }
+        chain_map_.set(block, owner);
+    }
+
+    if (owner == ChainMap::kPartial) {
+        return 0;
+    }
+
+    if (owner == ChainMap::kAbsent) {
+        libvdk::iov::fill(iov, iovcnt, iov_offset, 0, static_cast<size_t>(avail) << kSectorBytesShift);
+    } else {
+        uint32_t layer = ChainMap::layerOf(owner);
+        Vpc* current = (layer == 0 ? this : parents_[layer-1].get());
+        uint64_t offset = ChainMap::offsetOf(owner) + (static_cast<uint64_t>(block_offset) << kSectorBytesShift);
+        int ret = current->readLayerPayload(offset, iov, iovcnt, iov_offset, static_cast<size_t>(avail) << kSectorBytesShift,
+                io_batch_.get());
+        if (ret) {
+            return ret;
+        }
+    }
+
+    *sectors = avail;
+    return 0;
+}
+
+int Vpc::openParent(const std::string& path, const libvdk::guid::GUID& unique_id, std::shared_ptr<Vpc>* parent) {
+    using Registry = libvdk::storage::LayerRegistry<Vpc>;
+
+    int err = 0;
+    std::string canonical_path = libvdk::storage::absolute_path(path, &err);
+    if (err) {
+        CONSLOG("get absolute path of parent file: %s failed - %d", path.c_str(), err);
+        return -1;
+    }
+
+    std::string key = Registry::key(canonical_path, libvdk::guid::toWinString(&unique_id), direct_io_, io_engine_, access_hint_);
+    *parent = Registry::instance().find(key);
+    if (*parent) {
+        return 0;
+    }
+
+    /* the chain below the parent is held by the top image only */
+    std::shared_ptr<Vpc> layer = std::make_shared<Vpc>(path, true, direct_io_);
+    if (layer->parse(false)) {
+        CONSLOG("parse parent file: %s failed", path.c_str());
+        return -1;
+    }
+    
+    if (layer->uniqueId() != unique_id) {
+        CONSLOG("parent linkage mismatch[%s|%s]", 
+            libvdk::guid::toWinString(&layer->uniqueId()).c_str(),
+            libvdk::guid::toWinString(&unique_id).c_str());
+        return -1;
+    }
+
+    /* parents are never written while children use them, their data can be shared process wide */
+    layer->shared_cache_ = (libvdk::storage::BlockCache::fileKey(layer->fd(), &layer->cache_key_) == 0);
+    layer->setIoEngine(io_engine_, access_hint_);
+
+    *parent = Registry::instance().add(key, layer);
+    return 0;
+}
+
+int Vpc::loadLayerBitmap(uint64_t offset, uint8_t* bm_buf, size_t len) {
+    if (mapping_) {
+        int ret = mapping_->read(offset, bm_buf, len);
+        if (ret) {
+            CONSLOG("read bitmap failed");
+        }
+        return ret;
+    }
+
+    return readBitmap(storage_.get(), offset, bm_buf, len);
+}
+
+void Vpc::setupBitmapCache() {
+    bitmap_cache_.setReader([this](uint64_t offset, void* buf, size_t len) {
+        return loadLayerBitmap(offset, static_cast<uint8_t*>(buf), len);
+    });
+    bitmap_cache_.setWriter([this](uint64_t offset, const void* buf, size_t len) {
+        return writeBitmap(storage_.get(), offset, static_cast<const uint8_t*>(buf), len);
+    });
+}
+
+int Vpc::readLayerBitmap(uint64_t offset, uint8_t* bm_buf, size_t len) {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    uint8_t* bitmap = nullptr;
+    int ret = bitmap_cache_.get(offset, kBitmapSize, &bitmap);
+    if (ret == 0) {
+        memcpy(bm_buf, bitmap, std::min<size_t>(len, kBitmapSize));
+    }
+    return ret;
+}
+
+bool Vpc::peekLayerBitmap(uint64_t offset, uint8_t* bm_buf, size_t len) {
+    /* the holder may be loading a bitmap from the file, do not wait for it */
+    std::unique_lock<std::mutex> lock(cache_mutex_, std::try_to_lock);
+    uint8_t* bitmap = nullptr;
+    if (!lock.owns_lock() || !bitmap_cache_.lookup(offset, &bitmap)) {
+        return false;
+    }
+    memcpy(bm_buf, bitmap, std::min<size_t>(len, kBitmapSize));
+    return true;
+}
+
+int Vpc::flush() {
+    int ret = bitmap_cache_.flush();
+    if (ret) {
+        CONSLOG("write back bitmaps of file: %s failed - %d", file_.c_str(), ret);
+        return ret;
+    }
+
+    return storage_->flush();
+}
+
+void Vpc::setBitmapCacheBytes(uint64_t bytes) {
+    int ret = 0;
+    std::unique_lock<std::mutex> lock(cache_mutex_);
+    if (bytes / kBitmapSize < bitmap_cache_.dirtyPages()) {
+        /* shrinking below the dirty count would leave pages nobody can evict */
+        ret = bitmap_cache_.flush();
+    }
+    if (ret == 0) {
+        bitmap_cache_.setMaxPages(bytes / kBitmapSize);
+    }
+    lock.unlock();
+
+    for (auto& parent : parents_) {
+        parent->setBitmapCacheBytes(bytes);
+    }
+}
+
+int Vpc::readLayerPayload(uint64_t offset, const struct iovec* iov, int iovcnt, size_t iov_offset, size_t len,
+        libvdk::file::IoBatch* batch) {
+    if (mapping_) {
+        std::vector<struct iovec> pld_iov;
+        int ret = libvdk::iov::slice(iov, iovcnt, iov_offset, len, &pld_iov);
+        if (ret == 0) {
+            ret = mapping_->readv(offset, pld_iov.data(), pld_iov.size());
+        }
+        if (ret) {
+            CONSLOG("read payload data failed");
+        }
+        return ret;
+    }
+
+    if (shared_cache_ && libvdk::storage::BlockCache::instance().enabled()) {
+        std::vector<struct iovec> pld_iov;
+        libvdk::storage::Storage* storage = storage_.get();
+        int ret = libvdk::iov::slice(iov, iovcnt, iov_offset, len, &pld_iov);
+        if (ret == 0) {
+            ret = libvdk::storage::BlockCache::instance().readv(cache_key_, offset, pld_iov.data(), pld_iov.size(),
+                [storage](uint64_t off, const struct iovec* v, int n) { return storage->readv(off, v, n); });
+        }
+        if (ret) {
+            CONSLOG("read payload data failed");
+        }
+        return ret;
+    }
+
+    return readPayloadData(storage_.get(), offset, iov, iovcnt, iov_offset, len, batch);
+}
+
+int Vpc::readParent(int32_t parent_index, uint64_t sector_num, uint32_t nb_sectors, 
+        const struct iovec* iov, int iovcnt, size_t iov_offset) {
+    int ret = 0;
+    if (parent_index == 0 && !chain_map_.empty()) {
+        /* the sectors lie in one block, no parent holding it means zeros without walking the chain */
+        bool allocated = true;
+        ret = isParentAlreadyAllocBlock(sector_num / sectors_per_block_, &allocated);
+        if (ret == 0 && !allocated) {
+            libvdk::iov::fill(iov, iovcnt, iov_offset, 0, static_cast<size_t>(nb_sectors) << kSectorBytesShift);
+            return 0;
+        }
+    }
+
+    std::vector<struct iovec> parent_iov;
+    ret = libvdk::iov::slice(iov, iovcnt, iov_offset, 
+            static_cast<size_t>(nb_sectors) << kSectorBytesShift, &parent_iov);
+    if (ret == 0) {
+        ret = readRecursion(parent_index, sector_num, nb_sectors, parent_iov.data(), parent_iov.size());
+    }
+    if (ret) {
+        CONSLOG("recursion read sector: %" PRIu64 " , sectors: %u with parents index: %d failed",
+                sector_num, nb_sectors, parent_index);
+    }
+
+    return ret;
+}
+
 int Vpc::write(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = static_cast<size_t>(nb_sectors) << kSectorBytesShift;
+
+    return writev(sector_num, nb_sectors, &iov, 1);
+}
+
+int Vpc::writev(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt) {
     int ret = -ENOTSUP;
     SectorInfo si;
     uint64_t bitmap_offset;
     BatEntry old_bentry, bentry;
-    std::vector<uint8_t> bitmap_buf(kBitmapSize, 0);    
+    uint8_t* bitmap = nullptr;
+    bool block_full = false;
+    bool new_block = false;
+    // bytes of iov already done
+    size_t iov_offset = 0;
+
+    if (libvdk::iov::total_size(iov, iovcnt) < (static_cast<size_t>(nb_sectors) << kSectorBytesShift)) {
+        CONSLOG("iovec is too small for %u sectors", nb_sectors);
+        return -EINVAL;
+    }
+
+    /* the blocks written may change owner, they are resolved again on next read */
+    if (!chain_map_.empty() && nb_sectors > 0) {
+        chain_map_.invalidate(sector_num / sectors_per_block_, (sector_num + nb_sectors - 1) / sectors_per_block_);
+    }
 
     while (nb_sectors > 0) {
         blockTranslate(sector_num, nb_sectors, &si);
@@ -763,15 +1199,20 @@ int Vpc::write(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
                 }
                 
                 bitmap_offset = si.file_offset;
-                memset(bitmap_buf.data(), 0, kBitmapSize);
+                /* the space may hold the old end footer, the bitmap starts from zero without a read */
+                ret = bitmap_cache_.insert(bitmap_offset, &bitmap);
+                if (ret) {
+                    goto exit;
+                }
 
                 bentry = bitmap_offset >> kSectorBytesShift;
                 bat_entries_[si.bat_idx] = bentry;
+                new_block = true;
                 si.file_offset += kBitmapSize + si.block_offset;
             } else {
                 bitmap_offset = static_cast<uint64_t>(bentry) << kSectorBytesShift;
 
-                ret = readBitmap(fd_, bitmap_offset, bitmap_buf.data(), kBitmapSize);
+                ret = bitmap_cache_.get(bitmap_offset, kBitmapSize, &bitmap);
                 if (ret) {
                     goto exit;
                 }                
@@ -782,49 +1223,48 @@ int Vpc::write(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
                 sector_num, si.bat_idx, bentry, bitmap_offset);
 #endif            
             
-            { // set bitmap
-                uint8_t* p = bitmap_buf.data();
-                uint32_t secs = sector_num % kSectorsPerBitmap;
-                for (uint64_t i = 0; i < si.sectors_avail; ++i) {
-                    setBit(p, secs + i);
-                }                
-            }            
-
             // write block data
-            ret = writePayloadData(fd_, si.file_offset, buf, si.bytes_avail);
+            ret = writePayloadData(storage_.get(), si.file_offset, iov, iovcnt, iov_offset, si.bytes_avail);
             if (ret) {
                 CONSLOG("write payload data failed");
                 goto exit;
             }                        
 
-            // write bitmap
-            ret = writeBitmap(fd_, bitmap_offset, bitmap_buf.data(), kBitmapSize);
-            if (ret) {
-                CONSLOG("write bitmap failed");
-                goto exit;
-            }
+            /* the cached bitmap is shared with readers, its bits are set once the data is there */
+            block_full = libvdk::bitmap::set_range(bitmap, sector_num % kSectorsPerBitmap, si.sectors_avail, sectors_per_block_);
+
+            if (old_bentry == bentry) {
+                /* written back in batches by flush(), unload() or once too many are dirty */
+                bitmap_cache_.markDirty(bitmap_offset);
+            } else {
+                /* a new block: its bitmap is on disk before the bat entry points to it */
+                ret = writeBitmap(storage_.get(), bitmap_offset, bitmap, kBitmapSize);
+                if (ret) {
+                    CONSLOG("write bitmap failed");
+                    goto exit;
+                }
 
-            if (old_bentry != bentry) {
                 // write bat entry 
                 uint64_t bat_entry_offset = header_.table_offset + (si.bat_idx << 2);                
 
                 libvdk::byteorder::swap32(&bentry);
 
-                ret = libvdk::file::seek_file(fd_, bat_entry_offset, SEEK_SET);
-                if (ret) {
-                    CONSLOG("seek to bat entry offset: %" PRIu64 " failed", bat_entry_offset);
-                    goto exit;
-                }
-                
-                ret = libvdk::file::write_file(fd_, &bentry, sizeof(BatEntry));
+                ret = storage_->write(bat_entry_offset, &bentry, sizeof(BatEntry));
                 if (ret) {
                     CONSLOG("write bat entry to offset %" PRIu64 " failed", bat_entry_offset);
                     goto exit;
                 }
             }
+
+            if (block_full && !chain_map_.empty()) {
+                /* every sector is in this layer now, reads of the block skip the bitmap and the parents */
+                chain_map_.set(si.bat_idx, libvdk::storage::ChainMap::owned(0, 
+                    static_cast<uint64_t>(bat_entries_[si.bat_idx] + 1) << kSectorBytesShift));
+            }
+            new_block = false;
         } else {
             // write block data
-            ret = writePayloadData(fd_, si.file_offset, buf, si.bytes_avail);
+            ret = writePayloadData(storage_.get(), si.file_offset, iov, iovcnt, iov_offset, si.bytes_avail);
             if (ret) {
                 CONSLOG("write payload data failed");
                 goto exit;
@@ -833,36 +1273,41 @@ int Vpc::write(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf) {
 
         sector_num += si.sectors_avail;
         nb_sectors -= si.sectors_avail;
-        buf += si.bytes_avail;
+        iov_offset += si.bytes_avail;
+    }
+
+    if (bitmap_cache_.dirtyPages() >= kMaxDirtyBitmaps) {
+        ret = bitmap_cache_.flush();
     }
     
 exit:
+    if (ret && new_block) {
+        /* the new block is not on disk, the file keeps the space but nothing points to it */
+        libvdk::bitmap::clear_range(bitmap, sector_num % kSectorsPerBitmap, si.sectors_avail);
+        bat_entries_[si.bat_idx] = old_bentry;
+    }
     return ret;
 }
 
 int Vpc::allocateNewBlock(uint64_t* new_offset) {
     int ret;
-    uint64_t current_len, new_file_size;
 
-    ret = libvdk::file::get_file_sizes(fd_, reinterpret_cast<int64_t *>(&current_len));
-    if (ret) {
-        return ret;
-    }    
-
-    if (rewriter_footer_) {
-        *new_offset = current_len;        
-    } else {
-        *new_offset = current_len - sizeof(Footer);
+    if (!tail_allocator_.loaded()) {
+        /* the first new block takes the place of the end footer, it is written back on unload */
+        ret = tail_allocator_.load(storage_.get(), rewriter_footer_ ? 0 : sizeof(Footer));
+        if (ret) {
+            return ret;
+        }
     }
 
-    *new_offset = libvdk::convert::roundUp(*new_offset, 512);        
-
+    /* the tail is kept in memory and the file grows growth_blocks_ blocks at a time with
+     * fallocate, the block gets contiguous extents up front.
+     * The bitmap is always written by the caller, the data reads as zero */
     // bitmap(512 bytes) + block(2M)
-    new_file_size = *new_offset + kBitmapSize + kBlockSize;
-
-    ret = libvdk::file::truncate_file(fd_, new_file_size);
+    tail_allocator_.setChunkBytes(static_cast<uint64_t>(growth_blocks_) * (kBitmapSize + kBlockSize));
+    ret = tail_allocator_.allocate(storage_.get(), kSectorSize, kBitmapSize + kBlockSize, false, new_offset);
     if (ret) {
-        CONSLOG("truncate file: %s to size: %" PRIu64 " failed - %d", file_.c_str(), new_file_size, ret);
+        CONSLOG("allocate new block in file: %s failed - %d", file_.c_str(), ret);
     }
 
     if (!rewriter_footer_) {
@@ -895,13 +1340,7 @@ int Vpc::modifyParentLocator(const std::string& pa_path, const std::string& pr_p
                 std::vector<uint8_t> buf(data_space, 0);
                 memcpy(buf.data(), w.str(), w.len());
 
-                ret = libvdk::file::seek_file(fd_, data_offset, SEEK_SET);
-                if (ret) {
-                    CONSLOG("seek to file: %s platform locator data failed", file_.c_str());
-                    goto end;
-                }
-
-                ret = libvdk::file::write_file(fd_, buf.data(), buf.size());
+                ret = storage_->write(data_offset, buf.data(), buf.size());
                 if (ret) {
                     CONSLOG("write file: %s platform locator data failed", file_.c_str());
                     goto end;
@@ -918,13 +1357,7 @@ int Vpc::modifyParentLocator(const std::string& pa_path, const std::string& pr_p
     header_.checksum = calcChecksum(&header_, sizeof(Header));
     headerOut(&header_);
 
-    ret = libvdk::file::seek_file(fd_, sizeof(Footer), SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to file: %s header failed", file_.c_str());
-        goto end;
-    }
-
-    ret = libvdk::file::write_file(fd_, &header_, sizeof(Header));
+    ret = storage_->write(sizeof(Footer), &header_, sizeof(Header));
     if (ret) {
         CONSLOG("write file: %s header failed", file_.c_str());
         goto end;
@@ -942,9 +1375,9 @@ int Vpc::buildParentList() {
             std::string pa_path = current->parentAbsolutePath();
             std::string pr_path = current->parentRelativePath();
             std::string parent_path;
-            if (libvdk::file::exist_file(pa_path) == 0) {
+            if (libvdk::storage::exist_storage(pa_path) == 0) {
                 parent_path = pa_path;
-            } else if (libvdk::file::exist_file(pr_path) == 0) {
+            } else if (libvdk::storage::exist_storage(pr_path) == 0) {
                 parent_path = pr_path;
             }
             if (parent_path.empty()) {
@@ -954,28 +1387,18 @@ int Vpc::buildParentList() {
                 break;
             }
 
-            Vpc* parent = new Vpc(parent_path);
-            if (parent->parse()) {
-                CONSLOG("parse parent file: %s failed", parent_path.c_str());
-                ret = -1;
-                break;
-            }
-            
-            if (parent->uniqueId() != current->parentUniqueId()) {
-                CONSLOG("parent linkage mismatch[%s|%s]", 
-                    libvdk::guid::toWinString(&parent->uniqueId()).c_str(),
-                    libvdk::guid::toWinString(&current->parentUniqueId()).c_str());
-                ret = -1;
+            std::shared_ptr<Vpc> parent;
+            ret = openParent(parent_path, current->parentUniqueId(), &parent);
+            if (ret) {
                 break;
             }
-
-            parents_.emplace_back(parent);
+            parents_.push_back(parent);
 
             if (parent->diskType() != VpcDiskType::kDifferencing) {
                 break;
             }
 
-            current = parent;
+            current = parent.get();
         };
     }
 
@@ -1043,72 +1466,33 @@ void Vpc::blockTranslate(uint64_t sector_num, uint32_t nb_sectors, SectorInfo* s
     }
 }
 
-int Vpc::readBatTable(int fd, uint64_t offset, uint8_t* bt_buf, size_t len) {
-    int ret = libvdk::file::seek_file(fd, offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to bat table offset: %" PRIu64 " failed", offset);
-        return ret;
-    }
-    ret = libvdk::file::read_file(fd, bt_buf, len);
+int Vpc::readBatTable(libvdk::storage::Storage* storage, uint64_t offset, uint8_t* bt_buf, size_t len) {
+    int ret = storage->read(offset, bt_buf, len);
     if (ret) {
         CONSLOG("read from bat table offset: %" PRIu64 " failed", offset);
     }
     return ret;
 }
 
-int Vpc::writeBatTable(int fd, uint64_t offset, const uint8_t* bt_buf, size_t len) {
-    int ret = 0;
-    size_t write_bytes_left = len;
-    const uint8_t *p = bt_buf;
-
-    ret = libvdk::file::seek_file(fd, offset, SEEK_SET);
+int Vpc::writeBatTable(libvdk::storage::Storage* storage, uint64_t offset, const uint8_t* bt_buf, size_t len) {
+    int ret = storage->write(offset, bt_buf, len);
     if (ret) {
-        CONSLOG("seek to bat table offset: %" PRIu64 " failed", offset);
-        return ret;
-    }
-
-    while (write_bytes_left > 0) {
-        size_t write_bytes = 0;
-        if (write_bytes_left >= 4 * libvdk::kKiB) {
-            write_bytes = 4 * libvdk::kKiB;
-        } else {
-            write_bytes = write_bytes_left;
-        }
-
-        ret = libvdk::file::write_file(fd, p, write_bytes);
-        if (ret) {
-            CONSLOG("write bat table failed - %d", ret);
-            break;
-        }
-
-        p += write_bytes;
-        write_bytes_left -= write_bytes;
+        CONSLOG("write bat table failed - %d", ret);
     }
 
     return ret;
 }
 
-int Vpc::readBitmap(int fd, uint64_t offset, uint8_t* bm_buf, size_t len) {
-    int ret = libvdk::file::seek_file(fd, offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to bitmap offset: %" PRIu64 " failed", offset);
-        return ret;
-    }
-    ret = libvdk::file::read_file(fd, bm_buf, len);
+int Vpc::readBitmap(libvdk::storage::Storage* storage, uint64_t offset, uint8_t* bm_buf, size_t len) {
+    int ret = storage->read(offset, bm_buf, len);
     if (ret) {
         CONSLOG("read from bitmap offset: %" PRIu64 " failed", offset);        
     }
     return ret;
 }
 
-int Vpc::writeBitmap(int fd, uint64_t offset, const uint8_t* bm_buf, size_t len) {
-    int ret = libvdk::file::seek_file(fd, offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to bitmap offset: %" PRIu64 " failed", offset);
-        return ret;
-    }
-    
-    ret = libvdk::file::write_file(fd, bm_buf, len);
+int Vpc::writeBitmap(libvdk::storage::Storage* storage, uint64_t offset, const uint8_t* bm_buf, size_t len) {
+    int ret = storage->write(offset, bm_buf, len);
     if (ret) {
         CONSLOG("write to bitmap offset %" PRIu64 " with length %lu failed", offset, len);
     }
@@ -1116,27 +1500,29 @@ int Vpc::writeBitmap(int fd, uint64_t offset, const uint8_t* bm_buf, size_t len)
     return ret;
 }
 
-int Vpc::readPayloadData(int fd, uint64_t offset, uint8_t* pld_buf, size_t len) {
-    int ret = libvdk::file::seek_file(fd, offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to payload data offset: %" PRIu64 " failed", offset);
-        return ret;
+int Vpc::readPayloadData(libvdk::storage::Storage* storage, uint64_t offset, const struct iovec* iov, int iovcnt, size_t iov_offset, size_t len,
+        libvdk::file::IoBatch* batch) {
+    std::vector<struct iovec> pld_iov;
+    int ret = libvdk::iov::slice(iov, iovcnt, iov_offset, len, &pld_iov);
+    if (ret == 0) {
+        if (batch && storage->fd() >= 0) {
+            ret = batch->readv(storage->fd(), offset, pld_iov.data(), pld_iov.size());
+        } else {
+            ret = storage->readv(offset, pld_iov.data(), pld_iov.size());
+        }
     }
-    ret = libvdk::file::read_file(fd, pld_buf, len);
     if (ret) {
         CONSLOG("read from payload data offset: %" PRIu64 " failed", offset);        
     }
     return ret;
 }
 
-int Vpc::writePayloadData(int fd, uint64_t offset, const uint8_t* pld_buf, size_t len) {
-    int ret = libvdk::file::seek_file(fd, offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to payload data offset: %" PRIu64 " failed", offset);
-        return ret;
+int Vpc::writePayloadData(libvdk::storage::Storage* storage, uint64_t offset, const struct iovec* iov, int iovcnt, size_t iov_offset, size_t len) {
+    std::vector<struct iovec> pld_iov;
+    int ret = libvdk::iov::slice(iov, iovcnt, iov_offset, len, &pld_iov);
+    if (ret == 0) {
+        ret = storage->writev(offset, pld_iov.data(), pld_iov.size());
     }
-    
-    ret = libvdk::file::write_file(fd, pld_buf, len);
     if (ret) {
         CONSLOG("write to payload data offset %" PRIu64 " with length %lu failed", offset, len);
     }
@@ -1144,26 +1530,16 @@ int Vpc::writePayloadData(int fd, uint64_t offset, const uint8_t* pld_buf, size_
     return ret;
 }
 
-int Vpc::readFooter(int fd, uint64_t offset, uint8_t* f_buf) {
-    int ret = libvdk::file::seek_file(fd, offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to footer offset: %" PRIu64 " failed", offset);
-        return ret;
-    }
-    ret = libvdk::file::read_file(fd, f_buf, sizeof(Footer));
+int Vpc::readFooter(libvdk::storage::Storage* storage, uint64_t offset, uint8_t* f_buf) {
+    int ret = storage->read(offset, f_buf, sizeof(Footer));
     if (ret) {
         CONSLOG("read from footer offset: %" PRIu64 " failed", offset);        
     }
     return ret;
 }
 
-int Vpc::writeFooter(int fd, uint64_t offset, const uint8_t* f_buf) {
-    int ret = libvdk::file::seek_file(fd, offset, SEEK_SET);
-    if (ret) {
-        CONSLOG("seek to footer offset: %" PRIu64 " failed", offset);
-        return ret;
-    }
-    ret = libvdk::file::write_file(fd, f_buf, sizeof(Footer));
+int Vpc::writeFooter(libvdk::storage::Storage* storage, uint64_t offset, const uint8_t* f_buf) {
+    int ret = storage->write(offset, f_buf, sizeof(Footer));
     if (ret) {
         CONSLOG("write to footer offset: %" PRIu64 " failed", offset);        
     }
@@ -1322,7 +1698,7 @@ int Vpc::readBatEntryBitmap(uint64_t sector_num, BatEntry* bentry, uint8_t* buf)
     if (*bentry != kBatEntryUnused) {
         uint64_t offset = static_cast<uint64_t>(*bentry) << kSectorBytesShift;
 
-        ret = readBitmap(fd_, offset, buf, sizeof(kBitmapSize));        
+        ret = readLayerBitmap(offset, buf, kBitmapSize);
     }
 
     return ret;
@@ -98,6 +98,15 @@ struct SectorInfo;
 
 class Vpc {
 public:
+    // new blocks are preallocated this many at a time, the unused tail is trimmed on unload
+    static const uint32_t kDefaultGrowthBlocks = 16;
+    // sequential readers get up to this much prefetched ahead of them
+    static const uint32_t kDefaultReadaheadBytes = 4 * 1024 * 1024;
+    // block bitmaps kept in memory, changed bitmaps of existing blocks are written back later
+    static const uint32_t kDefaultBitmapCacheBytes = 1024 * 1024;
+    // writev() writes the dirty bitmaps back once this many have piled up
+    static const uint32_t kMaxDirtyBitmaps = 256;
+
     static int createFixed(const std::string& file, uint64_t size_in_bytes);    
     static int createDynamic(const std::string& file, uint64_t size_in_bytes);
     static int createDifferencing(const std::string& file, const std::string& parent_file, 
@@ -106,13 +115,14 @@ public:
     static int emptyDisk(const std::string& file);
 
     Vpc();
-    explicit Vpc(const std::string& file, bool read_only=true);
+    // direct_io: open with O_DIRECT, parents found by buildParentList are opened the same way
+    explicit Vpc(const std::string& file, bool read_only=true, bool direct_io=false);
     ~Vpc();
 
     Vpc(const Vpc& rhs) = delete;
     Vpc& operator=(const Vpc& rhs) = delete;
 
-    int load(const std::string& file, bool read_only=true);
+    int load(const std::string& file, bool read_only=true, bool direct_io=false);
     int parse(bool build_parent_list=true);
     void unload();
 
@@ -120,15 +130,41 @@ public:
 
     int read(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf);
     int write(uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf);
+    // scatter-gather version, iov must hold at least nb_sectors of 512 bytes
+    int readv(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt);
+    int writev(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt);
 
     const std::string& file() const {
         return file_;
     }
 
+    libvdk::storage::Storage* storage() {
+        return storage_.get();
+    }
+    // -1 if the storage is not a file
     int fd() const {
-        return fd_;
+        return (storage_ ? storage_->fd() : -1);
     }    
 
+    // kUring: data reads of one readv() across the whole parent chain go in one io_uring batch
+    // kMmap: read only layers of the chain are mapped, payload and bitmap reads are memcpy
+    // parents are opened again with the engine and hint, shared parents never change engine
+    void setIoEngine(libvdk::file::IoEngine engine, 
+            libvdk::file::AccessHint hint = libvdk::file::AccessHint::kNormal);
+
+    // 1: grow the file one block at a time
+    void setGrowthBlocks(uint32_t blocks) {
+        growth_blocks_ = (blocks == 0 ? 1 : blocks);
+    }
+
+    // 0: no readahead, direct io images never read ahead
+    void setReadahead(uint32_t max_bytes);
+
+    // passed on to the parents, at least one bitmap is kept
+    void setBitmapCacheBytes(uint64_t bytes);
+    // write the dirty bitmaps back and flush the file, unload() does the same
+    int flush();
+
     VpcDiskType diskType() const {
         return static_cast<VpcDiskType>(footer_.disk_type);
     }
@@ -233,21 +269,54 @@ private:
     }
 
     int buildParentList(); 
+    // parents are shared through libvdk::storage::LayerRegistry by every handle whose chain reaches them
+    int openParent(const std::string& path, const libvdk::guid::GUID& unique_id, std::shared_ptr<Vpc>* parent);
     void blockTranslate(uint64_t sector_num, uint32_t nb_sectors, SectorInfo* si); 
     int  allocateNewBlock(uint64_t* new_offset);
-    int  readRecursion(int32_t parent_index, uint64_t sector_num, uint32_t nb_sectors, uint8_t* buf);
-
-    static int  readBatTable(int fd, uint64_t offset, uint8_t* bt_buf, size_t len);
-    static int  writeBatTable(int fd, uint64_t offset, const uint8_t* bt_buf, size_t len);
-    static int  readBitmap(int fd, uint64_t offset, uint8_t* bm_buf, size_t len);
-    static int  writeBitmap(int fd, uint64_t offset, const uint8_t* bm_buf, size_t len);
-    static int  readPayloadData(int fd, uint64_t offset, uint8_t* pld_buf, size_t len);
-    static int  writePayloadData(int fd, uint64_t offset, const uint8_t* pld_buf, size_t len);
-    static int  readFooter(int fd, uint64_t offset, uint8_t* f_buf);
-    static int  writeFooter(int fd, uint64_t offset, const uint8_t* f_buf);
+    int  setupIoBatch();
+    void setupBitmapCache();
+    // bitmaps go through bitmap_cache_, a miss is loaded by loadLayerBitmap
+    int  readLayerBitmap(uint64_t offset, uint8_t* bm_buf, size_t len);
+    // copy the bitmap only if bitmap_cache_ holds it and is free, never reads the file or waits
+    bool peekLayerBitmap(uint64_t offset, uint8_t* bm_buf, size_t len);
+    // read from the mapping if there is one, a parent payload through the shared BlockCache if enabled,
+    // otherwise through storage_ (batch for payload if not null)
+    int  loadLayerBitmap(uint64_t offset, uint8_t* bm_buf, size_t len);
+    int  readLayerPayload(uint64_t offset, const struct iovec* iov, int iovcnt, size_t iov_offset, size_t len,
+            libvdk::file::IoBatch* batch);
+    // a block fully present in one layer of the chain is read straight from that layer,
+    // *sectors is 0 if the block needs the layer by layer walk
+    int  readOwnedBlock(uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt, size_t iov_offset,
+            uint32_t* sectors);
+    int  resolveOwner(uint32_t block, uint64_t* owner);
+    // any sector of the block present in a parent, the answer is kept in parent_blocks_
+    int  isParentAlreadyAllocBlock(uint32_t block, bool* allocated);
+    void buildChainMap();
+    int  readRecursion(int32_t parent_index, uint64_t sector_num, uint32_t nb_sectors, const struct iovec* iov, int iovcnt);
+    // read nb_sectors from parent into iov starting at byte iov_offset
+    int  readParent(int32_t parent_index, uint64_t sector_num, uint32_t nb_sectors, 
+            const struct iovec* iov, int iovcnt, size_t iov_offset);
+    // hint the layers holding the data of the sectors, the parent chain is resolved like readRecursion
+    // from cached bitmaps only, an uncached bitmap is hinted too and its parents are assumed needed
+    void prefetchRecursion(int32_t parent_index, uint64_t sector_num, uint32_t nb_sectors);
+    void prefetchLayer(uint64_t offset, uint32_t len);
+
+    static int  readBatTable(libvdk::storage::Storage* storage, uint64_t offset, uint8_t* bt_buf, size_t len);
+    static int  writeBatTable(libvdk::storage::Storage* storage, uint64_t offset, const uint8_t* bt_buf, size_t len);
+    static int  readBitmap(libvdk::storage::Storage* storage, uint64_t offset, uint8_t* bm_buf, size_t len);
+    static int  writeBitmap(libvdk::storage::Storage* storage, uint64_t offset, const uint8_t* bm_buf, size_t len);
+    // payload inside one block is contiguous in file, iov[iov_offset, iov_offset+len) goes in one preadv/pwritev
+    // queue the read into batch if not null, it is done when batch->wait() returns
+    static int  readPayloadData(libvdk::storage::Storage* storage, uint64_t offset, const struct iovec* iov, int iovcnt, size_t iov_offset, size_t len,
+            libvdk::file::IoBatch* batch);
+    static int  writePayloadData(libvdk::storage::Storage* storage, uint64_t offset, const struct iovec* iov, int iovcnt, size_t iov_offset, size_t len);
+    static int  readFooter(libvdk::storage::Storage* storage, uint64_t offset, uint8_t* f_buf);
+    static int  writeFooter(libvdk::storage::Storage* storage, uint64_t offset, const uint8_t* f_buf);
 
     std::string file_;
-    int fd_;
+    std::unique_ptr<libvdk::storage::Storage> storage_;
+    bool read_only_;
+    bool direct_io_;
 
     Footer footer_;
     Header header_;
@@ -258,11 +327,29 @@ private:
     uint32_t sectors_per_block_;
     // rewrite file end footer
     bool rewriter_footer_;
+    uint32_t growth_blocks_;
+    libvdk::storage::TailAllocator tail_allocator_;
 
     std::string parent_absolute_path_;
     std::string parent_relative_path_;
 
-    std::vector<std::unique_ptr<Vpc>> parents_;
+    std::vector<std::shared_ptr<Vpc>> parents_;
+    // owning layer of each virtual block, only for a chain of one block size
+    libvdk::storage::ChainMap chain_map_;
+    // by block, whether any parent holds the block
+    libvdk::storage::ParentBlockSet parent_blocks_;
+
+    libvdk::file::IoEngine io_engine_;
+    libvdk::file::AccessHint access_hint_;
+    std::unique_ptr<libvdk::file::IoBatch> io_batch_;
+    std::unique_ptr<libvdk::file::MappedFile> mapping_;
+    libvdk::file::StreamDetector readahead_;
+    libvdk::storage::PageCache bitmap_cache_;
+    // payload reads of a parent go through libvdk::storage::BlockCache when it is enabled
+    bool shared_cache_;
+    libvdk::storage::BlockCache::FileKey cache_key_;
+    // a shared parent is read by handles in other threads, guards the bitmap cache
+    std::mutex cache_mutex_;
 };
 
 }